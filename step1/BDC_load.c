@@ -0,0 +1,607 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <math.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+// ------------------------------------------------
+// Load generator for the block disk server
+// Every connection keeps up to queue_depth requests in flight.
+// Closed-loop: a new request is sent as soon as a slot is free.
+// Open-loop: requests arrive as a Poisson process of arrival_rate req/s in total,
+// and their latency is measured from the intended arrival time.
+// ------------------------------------------------
+#define DISTRIBUTION_UNIFORM 0
+#define DISTRIBUTION_SEQUENTIAL 1
+#define DISTRIBUTION_ZIPF 2
+#define BLOCK_SIZE 256
+
+struct Load_config {
+    char *server_address;
+    int port;
+    int concurrency;      // number of connections
+    int queue_depth;      // outstanding requests per connection
+    long request_num;     // total requests, -1 when the run is bounded by duration
+    double duration;      // seconds, 0 when the run is bounded by request_num
+    int read_ratio;       // percentage of reads
+    int distribution;     // sector distribution
+    double zipf_theta;    // skew of the zipfian distribution
+    double arrival_rate;  // req/s over all connections, 0 means closed-loop
+    int seed;
+    int cylinder_num;
+    int sector_num;
+};
+
+struct Pending_request {
+    char op;
+    long start_ns;
+};
+
+struct Connection {
+    struct Load_config *config;
+    int index;
+    int sockfd;
+    long request_num;  // requests of this connection, -1 when bounded by duration
+    long start_ns;
+    unsigned short rand_state[3];
+    // sector generator
+    long sequential_next;
+    double zipf_zetan;
+    double zipf_eta;
+    double zipf_alpha;
+    // results
+    long *latency;
+    long latency_num;
+    long latency_capacity;
+    long read_num;
+    long write_num;
+    long error_num;
+};
+
+// ------------------------------------------------
+// Print the usage and exit
+// ------------------------------------------------
+void usage(char *name) {
+    fprintf(stderr,
+            "Usage: %s <server_address> <port> [options]\n"
+            "  -c <num>     connections (default 1)\n"
+            "  -q <num>     queue depth per connection (default 1)\n"
+            "  -n <num>     total requests (default 1000)\n"
+            "  -t <sec>     run for a duration instead of a request count\n"
+            "  -r <pct>     percentage of reads (default 50)\n"
+            "  -d <dist>    uniform | sequential | zipf (default uniform)\n"
+            "  -z <theta>   zipf skew, 0 < theta < 1 (default 0.99)\n"
+            "  -a <rate>    open-loop arrival rate in req/s (default 0: closed-loop)\n"
+            "  -s <seed>    random seed (default 1)\n",
+            name);
+    exit(1);
+}
+
+// ------------------------------------------------
+// Parse the parameters
+// ------------------------------------------------
+void parse_parameters(int argc,
+                      char **argv,
+                      struct Load_config *config) {
+    if (argc < 3) {
+        usage(argv[0]);
+    }
+    config->server_address = argv[1];
+    config->port = atoi(argv[2]);
+    config->concurrency = 1;
+    config->queue_depth = 1;
+    config->request_num = 1000;
+    config->duration = 0;
+    config->read_ratio = 50;
+    config->distribution = DISTRIBUTION_UNIFORM;
+    config->zipf_theta = 0.99;
+    config->arrival_rate = 0;
+    config->seed = 1;
+
+    for (int i = 3; i < argc; i += 2) {
+        if (argv[i][0] != '-' || i + 1 >= argc) {
+            usage(argv[0]);
+        }
+        char *value = argv[i + 1];
+        switch (argv[i][1]) {
+            case 'c':
+                config->concurrency = atoi(value);
+                break;
+            case 'q':
+                config->queue_depth = atoi(value);
+                break;
+            case 'n':
+                config->request_num = atol(value);
+                config->duration = 0;
+                break;
+            case 't':
+                config->duration = atof(value);
+                config->request_num = -1;
+                break;
+            case 'r':
+                config->read_ratio = atoi(value);
+                break;
+            case 'd':
+                if (strcmp(value, "uniform") == 0) {
+                    config->distribution = DISTRIBUTION_UNIFORM;
+                } else if (strcmp(value, "sequential") == 0) {
+                    config->distribution = DISTRIBUTION_SEQUENTIAL;
+                } else if (strcmp(value, "zipf") == 0) {
+                    config->distribution = DISTRIBUTION_ZIPF;
+                } else {
+                    usage(argv[0]);
+                }
+                break;
+            case 'z':
+                config->zipf_theta = atof(value);
+                break;
+            case 'a':
+                config->arrival_rate = atof(value);
+                break;
+            case 's':
+                config->seed = atoi(value);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    // * Check the validity of the parameters
+    if (config->concurrency < 1 || config->queue_depth < 1 || config->queue_depth > 1024) {
+        fprintf(stderr, "Error: connections should be positive and queue depth in [1, 1024]\n");
+        exit(1);
+    }
+    if (config->request_num == 0 || (config->request_num < 0 && config->duration <= 0)) {
+        fprintf(stderr, "Error: the run needs a positive request count or duration\n");
+        exit(1);
+    }
+    if (config->read_ratio < 0 || config->read_ratio > 100) {
+        fprintf(stderr, "Error: the read percentage should be in [0, 100]\n");
+        exit(1);
+    }
+    if (config->zipf_theta <= 0 || config->zipf_theta >= 1) {
+        fprintf(stderr, "Error: the zipf theta should be in (0, 1)\n");
+        exit(1);
+    }
+    if (config->arrival_rate < 0) {
+        fprintf(stderr, "Error: the arrival rate should not be negative\n");
+        exit(1);
+    }
+}
+
+// ------------------------------------------------
+// Create a client
+// ------------------------------------------------
+void create_client(char *server_address,
+                   int port,
+                   int *sockfd) {
+    struct sockaddr_in server_addr;
+
+    // * Create a socket
+    *sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (*sockfd < 0) {
+        perror("socket");
+        exit(1);
+    }
+
+    // * Set the server address
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, server_address, &server_addr.sin_addr) <= 0) {
+        perror("inet_pton");
+        exit(1);
+    }
+
+    // * Connect to the server
+    if (connect(*sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+
+    // * Send every request immediately, Nagle's algorithm would add delayed-ACK stalls to the latencies
+    int flag = 1;
+    setsockopt(*sockfd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+}
+
+// ------------------------------------------------
+// Write the whole buffer to the server
+// ------------------------------------------------
+void write_all(int sockfd,
+               char *buffer,
+               int length) {
+    while (length > 0) {
+        int n = write(sockfd, buffer, length);
+        if (n < 0) {
+            perror("write");
+            exit(1);
+        }
+        buffer += n;
+        length -= n;
+    }
+}
+
+// ------------------------------------------------
+// Get the disk geometry with the I command
+// ------------------------------------------------
+void query_geometry(int sockfd,
+                    int *cylinder_num,
+                    int *sector_num) {
+    char buffer[1024];
+    int len = 0;
+    int newline_num = 0;
+    write_all(sockfd, "I\n", 2);
+    // the answer is two lines
+    while (newline_num < 2 && len < 1023) {
+        int n = read(sockfd, buffer + len, 1023 - len);
+        if (n <= 0) {
+            perror("read");
+            exit(1);
+        }
+        for (int i = len; i < len + n; i++) {
+            if (buffer[i] == '\n')
+                newline_num++;
+        }
+        len += n;
+    }
+    buffer[len] = '\0';
+    if (sscanf(buffer, "Cylinder number: %d\nSector number: %d\n", cylinder_num, sector_num) != 2) {
+        fprintf(stderr, "Error: cannot get the disk information\n");
+        exit(1);
+    }
+}
+
+// ------------------------------------------------
+// Monotonic time in nanoseconds
+// ------------------------------------------------
+long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// ------------------------------------------------
+// Initial the sector generator of a connection
+// The zipfian generator follows Gray et al., "Quickly generating billion-record synthetic databases"
+// ------------------------------------------------
+void init_sector_generator(struct Connection *connection) {
+    struct Load_config *config = connection->config;
+    long sector_total = (long)config->cylinder_num * config->sector_num;
+
+    // * sequential streams start evenly spread over the disk
+    connection->sequential_next = sector_total * connection->index / config->concurrency;
+
+    // * zipfian constants
+    double theta = config->zipf_theta;
+    double zeta2 = 1.0 + pow(0.5, theta);
+    connection->zipf_zetan = 0;
+    for (long i = 1; i <= sector_total; i++) {
+        connection->zipf_zetan += 1.0 / pow((double)i, theta);
+    }
+    connection->zipf_alpha = 1.0 / (1.0 - theta);
+    connection->zipf_eta = (1.0 - pow(2.0 / sector_total, 1.0 - theta)) / (1.0 - zeta2 / connection->zipf_zetan);
+}
+
+// ------------------------------------------------
+// Generate the next sector id
+// ------------------------------------------------
+long next_sector(struct Connection *connection) {
+    struct Load_config *config = connection->config;
+    long sector_total = (long)config->cylinder_num * config->sector_num;
+
+    if (config->distribution == DISTRIBUTION_SEQUENTIAL) {
+        long sector = connection->sequential_next;
+        connection->sequential_next = (connection->sequential_next + 1) % sector_total;
+        return sector;
+    }
+
+    if (config->distribution == DISTRIBUTION_ZIPF) {
+        double u = erand48(connection->rand_state);
+        double uz = u * connection->zipf_zetan;
+        long rank;
+        if (uz < 1.0) {
+            rank = 0;
+        } else if (uz < 1.0 + pow(0.5, config->zipf_theta)) {
+            rank = 1;
+        } else {
+            rank = (long)(sector_total * pow(connection->zipf_eta * u - connection->zipf_eta + 1.0, connection->zipf_alpha));
+        }
+        // scatter the hot ranks over the disk instead of packing them into cylinder 0
+        unsigned long hash = 14695981039346656037UL;
+        for (int i = 0; i < 8; i++) {
+            hash = (hash ^ ((rank >> (i * 8)) & 0xff)) * 1099511628211UL;
+        }
+        return hash % sector_total;
+    }
+
+    return (long)(erand48(connection->rand_state) * sector_total);
+}
+
+// ------------------------------------------------
+// Send one request, return the op
+// ------------------------------------------------
+char send_request(struct Connection *connection) {
+    struct Load_config *config = connection->config;
+    char buffer[1024];
+    long sector = next_sector(connection);
+    int c = sector / config->sector_num;
+    int s = sector % config->sector_num;
+    char op = erand48(connection->rand_state) * 100 < config->read_ratio ? 'R' : 'W';
+    int len;
+
+    if (op == 'R') {
+        len = sprintf(buffer, "R %d %d\n", c, s);
+    } else {
+        len = sprintf(buffer, "W %d %d %d ", c, s, BLOCK_SIZE);
+        for (int i = 0; i < BLOCK_SIZE; i++) {
+            buffer[len++] = 'a' + (int)(erand48(connection->rand_state) * 26);
+        }
+        buffer[len++] = '\n';
+    }
+    write_all(connection->sockfd, buffer, len);
+    return op;
+}
+
+// ------------------------------------------------
+// Record the latency of one finished request
+// ------------------------------------------------
+void record_latency(struct Connection *connection,
+                    long latency) {
+    if (connection->latency_num == connection->latency_capacity) {
+        connection->latency_capacity = connection->latency_capacity * 2 + 1024;
+        connection->latency = realloc(connection->latency, connection->latency_capacity * sizeof(long));
+        if (connection->latency == NULL) {
+            fprintf(stderr, "Error: failed to allocate memory for the latencies\n");
+            exit(1);
+        }
+    }
+    connection->latency[connection->latency_num++] = latency;
+}
+
+// ------------------------------------------------
+// Run one connection
+// ------------------------------------------------
+void *run_connection(void *arg) {
+    struct Connection *connection = (struct Connection *)arg;
+    struct Load_config *config = connection->config;
+    int queue_depth = config->queue_depth;
+    struct Pending_request pending[1024];
+    int pending_head = 0;
+    int pending_num = 0;
+    char response[8192];
+    int response_len = 0;
+    long issued = 0;
+    long deadline = connection->start_ns + (long)(config->duration * 1e9);
+    double rate = config->arrival_rate / config->concurrency;
+    long next_arrival = connection->start_ns;
+
+    while (1) {
+        long now = now_ns();
+        int stop_issuing = (connection->request_num >= 0 && issued >= connection->request_num) ||
+                           (config->duration > 0 && now >= deadline);
+
+        // * Issue requests while there are free slots
+        while (!stop_issuing && pending_num < queue_depth && (rate == 0 || next_arrival <= now)) {
+            int slot = (pending_head + pending_num) % queue_depth;
+            pending[slot].start_ns = rate == 0 ? now : next_arrival;
+            pending[slot].op = send_request(connection);
+            pending_num++;
+            issued++;
+            if (rate > 0) {
+                next_arrival += (long)(-log(1.0 - erand48(connection->rand_state)) / rate * 1e9);
+            }
+            stop_issuing = connection->request_num >= 0 && issued >= connection->request_num;
+        }
+        if (stop_issuing && pending_num == 0) {
+            break;
+        }
+
+        // * Wait for responses, or until the next open-loop arrival
+        struct pollfd pfd = {connection->sockfd, POLLIN, 0};
+        struct timespec timeout;
+        struct timespec *timeout_ptr = NULL;
+        if (rate > 0 && !stop_issuing && pending_num < queue_depth) {
+            long wait = next_arrival - now_ns();
+            if (wait < 0)
+                wait = 0;
+            timeout.tv_sec = wait / 1000000000L;
+            timeout.tv_nsec = wait % 1000000000L;
+            timeout_ptr = &timeout;
+        }
+        if (ppoll(&pfd, 1, timeout_ptr, NULL) <= 0) {
+            continue;
+        }
+        int n = read(connection->sockfd, response + response_len, sizeof(response) - response_len);
+        if (n <= 0) {
+            fprintf(stderr, "Error: the server closed the connection\n");
+            exit(1);
+        }
+        response_len += n;
+
+        // * Match complete responses with the oldest outstanding requests
+        int consumed = 0;
+        while (pending_num > 0) {
+            char *line = response + consumed;
+            char *newline = memchr(line, '\n', response_len - consumed);
+            if (newline == NULL) {
+                break;
+            }
+            int line_len = newline - line + 1;
+            struct Pending_request *request = &pending[pending_head];
+            int ok = strncmp(line, "Yes", 3) == 0;
+            int total_len = line_len + (ok && request->op == 'R' ? BLOCK_SIZE : 0);
+            if (response_len - consumed < total_len) {
+                break;
+            }
+            consumed += total_len;
+            record_latency(connection, now_ns() - request->start_ns);
+            if (!ok)
+                connection->error_num++;
+            else if (request->op == 'R')
+                connection->read_num++;
+            else
+                connection->write_num++;
+            pending_head = (pending_head + 1) % queue_depth;
+            pending_num--;
+        }
+        memmove(response, response + consumed, response_len - consumed);
+        response_len -= consumed;
+    }
+
+    write_all(connection->sockfd, "exit\n", 5);
+    close(connection->sockfd);
+    return NULL;
+}
+
+// ------------------------------------------------
+// Compare two latencies for qsort
+// ------------------------------------------------
+int compare_latency(const void *a,
+                    const void *b) {
+    long x = *(const long *)a;
+    long y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+// ------------------------------------------------
+// Get the p-th percentile from the sorted latencies
+// ------------------------------------------------
+long percentile(long *latency,
+                long latency_num,
+                double p) {
+    long rank = (long)ceil(p * latency_num) - 1;
+    if (rank < 0)
+        rank = 0;
+    if (rank >= latency_num)
+        rank = latency_num - 1;
+    return latency[rank];
+}
+
+// ------------------------------------------------
+// Merge the results and print the report
+// ------------------------------------------------
+void print_report(struct Load_config *config,
+                  struct Connection *connections,
+                  long elapsed_ns) {
+    long latency_num = 0;
+    long read_num = 0;
+    long write_num = 0;
+    long error_num = 0;
+    for (int i = 0; i < config->concurrency; i++) {
+        latency_num += connections[i].latency_num;
+        read_num += connections[i].read_num;
+        write_num += connections[i].write_num;
+        error_num += connections[i].error_num;
+    }
+    if (latency_num == 0) {
+        printf("No request finished\n");
+        return;
+    }
+
+    // * Merge all latencies and sort them
+    long *latency = malloc(latency_num * sizeof(long));
+    if (latency == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the latencies\n");
+        exit(1);
+    }
+    long k = 0;
+    double sum = 0;
+    for (int i = 0; i < config->concurrency; i++) {
+        for (long j = 0; j < connections[i].latency_num; j++) {
+            latency[k++] = connections[i].latency[j];
+            sum += connections[i].latency[j];
+        }
+    }
+    qsort(latency, latency_num, sizeof(long), compare_latency);
+
+    // * Print the report
+    char *distribution[] = {"uniform", "sequential", "zipf"};
+    double elapsed = elapsed_ns / 1e9;
+    printf("Disk: %d cylinders x %d sectors\n", config->cylinder_num, config->sector_num);
+    printf("Load: %d connections, queue depth %d, %d%% reads, %s sectors, ",
+           config->concurrency, config->queue_depth, config->read_ratio, distribution[config->distribution]);
+    if (config->arrival_rate > 0)
+        printf("open-loop %.0f req/s\n", config->arrival_rate);
+    else
+        printf("closed-loop\n");
+    printf("Requests: %ld (%ld reads, %ld writes, %ld errors)\n", latency_num, read_num, write_num, error_num);
+    printf("Elapsed: %.3f s\n", elapsed);
+    printf("Throughput: %.1f req/s, %.2f MiB/s\n",
+           latency_num / elapsed, (read_num + write_num) * (double)BLOCK_SIZE / elapsed / 1048576.0);
+    printf("Latency (us): mean %.1f, p50 %.1f, p99 %.1f, p999 %.1f, max %.1f\n",
+           sum / latency_num / 1e3,
+           percentile(latency, latency_num, 0.50) / 1e3,
+           percentile(latency, latency_num, 0.99) / 1e3,
+           percentile(latency, latency_num, 0.999) / 1e3,
+           latency[latency_num - 1] / 1e3);
+    free(latency);
+}
+
+// ------------------------------------------------
+// Main function
+// ------------------------------------------------
+int main(int argc, char **argv) {
+    struct Load_config config;
+
+    // * Parse the parameters
+    parse_parameters(argc, argv, &config);
+
+    // * Connect all clients before the clock starts
+    struct Connection *connections = calloc(config.concurrency, sizeof(struct Connection));
+    if (connections == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the connections\n");
+        exit(1);
+    }
+    for (int i = 0; i < config.concurrency; i++) {
+        create_client(config.server_address, config.port, &connections[i].sockfd);
+    }
+    query_geometry(connections[0].sockfd, &config.cylinder_num, &config.sector_num);
+
+    // * Split the requests over the connections
+    for (int i = 0; i < config.concurrency; i++) {
+        struct Connection *connection = &connections[i];
+        connection->config = &config;
+        connection->index = i;
+        connection->request_num = -1;
+        if (config.request_num > 0) {
+            connection->request_num = config.request_num / config.concurrency +
+                                      (i < config.request_num % config.concurrency ? 1 : 0);
+        }
+        connection->rand_state[0] = (unsigned short)config.seed;
+        connection->rand_state[1] = (unsigned short)i;
+        connection->rand_state[2] = 0x330e;
+        init_sector_generator(connection);
+    }
+
+    // * Run all connections
+    pthread_t *threads = malloc(config.concurrency * sizeof(pthread_t));
+    if (threads == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the threads\n");
+        exit(1);
+    }
+    long start_ns = now_ns();
+    for (int i = 0; i < config.concurrency; i++) {
+        connections[i].start_ns = start_ns;
+        pthread_create(&threads[i], NULL, run_connection, &connections[i]);
+    }
+    for (int i = 0; i < config.concurrency; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    long elapsed_ns = now_ns() - start_ns;
+
+    // * Print the report
+    print_report(&config, connections, elapsed_ns);
+
+    for (int i = 0; i < config.concurrency; i++) {
+        free(connections[i].latency);
+    }
+    free(connections);
+    free(threads);
+    return 0;
+}
@@ -7,8 +7,11 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+// print every command, off by default so the terminal stays out of the measured latency
+int verbose = 0;
 // --------------------------------------------------------------------------------------------
 // Decode the parameters from the command line
 // --------------------------------------------------------------------------------------------
@@ -21,10 +24,11 @@ void decode_parameters(int argc,
                        int *port,
                        int block_size,
                        long *FileSize) {
-    if (argc != 6) {
-        fprintf(stderr, "Usage: BDS <DiskFileName> <cylinder_num> <sector_num> <track_to_track_delay> <port>\n");
+    if (argc != 6 && !(argc == 7 && strcmp(argv[6], "-v") == 0)) {
+        fprintf(stderr, "Usage: BDS <DiskFileName> <cylinder_num> <sector_num> <track_to_track_delay> <port> [-v]\n");
         exit(1);
     }
+    verbose = argc == 7;
     *DiskFileName = argv[1];
     *cylinder_num = atoi(argv[2]);
     *sector_num = atoi(argv[3]);
@@ -168,7 +172,9 @@ int parseLine(char *line,
 
     // first token should be read or write
     token = strtok(line, " ");
-    printf("token: %s\n", token);
+    if (verbose) {
+        printf("token: %s\n", token);
+    }
     if (token == NULL) {
         fprintf(stderr, "Error: the command should have at least one token\n");
         return -1;
@@ -232,19 +238,47 @@ int parseLine(char *line,
 
 // --------------------------------------------------------------------------------------------
 // Read the command from the client
+// Commands are terminated by '\n'. A pipelining client may send several commands at once,
+// so the bytes after the first newline are kept for the next call.
+// Return 0 when the client has disconnected
 // --------------------------------------------------------------------------------------------
+char pending_command[2048];
+int pending_len = 0;
+
 int read_command_from_client(int client_sockfd,
                              char *buf) {
-    int len = read(client_sockfd, buf, 1024);
-    if (len < 2) {
-        fprintf(stderr, "Error: cannot read the command from the client\n");
-        return -1;
+    while (1) {
+        // *a complete command is already buffered
+        char *newline = memchr(pending_command, '\n', pending_len);
+        if (newline != NULL) {
+            int len = newline - pending_command + 1;
+            int copy_len = len < 1024 ? len : 1024;
+            memcpy(buf, pending_command, copy_len);
+            buf[copy_len - 1] = '\0';
+            memmove(pending_command, pending_command + len, pending_len - len);
+            pending_len -= len;
+            if (len < 2 || len > 1024) {
+                fprintf(stderr, "Error: cannot read the command from the client\n");
+                return -1;
+            }
+            if (verbose) {
+                printf("Received: %s\n", buf);
+            }
+            return len;
+        }
+        // *the buffer is full but holds no newline
+        if (pending_len == (int)sizeof(pending_command)) {
+            pending_len = 0;
+            fprintf(stderr, "Error: cannot read the command from the client\n");
+            return -1;
+        }
+        // *read more bytes from the client
+        int n = read(client_sockfd, pending_command + pending_len, sizeof(pending_command) - pending_len);
+        if (n <= 0) {
+            return 0;
+        }
+        pending_len += n;
     }
-    buf[len] = '\0';
-    if (buf[len - 1] == '\n')
-        buf[len - 1] = '\0';
-    printf("Received: %s\n", buf);
-    return len;
 }
 
 // --------------------------------------------------------------------------------------------
@@ -262,6 +296,10 @@ void Execution_for_one_client_in_child_process(int client_sockfd,
         // *read the command from the client
         char buf[1024];
         int len = read_command_from_client(client_sockfd, buf);
+        if (len == 0) {
+            close(client_sockfd);
+            return;
+        }
         if (len == -1) {
             write(client_sockfd, "Failed to read", 14);
             continue;
@@ -338,8 +376,11 @@ void Execution_for_one_client_in_child_process(int client_sockfd,
                 write(client_sockfd, "No\n", 3);
                 continue;
             } else {
-                write(client_sockfd, "Yes\n", 4);
-                write(client_sockfd, buf, block_size);
+                // one write for the status and the block, so Nagle's algorithm does not hold the block back
+                char response[1024 + 4];
+                memcpy(response, "Yes\n", 4);
+                memcpy(response + 4, buf, block_size);
+                write(client_sockfd, response, 4 + block_size);
             }
         }
     }
@@ -373,6 +414,7 @@ void Execution_for_one_client(int client_sockfd,
                                                   block_size,
                                                   File_Size,
                                                   track_to_track_delay);
+        exit(0);
     }
 
     // *parent process
@@ -412,6 +454,10 @@ void interaction_between_server_and_clients(char *mapped_diskfile,
             continue;
         }
 
+        // *answer every request immediately instead of coalescing small responses
+        int nodelay = 1;
+        setsockopt(client_sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
         // *print the client's IP address and port
         printf("Client %s:%d connected\n",
                inet_ntoa(client_addr.sin_addr),
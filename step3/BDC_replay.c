@@ -0,0 +1,393 @@
+#include <arpa/inet.h>
+#include <math.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "include/trace.h"
+
+// ------------------------------------------------
+// Replay a BDS trace against a block disk server
+// Every traced client gets its own connection and its requests are sent in the traced order.
+// speed 1 keeps the original timing, speed k replays k times faster,
+// speed 0 sends every request as soon as the previous one of the same client has finished.
+// ------------------------------------------------
+struct Replay_client {
+    char *server_address;
+    int port;
+    double speed;
+    uint64_t start_ns;
+    struct Trace_record *record;  // records of this client
+    long record_num;
+    // results
+    long *read_latency;
+    long read_num;
+    long write_num;
+    double lag_sum;
+    long lag_max;
+};
+
+// ------------------------------------------------
+// Parse the parameters
+// ------------------------------------------------
+void parse_parameters(int argc,
+                      char **argv,
+                      char **trace_file,
+                      char **server_address,
+                      int *port,
+                      double *speed) {
+    if (argc != 4 && argc != 5) {
+        fprintf(stderr, "Usage: %s <trace_file> <server_address> <port> [speed]\n", argv[0]);
+        fprintf(stderr, "  speed 1: original timing (default), k: k times faster, 0: as fast as possible\n");
+        exit(1);
+    }
+    *trace_file = argv[1];
+    *server_address = argv[2];
+    *port = atoi(argv[3]);
+    *speed = argc == 5 ? atof(argv[4]) : 1.0;
+    if (*speed < 0) {
+        fprintf(stderr, "Error: the speed should not be negative\n");
+        exit(1);
+    }
+}
+
+// ------------------------------------------------
+// Create a client
+// ------------------------------------------------
+void create_client(char *server_address,
+                   int port,
+                   int *sockfd) {
+    struct sockaddr_in server_addr;
+
+    // * Create a socket
+    *sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (*sockfd < 0) {
+        perror("socket");
+        exit(1);
+    }
+
+    // * Set the server address
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, server_address, &server_addr.sin_addr) <= 0) {
+        perror("inet_pton");
+        exit(1);
+    }
+
+    // * Connect to the server
+    if (connect(*sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+
+    // * Send every request immediately
+    int flag = 1;
+    setsockopt(*sockfd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+}
+
+// ------------------------------------------------
+// Load the trace file
+// ------------------------------------------------
+struct Trace_record *load_trace(char *trace_file,
+                                struct Trace_header *header,
+                                long *record_num) {
+    FILE *fp = fopen(trace_file, "rb");
+    if (fp == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    if (fread(header, sizeof(*header), 1, fp) != 1 || header->magic != TRACE_MAGIC || header->version != TRACE_VERSION) {
+        fprintf(stderr, "Error: %s is not a BDS trace\n", trace_file);
+        exit(1);
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp) - sizeof(*header);
+    fseek(fp, sizeof(*header), SEEK_SET);
+    *record_num = size / sizeof(struct Trace_record);
+    struct Trace_record *record = malloc((*record_num + 1) * sizeof(struct Trace_record));
+    if (record == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the trace\n");
+        exit(1);
+    }
+    if ((long)fread(record, sizeof(struct Trace_record), *record_num, fp) != *record_num) {
+        fprintf(stderr, "Error: cannot read the trace\n");
+        exit(1);
+    }
+    fclose(fp);
+    return record;
+}
+
+// ------------------------------------------------
+// Sort the records by client, keeping the traced order of each client
+// ------------------------------------------------
+int compare_record(const void *a,
+                   const void *b) {
+    const struct Trace_record *x = (const struct Trace_record *)a;
+    const struct Trace_record *y = (const struct Trace_record *)b;
+    if (x->client != y->client)
+        return x->client < y->client ? -1 : 1;
+    return (x->timestamp_ns > y->timestamp_ns) - (x->timestamp_ns < y->timestamp_ns);
+}
+
+// ------------------------------------------------
+// Read exactly length bytes
+// ------------------------------------------------
+void read_all(int sockfd,
+              char *buffer,
+              int length) {
+    while (length > 0) {
+        int n = read(sockfd, buffer, length);
+        if (n <= 0) {
+            fprintf(stderr, "Error: the server closed the connection\n");
+            exit(1);
+        }
+        buffer += n;
+        length -= n;
+    }
+}
+
+// ------------------------------------------------
+// Ask the server for its geometry
+// ------------------------------------------------
+void get_server_geometry(char *server_address,
+                         int port,
+                         int *cylinder_num,
+                         int *sector_num) {
+    int sockfd;
+    create_client(server_address, port, &sockfd);
+    char buffer[512];
+    memset(buffer, ' ', sizeof(buffer));
+    buffer[0] = 'I';
+    if (write(sockfd, buffer, sizeof(buffer)) != (int)sizeof(buffer)) {
+        perror("write");
+        exit(1);
+    }
+    char answer[256];
+    read_all(sockfd, answer, sizeof(answer));
+    answer[255] = '\0';
+    close(sockfd);
+    if (sscanf(answer, "%d %d", cylinder_num, sector_num) != 2) {
+        fprintf(stderr, "Error: the server did not report its geometry\n");
+        exit(1);
+    }
+}
+
+// ------------------------------------------------
+// Replay the requests of one client
+// ------------------------------------------------
+void *replay_client(void *arg) {
+    struct Replay_client *client = (struct Replay_client *)arg;
+    int sockfd;
+    create_client(client->server_address, client->port, &sockfd);
+
+    client->read_latency = malloc((client->record_num + 1) * sizeof(long));
+    if (client->read_latency == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the latencies\n");
+        exit(1);
+    }
+
+    for (long i = 0; i < client->record_num; i++) {
+        struct Trace_record *record = &client->record[i];
+
+        // * Wait for the scheduled time
+        uint64_t now = trace_now_ns();
+        if (client->speed > 0) {
+            uint64_t scheduled = client->start_ns + (uint64_t)(record->timestamp_ns / client->speed);
+            if (scheduled > now) {
+                struct timespec ts;
+                ts.tv_sec = scheduled / 1000000000ULL;
+                ts.tv_nsec = scheduled % 1000000000ULL;
+                clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+                now = trace_now_ns();
+            } else {
+                long lag = now - scheduled;
+                client->lag_sum += lag;
+                if (lag > client->lag_max)
+                    client->lag_max = lag;
+            }
+        }
+
+        // * Build the command the same way the FS does
+        // 0: R or W
+        // 2-255: sector_id
+        // 256-511: data
+        char buffer[512];
+        memset(buffer, ' ', 256);
+        buffer[0] = record->op;
+        sprintf(buffer + 2, "%u", record->sector_id);
+        memset(buffer + 256, 'a' + record->sector_id % 26, 256);
+        char *p = buffer;
+        int left = 512;
+        while (left > 0) {
+            int n = write(sockfd, p, left);
+            if (n < 0) {
+                perror("write");
+                exit(1);
+            }
+            p += n;
+            left -= n;
+        }
+
+        // * Only reads are answered
+        if (record->op == 'R') {
+            char data[256];
+            read_all(sockfd, data, 256);
+            client->read_latency[client->read_num++] = trace_now_ns() - now;
+        } else {
+            client->write_num++;
+        }
+    }
+    close(sockfd);
+    return NULL;
+}
+
+// ------------------------------------------------
+// Compare two latencies for qsort
+// ------------------------------------------------
+int compare_latency(const void *a,
+                    const void *b) {
+    long x = *(const long *)a;
+    long y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+// ------------------------------------------------
+// Get the p-th percentile from the sorted latencies
+// ------------------------------------------------
+long percentile(long *latency,
+                long latency_num,
+                double p) {
+    long rank = (long)ceil(p * latency_num) - 1;
+    if (rank < 0)
+        rank = 0;
+    if (rank >= latency_num)
+        rank = latency_num - 1;
+    return latency[rank];
+}
+
+// ------------------------------------------------
+// Main function
+// ------------------------------------------------
+int main(int argc, char **argv) {
+    char *trace_file;
+    char *server_address;
+    int port;
+    double speed;
+
+    // * Parse the parameters
+    parse_parameters(argc, argv, &trace_file, &server_address, &port, &speed);
+
+    // * Load the trace and split it by client
+    struct Trace_header header;
+    long record_num;
+    struct Trace_record *record = load_trace(trace_file, &header, &record_num);
+    if (record_num == 0) {
+        printf("The trace is empty\n");
+        return 0;
+    }
+    qsort(record, record_num, sizeof(struct Trace_record), compare_record);
+    uint64_t trace_duration = 0;
+    int client_num = 0;
+    for (long i = 0; i < record_num; i++) {
+        if (i == 0 || record[i].client != record[i - 1].client)
+            client_num++;
+        if (record[i].timestamp_ns > trace_duration)
+            trace_duration = record[i].timestamp_ns;
+    }
+    struct Replay_client *clients = calloc(client_num, sizeof(struct Replay_client));
+    pthread_t *threads = malloc(client_num * sizeof(pthread_t));
+    if (clients == NULL || threads == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the clients\n");
+        exit(1);
+    }
+    int k = -1;
+    for (long i = 0; i < record_num; i++) {
+        if (i == 0 || record[i].client != record[i - 1].client) {
+            k++;
+            clients[k].record = &record[i];
+        }
+        clients[k].record_num++;
+    }
+    printf("Trace: %ld requests from %d clients over %.3f s (%u cylinders x %u sectors)\n",
+           record_num, client_num, trace_duration / 1e9, header.cylinder_num, header.sector_num);
+
+    // * The sectors and seeks of the trace only mean the same on a disk of the same geometry
+    int cylinder_num;
+    int sector_num;
+    get_server_geometry(server_address, port, &cylinder_num, &sector_num);
+    if ((int)header.cylinder_num != cylinder_num || (int)header.sector_num != sector_num) {
+        fprintf(stderr, "Error: the trace is from a disk of %u cylinders x %u sectors, the server has %d x %d\n",
+                header.cylinder_num, header.sector_num, cylinder_num, sector_num);
+        exit(1);
+    }
+
+    // * Replay all clients
+    uint64_t start_ns = trace_now_ns();
+    for (int i = 0; i < client_num; i++) {
+        clients[i].server_address = server_address;
+        clients[i].port = port;
+        clients[i].speed = speed;
+        clients[i].start_ns = start_ns;
+        pthread_create(&threads[i], NULL, replay_client, &clients[i]);
+    }
+    for (int i = 0; i < client_num; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = (trace_now_ns() - start_ns) / 1e9;
+
+    // * Merge the results
+    long read_num = 0;
+    long write_num = 0;
+    double lag_sum = 0;
+    long lag_max = 0;
+    for (int i = 0; i < client_num; i++) {
+        read_num += clients[i].read_num;
+        write_num += clients[i].write_num;
+        lag_sum += clients[i].lag_sum;
+        if (clients[i].lag_max > lag_max)
+            lag_max = clients[i].lag_max;
+    }
+    long *latency = malloc((read_num + 1) * sizeof(long));
+    if (latency == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the latencies\n");
+        exit(1);
+    }
+    long j = 0;
+    for (int i = 0; i < client_num; i++) {
+        memcpy(latency + j, clients[i].read_latency, clients[i].read_num * sizeof(long));
+        j += clients[i].read_num;
+    }
+    qsort(latency, read_num, sizeof(long), compare_latency);
+
+    // * Print the report
+    if (speed > 0)
+        printf("Replay: speed x%.2f\n", speed);
+    else
+        printf("Replay: as fast as possible\n");
+    printf("Requests: %ld (%ld reads, %ld writes)\n", read_num + write_num, read_num, write_num);
+    printf("Elapsed: %.3f s\n", elapsed);
+    printf("Throughput: %.1f req/s\n", (read_num + write_num) / elapsed);
+    if (read_num > 0) {
+        printf("Read latency (us): p50 %.1f, p99 %.1f, p999 %.1f, max %.1f\n",
+               percentile(latency, read_num, 0.50) / 1e3,
+               percentile(latency, read_num, 0.99) / 1e3,
+               percentile(latency, read_num, 0.999) / 1e3,
+               latency[read_num - 1] / 1e3);
+    }
+    if (speed > 0) {
+        printf("Issue lag (us): mean %.1f, max %.1f\n", lag_sum / (read_num + write_num) / 1e3, lag_max / 1e3);
+    }
+
+    for (int i = 0; i < client_num; i++) {
+        free(clients[i].read_latency);
+    }
+    free(latency);
+    free(clients);
+    free(threads);
+    free(record);
+    return 0;
+}
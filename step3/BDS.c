@@ -4,11 +4,14 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include "include/trace.h"
 // --------------------------------------------------------------------------------------------
 // Decode the parameters from the command line
 // --------------------------------------------------------------------------------------------
@@ -19,12 +22,14 @@ void decode_parameters(int argc,
                        int *sector_num,
                        int *track_to_track_delay,
                        int *port,
+                       char **TraceFileName,
                        int block_size,
                        long *FileSize) {
-    if (argc != 6) {
-        fprintf(stderr, "Usage: BDS <DiskFileName> <cylinder_num> <sector_num> <track_to_track_delay> <port>\n");
+    if (argc != 6 && argc != 7) {
+        fprintf(stderr, "Usage: BDS <DiskFileName> <cylinder_num> <sector_num> <track_to_track_delay> <port> [TraceFileName]\n");
         exit(1);
     }
+    *TraceFileName = argc == 7 ? argv[6] : NULL;
     *DiskFileName = argv[1];
     *cylinder_num = atoi(argv[2]);
     *sector_num = atoi(argv[3]);
@@ -162,6 +167,10 @@ void create_server(int *sockfd,
 int parseLine(char *line,
               int *id,
               char *data) {
+    // Information: the geometry of the disk
+    if (line[0] == 'I') {
+        return 1;
+    }
     // Read
     if (line[0] == 'R') {
         // the id
@@ -185,16 +194,29 @@ int parseLine(char *line,
 int read_command_from_client(int client_sockfd,
                              char *buf) {
     // * For this particular job, we read the command from the client for 512 bytes each time
-    int n = read(client_sockfd, buf, 512);
-    if (n < 0) {
-        fprintf(stderr, "Error: cannot read the command from the client\n");
-        return 0;
-    }
-    printf("Received command: %s\n", buf);
-    for (int i = 0; i < 512; i++) {
-        printf("%d", (int)buf[i]);
+    // a command may arrive in several pieces, and 0 bytes means the client has disconnected
+    int len = 0;
+    while (len < 512) {
+        if (TRACE_STOP) {
+            return 0;
+        }
+        int n = read(client_sockfd, buf + len, 512 - len);
+        if (n < 0) {
+            // *a traced client wakes up to flush old records, and leaves once it is stopped
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                flush_old_trace();
+                continue;
+            }
+            fprintf(stderr, "Error: cannot read the command from the client\n");
+            return 0;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        len += n;
     }
-    printf("\n");
+    // ?debug
+    // printf("Received command: %s\n", buf);
     return 1;
 }
 
@@ -204,6 +226,7 @@ int read_command_from_client(int client_sockfd,
 // --------------------------------------------------------------------------------------------
 void Execution_for_one_client_in_child_process(
     int client_sockfd,
+    int client_id,
     char *mapped_diskfile,
     int sector_num,
     int block_size,
@@ -211,8 +234,10 @@ void Execution_for_one_client_in_child_process(
     int track_to_track_delay) {
     // ?for the following code, we can see that it is the same as the code in the main function
     // track_to_track_delay = 0;
+    watch_trace(client_sockfd);
     while (1) {
-        printf("Waiting for the command from the client\n");
+        // ?debug
+        // printf("Waiting for the command from the client\n");
         // *read the command from the client
         char buf[512];
         if (!read_command_from_client(client_sockfd, buf)) {
@@ -228,8 +253,17 @@ void Execution_for_one_client_in_child_process(
         // printf("cmd_num: %d\n", cmd_num);
         // printf("id: %d\n", id);
 
+        // *answer the geometry: "<cylinder_num> <sector_num>" in one 256-byte block
+        if (cmd_num == 1) {
+            char buffer[256];
+            memset(buffer, 0, 256);
+            sprintf(buffer, "%d %d", File_Size / (sector_num * block_size), sector_num);
+            write(client_sockfd, buffer, 256);
+        }
+
         // *handle the read command
-        if (cmd_num == 2) {
+        else if (cmd_num == 2) {
+            record_trace(client_id, 'R', id, block_size);
             int c = id / sector_num;
             int s = id % sector_num;
             char buffer[256];
@@ -248,6 +282,7 @@ void Execution_for_one_client_in_child_process(
 
         // *handle the write command
         else if (cmd_num == 3) {
+            record_trace(client_id, 'W', id, block_size);
             int c = id / sector_num;
             int s = id % sector_num;
             char *buffer = data;
@@ -264,12 +299,15 @@ void Execution_for_one_client_in_child_process(
             }
         }
     }
+    flush_trace();
+    close(client_sockfd);
 }
 
 // --------------------------------------------------------------------------------------------
 // Execution for one client
 // --------------------------------------------------------------------------------------------
 void Execution_for_one_client(int client_sockfd,
+                              int client_id,
                               char *mapped_diskfile,
                               int sector_num,
                               int block_size,
@@ -287,11 +325,13 @@ void Execution_for_one_client(int client_sockfd,
     if (pid == 0) {
         // *handle one client's commands in the child process
         Execution_for_one_client_in_child_process(client_sockfd,
+                                                  client_id,
                                                   mapped_diskfile,
                                                   sector_num,
                                                   block_size,
                                                   File_Size,
                                                   track_to_track_delay);
+        exit(0);
     }
 
     // *parent process
@@ -318,6 +358,7 @@ void interaction_between_server_and_clients(char *mapped_diskfile,
     create_server(&sockfd, port);
 
     // *client execution
+    int client_num = 0;
     while (1) {
         // *accept the client
         struct sockaddr_in client_addr;
@@ -330,6 +371,10 @@ void interaction_between_server_and_clients(char *mapped_diskfile,
             continue;
         }
 
+        // *answer pipelined reads without waiting for acknowledgements
+        int flag = 1;
+        setsockopt(client_sockfd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
         // *print the client's IP address and port
         printf("Client %s:%d connected\n",
                inet_ntoa(client_addr.sin_addr),
@@ -337,6 +382,7 @@ void interaction_between_server_and_clients(char *mapped_diskfile,
 
         // *execute the client's commands
         Execution_for_one_client(client_sockfd,
+                                 client_num++,
                                  mapped_diskfile,
                                  sector_num,
                                  block_size,
@@ -356,6 +402,7 @@ int main(int argc, char *argv[]) {
     int block_size = 256;
     int track_to_track_delay;
     int port;
+    char *TraceFileName;
     long FileSize;
 
     // *Decode the parameters from the command line
@@ -366,6 +413,7 @@ int main(int argc, char *argv[]) {
                       &sector_num,
                       &track_to_track_delay,
                       &port,
+                      &TraceFileName,
                       block_size,
                       &FileSize);
 
@@ -381,6 +429,15 @@ int main(int argc, char *argv[]) {
                       FileSize,
                       &mapped_diskfile);
 
+    // *Record every request when a trace file is given
+    if (TraceFileName != NULL) {
+        if (open_trace(TraceFileName, block_size, cylinder_num, sector_num) == -1) {
+            fprintf(stderr, "Error: cannot open the trace file\n");
+            exit(1);
+        }
+        printf("Tracing requests to %s\n", TraceFileName);
+    }
+
     // *Execute the server and clients
     interaction_between_server_and_clients(mapped_diskfile,
                                            sector_num,
@@ -54,6 +54,37 @@ void create_client(char *server_address,
     printf("Connected to the server\n");
 }
 
+// ------------------------------------------------
+// Read exactly length bytes from the server
+// ------------------------------------------------
+void read_all(int sockfd,
+              char *buffer,
+              int length) {
+    while (length > 0) {
+        int n = read(sockfd, buffer, length);
+        if (n <= 0) {
+            perror("read");
+            exit(1);
+        }
+        buffer += n;
+        length -= n;
+    }
+}
+
+// ------------------------------------------------
+// Print a streamed file: the header "Stream: <bytes>" is followed by the bytes
+// ------------------------------------------------
+void print_stream(int sockfd,
+                  int length) {
+    char chunk[4096];
+    while (length > 0) {
+        int size = length < 4096 ? length : 4096;
+        read_all(sockfd, chunk, size);
+        fwrite(chunk, 1, size, stdout);
+        length -= size;
+    }
+}
+
 // ------------------------------------------------
 // Interact with the server
 // ------------------------------------------------
@@ -65,11 +96,7 @@ void interact_with_server(int sockfd) {
         // * Current directory
         char current_directory[1024];
         bzero(current_directory, 1024);
-        n = read(sockfd, current_directory, 1024);
-        if (n < 0) {
-            perror("read");
-            exit(1);
-        }
+        read_all(sockfd, current_directory, 1024);
         printf("Current directory: %s: ", current_directory);
 
         // * Read the command from the user
@@ -85,11 +112,7 @@ void interact_with_server(int sockfd) {
 
         // * Read the response from the server
         bzero(buffer, 1024);
-        n = read(sockfd, buffer, 1024);
-        if (n < 0) {
-            perror("read");
-            exit(1);
-        }
+        read_all(sockfd, buffer, 1024);
 
         // * Check if the server closed the connection
         if (buffer[0] == 'E' && buffer[1] == 'X' && buffer[2] == 'I' && buffer[3] == 'T') {
@@ -97,7 +120,12 @@ void interact_with_server(int sockfd) {
             break;
         }
 
-        // * Print the response
+        // * Print the response, a file comes after its header
+        if (strncmp(buffer, "Stream: ", 8) == 0) {
+            print_stream(sockfd, atoi(buffer + 8));
+            printf("\n");
+            continue;
+        }
         for (int i = 0; i < 1024; i++) {
             printf("%c", buffer[i]);
         }
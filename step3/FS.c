@@ -4,60 +4,103 @@
 
 // ------------------------------------------------
 // Parse the parameters
+// FS <Disk_server_address> <BDS_port> <FS_port>: the blocks live on a BDS
+// FS memory <FS_port>: the blocks live in an in-process RAM disk
+// FS image <Disk_file> <FS_port>: the blocks live in an in-process disk file
 // ------------------------------------------------
 void parse_parameters(int argc,
                       char *argv[],
+                      int *device_type,
                       char **DSK_server_address,
                       int *BDS_port,
+                      char **Disk_file_name,
                       int *FS_port) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s <Disk_server_address> <BDS_port><FSport>\n", argv[0]);
+    *BDS_port = 0;
+    if (argc == 3 && strcmp(argv[1], "memory") == 0) {
+        *device_type = DEVICE_MEMORY;
+        *FS_port = atoi(argv[2]);
+    } else if (argc == 4 && strcmp(argv[1], "image") == 0) {
+        *device_type = DEVICE_IMAGE;
+        *Disk_file_name = argv[2];
+        *FS_port = atoi(argv[3]);
+    } else if (argc == 4) {
+        *device_type = DEVICE_BDS;
+        *DSK_server_address = argv[1];
+        *BDS_port = atoi(argv[2]);
+        *FS_port = atoi(argv[3]);
+    } else {
+        fprintf(stderr, "Usage: %s <Disk_server_address> <BDS_port> <FSport>\n", argv[0]);
+        fprintf(stderr, "       %s memory <FSport>\n", argv[0]);
+        fprintf(stderr, "       %s image <Disk_file> <FSport>\n", argv[0]);
         exit(1);
     }
-    *DSK_server_address = argv[1];
-    *BDS_port = atoi(argv[2]);
-    *FS_port = atoi(argv[3]);
 
-    if (*BDS_port <= 1000 || *FS_port <= 1000 || *BDS_port > 65535 || *FS_port > 65535) {
+    if ((*device_type == DEVICE_BDS && (*BDS_port <= 1000 || *BDS_port > 65535)) || *FS_port <= 1000 || *FS_port > 65535) {
         fprintf(stderr, "Invalid port number\n");
         exit(1);
     }
 }
 
-// ------------------------------------------------
-// Semaphores Initial
-// ------------------------------------------------
-void semaphores_initial() {
-    for (int i = 0; i < BLOCK_NUM; i++) {
-        sem_init(&block_semaphore[i], 0, 1);
-    }
-}
-
 int main(int argc, char *argv[]) {
+    int device_type;
     char *Disk_server_address;
+    char *Disk_file_name;
     int BDS_port;
     int FS_port;
-    // * Initial the semaphore
-    semaphores_initial();
-
     // * Parse the parameters
-    parse_parameters(argc, argv, &Disk_server_address, &BDS_port, &FS_port);
+    parse_parameters(argc, argv, &device_type, &Disk_server_address, &BDS_port, &Disk_file_name, &FS_port);
 
-    // ?debug
-    printf("Disk server address: %s\n", Disk_server_address);
-    printf("BDS port: %d\n", BDS_port);
+    // * Initial the block device
+    if (device_type == DEVICE_BDS) {
+        // ?debug
+        printf("Disk server address: %s\n", Disk_server_address);
+        printf("BDS port: %d\n", BDS_port);
+        if (open_bds_device(Disk_server_address, BDS_port) == -1) {
+            fprintf(stderr, "Error: cannot open the BDS\n");
+            exit(1);
+        }
+    } else if (device_type == DEVICE_MEMORY) {
+        printf("Block device: memory\n");
+        if (open_memory_device(BLOCK_NUM) == -1) {
+            fprintf(stderr, "Error: cannot create the memory disk\n");
+            exit(1);
+        }
+    } else {
+        printf("Block device: image %s\n", Disk_file_name);
+        if (open_image_device(Disk_file_name, BLOCK_NUM) == -1) {
+            fprintf(stderr, "Error: cannot open the disk image\n");
+            exit(1);
+        }
+    }
     printf("FS port: %d\n", FS_port);
 
-    // * Initial the disk client
-    create_client(Disk_server_address, BDS_port, &SOCKET_FD);
+    // * Initial the caches and the locks shared by the sessions
+    if (init_shared_state() == -1) {
+        fprintf(stderr, "Error: cannot create the shared state\n");
+        exit(1);
+    }
 
-    // * initial the bitmap
-    init_bitmap();
+    // * mount the disk, replaying its journal, or format it when it holds no FS
+    root_sector_id = mount_journal();
+    if (root_sector_id == -1) {
+        fprintf(stderr, "Error: cannot mount the disk, it is left as it is\n");
+        exit(1);
+    }
+    if (root_sector_id != -2) {
+        load_bitmap();
+        load_inode_map();
+        get_inode(root_sector_id, &ROOT);
+    } else {
+        // * initial the bitmap
+        init_bitmap();
 
-    // * initial the root directory
-    create_root_directory(&ROOT);
-    create_public_directory(&ROOT);
-    root_sector_id = ROOT.sector_id;
+        // * initial the root directory
+        create_root_directory(&ROOT);
+        create_public_directory(&ROOT);
+        root_sector_id = ROOT.sector_id;
+        end_command();
+        set_journal_root(root_sector_id);
+    }
 
     // * Initial the file server
     create_disk_server(FS_port);
@@ -0,0 +1,634 @@
+#include <time.h>
+#include "include/inode.h"
+#include "include/disk_server.h"
+
+// ------------------------------------------------
+// Microbenchmarks of the inode and directory layers
+// All blocks live in an in-memory disk, so the numbers show the cost of the
+// algorithms and the number of block I/Os each of them would send to the BDS.
+// ------------------------------------------------
+#define FILE_BLOCK_NUM 700      // blocks of the largest file
+#define FRAGMENT_BLOCK_NUM 300  // blocks of each of two interleaved files
+
+struct Bench_counter {
+    long start_ns;
+    long read_num;
+    long write_num;
+};
+
+// ------------------------------------------------
+// Monotonic time in nanoseconds
+// ------------------------------------------------
+long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// ------------------------------------------------
+// Start measuring
+// ------------------------------------------------
+void bench_start(struct Bench_counter *counter) {
+    counter->read_num = BLOCK_READ_NUM;
+    counter->write_num = BLOCK_WRITE_NUM;
+    counter->start_ns = now_ns();
+}
+
+// ------------------------------------------------
+// Print one result line from the totals of op_num ops
+// ------------------------------------------------
+void bench_print(char *name,
+                 char *param,
+                 long ns,
+                 long read_num,
+                 long write_num,
+                 long op_num) {
+    printf("%-20s %-24s %12.1f %10.2f %10.2f\n",
+           name,
+           param,
+           (double)ns / op_num,
+           (double)read_num / op_num,
+           (double)write_num / op_num);
+}
+
+// ------------------------------------------------
+// Stop measuring and print one result line
+// ------------------------------------------------
+void bench_stop(struct Bench_counter *counter,
+                char *name,
+                char *param,
+                long op_num) {
+    bench_print(name,
+                param,
+                now_ns() - counter->start_ns,
+                BLOCK_READ_NUM - counter->read_num,
+                BLOCK_WRITE_NUM - counter->write_num,
+                op_num);
+}
+
+// ------------------------------------------------
+// Stop measuring and add the cost to the totals
+// ------------------------------------------------
+void bench_add(struct Bench_counter *counter,
+               long *ns,
+               long *read_num,
+               long *write_num) {
+    *ns += now_ns() - counter->start_ns;
+    *read_num += BLOCK_READ_NUM - counter->read_num;
+    *write_num += BLOCK_WRITE_NUM - counter->write_num;
+}
+
+// ------------------------------------------------
+// Pseudo-random number below limit
+// ------------------------------------------------
+int bench_random(unsigned int *seed, int limit) {
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 8) % limit;
+}
+
+// ------------------------------------------------
+// Content of size bytes for the file benchmarks
+// ------------------------------------------------
+char *new_content(int size) {
+    char *content = malloc(size);
+    if (content == NULL) {
+        fprintf(stderr, "Error: failed to allocate memory for the content\n");
+        exit(1);
+    }
+    for (int i = 0; i < size; i++) {
+        content[i] = 'a' + i % 26;
+    }
+    return content;
+}
+
+// ------------------------------------------------
+// Format the in-memory disk
+// ------------------------------------------------
+void format_memory_disk() {
+    memset(MEMORY_DISK, 0, BLOCK_NUM * 256);
+    reset_block_cache();
+    init_bitmap();
+}
+
+// ------------------------------------------------
+// Format the in-memory disk and create one empty file on it
+// ------------------------------------------------
+void format_with_file(struct Inode *inode) {
+    int sector_id;
+    format_memory_disk();
+    init_new_inode(inode, &sector_id, -1, 0);
+}
+
+// ------------------------------------------------
+// Create a file inode with block_num blocks
+// it is the only file growing, so all blocks end up in one extent
+// ------------------------------------------------
+void create_file_with_blocks(struct Inode *inode,
+                             int block_num) {
+    int sector_id;
+    init_new_inode(inode, &sector_id, -1, 0);
+    for (int i = 0; i < block_num; i++) {
+        init_new_block(inode, &sector_id);
+    }
+}
+
+// ------------------------------------------------
+// Create two file inodes growing in turn
+// every block of one file is followed by a block of the other, so every block is an extent
+// ------------------------------------------------
+void create_fragmented_files(struct Inode *first,
+                             struct Inode *second,
+                             int block_num) {
+    int sector_id;
+    init_new_inode(first, &sector_id, -1, 0);
+    init_new_inode(second, &sector_id, -1, 0);
+    for (int i = 0; i < block_num; i++) {
+        init_new_block(first, &sector_id);
+        init_new_block(second, &sector_id);
+    }
+}
+
+// ------------------------------------------------
+// get_sector_id on each mapping layout
+// ------------------------------------------------
+void bench_get_sector_id() {
+    struct Bench_counter counter;
+    struct Inode contiguous;
+    struct Inode fragmented;
+    struct Inode other;
+    struct Inode *inode[] = {&contiguous, &fragmented, &fragmented};
+    char *name[] = {"one extent", "inline extents", "extent tree"};
+    int begin[] = {0, 0, INLINE_EXTENT_NUM};
+    int end[] = {FILE_BLOCK_NUM, INLINE_EXTENT_NUM, FRAGMENT_BLOCK_NUM};
+    long op_num = 200000;
+
+    for (int r = 0; r < 3; r++) {
+        int sector_id;
+        format_memory_disk();
+        if (r == 0) {
+            create_file_with_blocks(&contiguous, FILE_BLOCK_NUM);
+        } else {
+            create_fragmented_files(&fragmented, &other, FRAGMENT_BLOCK_NUM);
+        }
+        bench_start(&counter);
+        for (long i = 0; i < op_num; i++) {
+            get_sector_id(inode[r], begin[r] + (i * 7919) % (end[r] - begin[r]), &sector_id);
+        }
+        bench_stop(&counter, "get_sector_id", name[r], op_num);
+    }
+}
+
+// ------------------------------------------------
+// Resolve whole files through the block map iterator
+// ------------------------------------------------
+void bench_bmap_range() {
+    struct Bench_counter counter;
+    struct Inode contiguous;
+    struct Inode fragmented;
+    struct Inode other;
+    struct Inode *inode[] = {&contiguous, &fragmented};
+    char *name[] = {"one extent", "extent per block"};
+    long op_num = 2000;
+
+    for (int r = 0; r < 2; r++) {
+        long sum = 0;
+        format_memory_disk();
+        if (r == 0) {
+            create_file_with_blocks(&contiguous, FILE_BLOCK_NUM);
+        } else {
+            create_fragmented_files(&fragmented, &other, FRAGMENT_BLOCK_NUM);
+        }
+        bench_start(&counter);
+        for (long i = 0; i < op_num; i++) {
+            struct Bmap_iterator it;
+            int index, sector_id, length;
+            bmap_begin(&it, inode[r], 0, inode[r]->block_num);
+            while (bmap_next(&it, &index, &sector_id, &length)) {
+                sum += sector_id + length;
+            }
+        }
+        bench_stop(&counter, "bmap whole file", name[r], op_num * inode[r]->block_num);
+        if (sum == 0) {
+            printf("unreachable\n");
+        }
+    }
+}
+
+// ------------------------------------------------
+// init_new_block and remove_tail_block on each mapping layout
+// ------------------------------------------------
+void bench_grow_and_shrink() {
+    struct Bench_counter counter;
+    long grow_ns[2] = {0, 0};
+    long shrink_ns[2] = {0, 0};
+    long grow_read[2] = {0, 0};
+    long grow_write[2] = {0, 0};
+    long shrink_read[2] = {0, 0};
+    long shrink_write[2] = {0, 0};
+    char *name[] = {"one extent", "extent per block"};
+    long block_num[] = {FILE_BLOCK_NUM, 2 * FRAGMENT_BLOCK_NUM};
+    int repeat = 20;
+
+    for (int k = 0; k < repeat; k++) {
+        for (int r = 0; r < 2; r++) {
+            struct Inode first;
+            struct Inode second;
+            format_memory_disk();
+            // grow
+            bench_start(&counter);
+            if (r == 0) {
+                create_file_with_blocks(&first, FILE_BLOCK_NUM);
+            } else {
+                create_fragmented_files(&first, &second, FRAGMENT_BLOCK_NUM);
+            }
+            bench_add(&counter, &grow_ns[r], &grow_read[r], &grow_write[r]);
+            // shrink back
+            bench_start(&counter);
+            while (first.block_num > 0) {
+                remove_tail_block(&first);
+            }
+            while (r == 1 && second.block_num > 0) {
+                remove_tail_block(&second);
+            }
+            bench_add(&counter, &shrink_ns[r], &shrink_read[r], &shrink_write[r]);
+        }
+    }
+    for (int r = 0; r < 2; r++) {
+        long op_num = (long)repeat * block_num[r];
+        bench_print("init_new_block", name[r], grow_ns[r], grow_read[r], grow_write[r], op_num);
+    }
+    for (int r = 0; r < 2; r++) {
+        long op_num = (long)repeat * block_num[r];
+        bench_print("remove_tail_block", name[r], shrink_ns[r], shrink_read[r], shrink_write[r], op_num);
+    }
+}
+
+// ------------------------------------------------
+// truncate_blocks of whole files on each mapping layout, one op is one file
+// ------------------------------------------------
+void bench_truncate_blocks() {
+    char *name[] = {"one extent", "extent per block"};
+    int repeat = 20;
+    for (int r = 0; r < 2; r++) {
+        struct Bench_counter counter;
+        long ns = 0;
+        long read_num = 0;
+        long write_num = 0;
+        for (int k = 0; k < repeat; k++) {
+            struct Inode first;
+            struct Inode second;
+            format_memory_disk();
+            if (r == 0) {
+                create_file_with_blocks(&first, FILE_BLOCK_NUM);
+            } else {
+                create_fragmented_files(&first, &second, FRAGMENT_BLOCK_NUM);
+            }
+            end_command();
+            bench_start(&counter);
+            truncate_blocks(&first, 0);
+            if (r == 1) {
+                truncate_blocks(&second, 0);
+            }
+            end_command();
+            bench_add(&counter, &ns, &read_num, &write_num);
+        }
+        bench_print("truncate_blocks", name[r], ns, read_num, write_num, repeat);
+    }
+}
+
+// ------------------------------------------------
+// find_name_id on directories of several sizes
+// ------------------------------------------------
+void bench_find_name_id() {
+    int directory_size[] = {1, 16, 64, 256};
+    for (int d = 0; d < 4; d++) {
+        struct Bench_counter counter;
+        struct Inode directory;
+        int sector_id;
+        char name[256];
+        char param[64];
+        long op_num = 200000 / directory_size[d];
+
+        format_memory_disk();
+        init_new_inode(&directory, &sector_id, -1, 1);
+        for (int i = 0; i < directory_size[d]; i++) {
+            sprintf(name, "file_%d", i);
+            create_file(&directory, name);
+        }
+
+        // the last name is the worst case of the linear scan
+        sprintf(name, "file_%d", directory_size[d] - 1);
+        sprintf(param, "%d names, hit", directory_size[d]);
+        bench_start(&counter);
+        for (long i = 0; i < op_num; i++) {
+            find_name_id(&directory, name, &sector_id);
+        }
+        bench_stop(&counter, "find_name_id", param, op_num);
+
+        sprintf(param, "%d names, miss", directory_size[d]);
+        bench_start(&counter);
+        for (long i = 0; i < op_num; i++) {
+            find_name_id(&directory, "missing", &sector_id);
+        }
+        bench_stop(&counter, "find_name_id", param, op_num);
+    }
+}
+
+// ------------------------------------------------
+// write_file of several sizes
+// ------------------------------------------------
+void bench_write_file() {
+    int file_size[] = {100, 16 * 256, 40 * 256, 256 * 256, 680 * 256, FILE_BLOCK_NUM * 256};
+    char *content = new_content(FILE_BLOCK_NUM * 256);
+    for (int f = 0; f < 6; f++) {
+        struct Bench_counter counter;
+        struct Inode inode;
+        char param[64];
+        long op_num = 20000 / (file_size[f] / 256 + 1) + 2;
+
+        format_with_file(&inode);
+        sprintf(param, "%d bytes", file_size[f]);
+        bench_start(&counter);
+        for (long i = 0; i < op_num; i++) {
+            write_file(&inode, file_size[f], content);
+            end_command();
+        }
+        bench_stop(&counter, "write_file", param, op_num);
+    }
+    free(content);
+}
+
+// ------------------------------------------------
+// pwrite_file of one record in the largest file
+// ------------------------------------------------
+void bench_pwrite_file() {
+    char *content = new_content(FILE_BLOCK_NUM * 256);
+    int record_size[] = {64, 200};
+    for (int r = 0; r < 2; r++) {
+        struct Bench_counter counter;
+        struct Inode inode;
+        char param[64];
+        long op_num = 20000;
+        unsigned int seed = 1;
+
+        format_with_file(&inode);
+        write_file(&inode, FILE_BLOCK_NUM * 256, content);
+        end_command();
+        sprintf(param, "%d bytes of %d blocks", record_size[r], FILE_BLOCK_NUM);
+        bench_start(&counter);
+        for (long i = 0; i < op_num; i++) {
+            int pos = bench_random(&seed, FILE_BLOCK_NUM * 256 - record_size[r]);
+            pwrite_file(&inode, pos, record_size[r], content);
+            end_command();
+        }
+        bench_stop(&counter, "pwrite_file", param, op_num);
+    }
+    free(content);
+}
+
+// ------------------------------------------------
+// append_file and append_file_atomic of one record until the file has the largest size
+// ------------------------------------------------
+void bench_append_file() {
+    char content[256];
+    memset(content, 'a', sizeof(content));
+    int record_size = 64;
+    for (int r = 0; r < 2; r++) {
+        struct Bench_counter counter;
+        struct Inode inode;
+        int pos;
+        long op_num = FILE_BLOCK_NUM * 256 / record_size;
+
+        format_with_file(&inode);
+        end_command();
+        bench_start(&counter);
+        for (long i = 0; i < op_num; i++) {
+            if (r == 0) {
+                append_file(&inode, record_size, content);
+            } else {
+                append_file_atomic(inode.sector_id, record_size, content, &pos, 0);
+            }
+            end_command();
+        }
+        bench_stop(&counter, r == 0 ? "append_file" : "append_file_atomic", "64 bytes", op_num);
+    }
+}
+
+// ------------------------------------------------
+// truncate_file of an empty file to a size larger than the disk, and read_file_range in
+// the hole it leaves
+// ------------------------------------------------
+void bench_sparse_file() {
+    char *content = new_content(FILE_BLOCK_NUM * 256);
+    int size = 64 * BLOCK_NUM * 256;
+    for (int r = 0; r < 2; r++) {
+        struct Bench_counter counter;
+        struct Inode inode;
+        char param[64];
+        long op_num = 2000;
+        unsigned int seed = 1;
+
+        format_with_file(&inode);
+        if (r == 1) {
+            truncate_file(&inode, size);
+        }
+        end_command();
+        sprintf(param, "%d blocks", size / 256);
+        bench_start(&counter);
+        for (long i = 0; i < op_num; i++) {
+            if (r == 0) {
+                truncate_file(&inode, size);
+                truncate_file(&inode, 0);
+            } else {
+                read_file_range(&inode, bench_random(&seed, size - FILE_BLOCK_NUM * 256), FILE_BLOCK_NUM * 256, content);
+            }
+            end_command();
+        }
+        bench_stop(&counter, r == 0 ? "truncate_file" : "read_file_range", param, op_num);
+    }
+    free(content);
+}
+
+// ------------------------------------------------
+// insert_file and delete_file_range of one record in a file of half the largest size
+// every insert is followed by a delete of the same length, so the size stays the same
+// ------------------------------------------------
+void bench_insert_file() {
+    int block_num = FILE_BLOCK_NUM / 2;
+    char *content = new_content(block_num * 256);
+    int record_size[] = {64, 600};
+    for (int r = 0; r < 2; r++) {
+        struct Bench_counter counter;
+        struct Inode inode;
+        char param[64];
+        long op_num = 10000;
+        unsigned int seed = 1;
+
+        format_with_file(&inode);
+        write_file(&inode, block_num * 256, content);
+        end_command();
+        sprintf(param, "%d bytes of %d blocks", record_size[r], block_num);
+        bench_start(&counter);
+        for (long i = 0; i < op_num; i++) {
+            insert_file(&inode, bench_random(&seed, block_num * 256), record_size[r], content);
+            end_command();
+            delete_file_range(&inode, bench_random(&seed, block_num * 256), record_size[r]);
+            end_command();
+        }
+        bench_stop(&counter, "insert+delete", param, op_num);
+    }
+    free(content);
+}
+
+// ------------------------------------------------
+// Cold scan of a tree built the way sessions build it
+// Several directories get their files in turn, then every directory is listed and
+// every file read with empty caches; the seek distance is what the BDS head travels.
+// ------------------------------------------------
+void bench_layout() {
+    int directory_num = 6;
+    int file_num = 12;
+    struct Inode root;
+    struct Inode directory[6];
+    char name[64];
+    char content[2 * 256];
+    int sector_id;
+
+    format_memory_disk();
+    init_new_inode(&root, &sector_id, -1, 1);
+    for (int d = 0; d < directory_num; d++) {
+        sprintf(name, "dir_%d", d);
+        create_directory(&root, name);
+    }
+    for (int d = 0; d < directory_num; d++) {
+        sprintf(name, "dir_%d", d);
+        get_inode(root.sector_id, &root);
+        find_name_id(&root, name, &sector_id);
+        get_inode(sector_id, &directory[d]);
+    }
+    memset(content, 'x', sizeof(content));
+    for (int f = 0; f < file_num; f++) {
+        for (int d = 0; d < directory_num; d++) {
+            struct Inode file;
+            sprintf(name, "file_%d", f);
+            create_file(&directory[d], name);
+            find_name_id(&directory[d], name, &sector_id);
+            get_inode(sector_id, &file);
+            write_file(&file, sizeof(content), content);
+        }
+        // one transaction per round keeps the metadata within the journal
+        end_command();
+    }
+
+    // *cold caches, read from the sectors instead of the journal
+    checkpoint_journal();
+    reset_block_cache();
+    reset_inode_cache();
+    struct Bench_counter counter;
+    long seek_start = SEEK_DISTANCE;
+    last_cylinder = 0;
+    bench_start(&counter);
+    for (int d = 0; d < directory_num; d++) {
+        char names[256][252];
+        int name_num = 0;
+        get_inode(directory[d].sector_id, &directory[d]);
+        list_all_name(&directory[d], names, &name_num);
+        for (int f = 0; f < name_num; f++) {
+            struct Inode file;
+            char buffer[sizeof(content) + 256];
+            find_name_id(&directory[d], names[f], &sector_id);
+            get_inode(sector_id, &file);
+            read_whole_file(&file, buffer);
+        }
+    }
+    bench_stop(&counter, "cold scan", "6 dirs x 12 files", directory_num);
+    printf("%-20s %-24s %12.1f\n", "cold scan", "seek cylinders/dir", (double)(SEEK_DISTANCE - seek_start) / directory_num);
+}
+
+// ------------------------------------------------
+// Small writes scattered over a tree
+// Files of size bytes in several directories are rewritten in a pseudo-random order, and the
+// journal is checkpointed at the end; the seek distance is what the BDS head travels for
+// all of it, the work the log-structured layout turns into sequential writes. Files of at
+// most INLINE_DATA_SIZE bytes live in their inodes and write no data block.
+// ------------------------------------------------
+void bench_small_writes(int size) {
+    int directory_num = 6;
+    int file_num = 12;
+    int op_num = 2000;
+    struct Inode root;
+    struct Inode directory;
+    int file_id[6 * 12];
+    char name[64];
+    char param[64];
+    char content[256];
+    int sector_id;
+
+    format_memory_disk();
+    init_new_inode(&root, &sector_id, -1, 1);
+    memset(content, 'x', sizeof(content));
+    for (int d = 0; d < directory_num; d++) {
+        sprintf(name, "dir_%d", d);
+        create_directory(&root, name);
+        get_inode(root.sector_id, &root);
+        find_name_id(&root, name, &sector_id);
+        get_inode(sector_id, &directory);
+        for (int f = 0; f < file_num; f++) {
+            struct Inode file;
+            sprintf(name, "file_%d", f);
+            create_file(&directory, name);
+            find_name_id(&directory, name, &file_id[d * file_num + f]);
+            get_inode(file_id[d * file_num + f], &file);
+            write_file(&file, size, content);
+        }
+        end_command();
+    }
+    checkpoint_journal();
+
+    struct Bench_counter counter;
+    long seek_start = SEEK_DISTANCE;
+    unsigned int seed = 1;
+    bench_start(&counter);
+    for (int i = 0; i < op_num; i++) {
+        struct Inode file;
+        seed = seed * 1103515245 + 12345;
+        get_inode(file_id[(seed >> 16) % (directory_num * file_num)], &file);
+        content[0] = 'a' + i % 26;
+        write_file(&file, size, content);
+        end_command();
+    }
+    checkpoint_journal();
+    sprintf(param, "72 files x %d bytes", size);
+    bench_stop(&counter, "small writes", param, op_num);
+    printf("%-20s %-24s %12.1f\n", "small writes", "seek cylinders/op", (double)(SEEK_DISTANCE - seek_start) / op_num);
+}
+
+// ------------------------------------------------
+// Main function
+// ------------------------------------------------
+int main() {
+    // * Initial the shared state and the in-memory disk
+    if (init_shared_state() == -1 || open_memory_device(BLOCK_NUM) == -1) {
+        fprintf(stderr, "Error: failed to allocate memory for the disk\n");
+        exit(1);
+    }
+
+    // * Run the benchmarks
+    printf("%-20s %-24s %12s %10s %10s\n", "benchmark", "case", "ns/op", "reads/op", "writes/op");
+    bench_get_sector_id();
+    bench_bmap_range();
+    bench_grow_and_shrink();
+    bench_truncate_blocks();
+    bench_find_name_id();
+    bench_write_file();
+    bench_pwrite_file();
+    bench_append_file();
+    bench_insert_file();
+    bench_sparse_file();
+    bench_layout();
+    bench_small_writes(256);
+    bench_small_writes(64);
+    print_block_cache_stats(stdout);
+    print_inode_cache_stats(stdout);
+    return 0;
+}
@@ -0,0 +1,370 @@
+#include "include/inode.h"
+#include "include/disk_server.h"
+
+// ------------------------------------------------
+// Checks of the file layer against an in-memory model
+// Random edits run on a file of an in-memory disk and on a plain buffer, and after each
+// one the file must read back as the buffer. On a nearly full disk an edit may fail, and
+// then the file must be left as it was. Once the file and the filler are gone, every
+// block is free again.
+// ------------------------------------------------
+#define MODEL_SIZE 200000  // bytes a file may reach
+#define EDIT_NUM 3000      // edits of each run
+#define RUN_NUM 8          // seeds, each run once on an empty and once on a full disk
+#define APPENDER_NUM 8     // threads appending atomically
+#define RECORD_NUM 200     // records of each appender
+
+char model[MODEL_SIZE];
+int model_size;
+char content[MODEL_SIZE + 256];
+unsigned int seed;
+
+// ------------------------------------------------
+// Pseudo-random number below limit
+// ------------------------------------------------
+int random_below(int limit) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % limit;
+}
+
+// ------------------------------------------------
+// Format the in-memory disk
+// ------------------------------------------------
+void format_memory_disk() {
+    memset(MEMORY_DISK, 0, BLOCK_NUM * 256);
+    reset_block_cache();
+    reset_inode_cache();
+    init_bitmap();
+}
+
+// ------------------------------------------------
+// Blocks marked used in the bitmap
+// ------------------------------------------------
+int used_block_num() {
+    int used = 0;
+    for (int i = 0; i < BLOCK_NUM; i++) {
+        used += block_is_used(i);
+    }
+    return used;
+}
+
+// ------------------------------------------------
+// Compare the file with the model
+// return -1 and print where they differ
+// ------------------------------------------------
+int check_file(struct Inode *inode, int edit, char *name) {
+    if (inode->file_size != model_size) {
+        printf("Error: edit %d (%s) left %d bytes, the model has %d\n", edit, name, inode->file_size, model_size);
+        return -1;
+    }
+    memset(content, 0, sizeof(content));
+    read_file(inode, model_size, content);
+    if (memcmp(content, model, model_size) != 0) {
+        int i = 0;
+        while (content[i] == model[i]) {
+            i++;
+        }
+        printf("Error: edit %d (%s) differs from the model at byte %d\n", edit, name, i);
+        return -1;
+    }
+    if (model_size > 0) {
+        int pos = random_below(model_size);
+        int length = random_below(model_size - pos + 1);
+        read_file_range(inode, pos, length, content);
+        if (memcmp(content, model + pos, length) != 0) {
+            printf("Error: edit %d (%s) reads %d bytes at %d wrong\n", edit, name, length, pos);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// ------------------------------------------------
+// Grow the filler until the disk is full
+// ------------------------------------------------
+void fill_disk(struct Inode *filler) {
+    char block[256];
+    memset(block, 'f', sizeof(block));
+    while (append_file(filler, sizeof(block), block) == 0) {
+    }
+    end_command();
+    get_inode(filler->sector_id, filler);
+}
+
+// ------------------------------------------------
+// One random edit on the file and on the model
+// a failed edit leaves the model as it was, except write, which leaves the file empty
+// return the result of the edit, name gets its name
+// ------------------------------------------------
+int random_edit(struct Inode *inode, char *data, char **name) {
+    int length = 1 + random_below(random_below(4) == 0 ? 3000 : 200);
+    int pos;
+    int result;
+    for (int i = 0; i < length; i++) {
+        data[i] = 'a' + random_below(26);
+    }
+    switch (random_below(7)) {
+    case 0:
+        *name = "pwrite";
+        pos = random_below(model_size + 50);
+        if (random_below(4) == 0) {
+            pos = model_size + random_below(20000);
+        }
+        if (pos + length > MODEL_SIZE) {
+            return 0;
+        }
+        result = pwrite_file(inode, pos, length, data);
+        if (result == 0) {
+            if (pos > model_size) {
+                memset(model + model_size, 0, pos - model_size);
+            }
+            memcpy(model + pos, data, length);
+            if (pos + length > model_size) {
+                model_size = pos + length;
+            }
+        }
+        return result;
+    case 1:
+        *name = "insert";
+        pos = random_below(model_size + 1);
+        if (model_size + length > MODEL_SIZE) {
+            return 0;
+        }
+        result = insert_file(inode, pos, length, data);
+        if (result == 0) {
+            memmove(model + pos + length, model + pos, model_size - pos);
+            memcpy(model + pos, data, length);
+            model_size += length;
+        }
+        return result;
+    case 2:
+        *name = "delete";
+        if (model_size == 0) {
+            return 0;
+        }
+        pos = random_below(model_size);
+        if (random_below(5) == 0) {
+            length = model_size - pos + random_below(5);
+        }
+        result = delete_file_range(inode, pos, length);
+        if (result == 0) {
+            if (length > model_size - pos) {
+                length = model_size - pos;
+            }
+            memmove(model + pos, model + pos + length, model_size - pos - length);
+            model_size -= length;
+        }
+        return result;
+    case 3:
+        *name = "truncate";
+        pos = random_below(model_size + 3000);
+        if (random_below(3) == 0) {
+            pos = random_below(model_size + 1);
+        }
+        result = truncate_file(inode, pos);
+        if (result == 0) {
+            if (pos > model_size) {
+                memset(model + model_size, 0, pos - model_size);
+            }
+            model_size = pos;
+        }
+        return result;
+    case 4:
+        *name = "append";
+        if (model_size + length > MODEL_SIZE) {
+            return 0;
+        }
+        result = append_file(inode, length, data);
+        if (result == 0) {
+            memcpy(model + model_size, data, length);
+            model_size += length;
+        }
+        return result;
+    case 5:
+        *name = "atomic append";
+        if (model_size + length > MODEL_SIZE) {
+            return 0;
+        }
+        // *the edits run in one thread, so the record lands at the end; over holes it is
+        //  appended again as under the exclusive lock
+        result = append_file_atomic(inode->sector_id, length, data, &pos, 0);
+        if (result == -2) {
+            result = append_file_atomic(inode->sector_id, length, data, &pos, 1);
+        }
+        if (result == 0) {
+            if (pos != model_size) {
+                printf("Error: an atomic append landed at %d, the file had %d bytes\n", pos, model_size);
+                return -2;
+            }
+            memcpy(model + model_size, data, length);
+            model_size += length;
+        }
+        return result;
+    default:
+        if (random_below(4) != 0) {
+            return 0;
+        }
+        *name = "write";
+        result = write_file(inode, length, data);
+        memcpy(model, data, length);
+        model_size = result == 0 ? length : 0;
+        return result;
+    }
+}
+
+// ------------------------------------------------
+// Random edits of one file
+// full: a filler takes the free blocks, and gives some back now and then
+// return -1 if the file and the model differ or blocks leak
+// ------------------------------------------------
+int check_edits(unsigned int run_seed, int full) {
+    struct Inode inode;
+    struct Inode filler;
+    char data[3000];
+    int sector_id;
+    int fail_num = 0;
+
+    seed = run_seed;
+    model_size = 0;
+    format_memory_disk();
+    int used_start = used_block_num();
+    init_new_inode(&inode, &sector_id, -1, 0);
+    init_new_inode(&filler, &sector_id, -1, 0);
+    end_command();
+    get_inode(inode.sector_id, &inode);
+    get_inode(filler.sector_id, &filler);
+    if (full) {
+        fill_disk(&filler);
+    }
+
+    for (int edit = 0; edit < EDIT_NUM; edit++) {
+        char *name = "none";
+        int result = random_edit(&inode, data, &name);
+        if (result == -2 || (result == -1 && !full)) {
+            printf("Error: edit %d (%s) failed on a disk with room\n", edit, name);
+            return -1;
+        }
+        fail_num += result == -1;
+        end_command();
+        get_inode(inode.sector_id, &inode);
+        if (check_file(&inode, edit, name) == -1) {
+            return -1;
+        }
+        // *give the file some blocks, or take the free ones back
+        if (full && random_below(8) == 0) {
+            get_inode(filler.sector_id, &filler);
+            if (random_below(2) == 0) {
+                int size = filler.file_size - 256 * (1 + random_below(16));
+                truncate_file(&filler, size > 0 ? size : 0);
+                end_command();
+                get_inode(filler.sector_id, &filler);
+            } else {
+                fill_disk(&filler);
+            }
+        }
+    }
+
+    truncate_file(&inode, 0);
+    truncate_file(&filler, 0);
+    end_command();
+    get_inode(inode.sector_id, &inode);
+    get_inode(filler.sector_id, &filler);
+    // *the two inodes keep their own blocks
+    int used_end = used_block_num() - 2;
+    if (inode.block_num != 0 || inode.extent_num != 0 || used_end != used_start) {
+        printf("Error: %d blocks used after the run, %d before\n", used_end, used_start);
+        return -1;
+    }
+    printf("%-20s seed %-4u %s %5d failed edits\n", "edits", run_seed, full ? "full disk " : "empty disk", fail_num);
+    return 0;
+}
+
+// ------------------------------------------------
+// Concurrent atomic appends
+// every record must land whole in its own range
+// ------------------------------------------------
+int appender_file;
+int record_pos[APPENDER_NUM][RECORD_NUM];
+int record_length[APPENDER_NUM][RECORD_NUM];
+
+void *appender(void *arg) {
+    long id = (long)arg;
+    unsigned int state = id * 77 + 1;
+    char record[400];
+    for (int i = 0; i < RECORD_NUM; i++) {
+        state = state * 1103515245 + 12345;
+        int length = i % 17 == 0 ? 256 + (state >> 8) % 100 : 1 + (state >> 8) % 90;
+        memset(record, 'A' + id * 3 + i % 3, length);
+        begin_command(0, 1);
+        lock_inode(appender_file, 0);
+        if (append_file_atomic(appender_file, length, record, &record_pos[id][i], 0) != 0) {
+            record_length[id][i] = 0;
+        } else {
+            record_length[id][i] = length;
+        }
+        end_command();
+    }
+    return NULL;
+}
+
+int check_atomic_appends() {
+    struct Inode inode;
+    pthread_t thread[APPENDER_NUM];
+    int sector_id;
+    int bad = 0;
+    long total = 0;
+
+    format_memory_disk();
+    init_new_inode(&inode, &sector_id, -1, 0);
+    appender_file = inode.sector_id;
+    end_command();
+    for (long i = 0; i < APPENDER_NUM; i++) {
+        pthread_create(&thread[i], NULL, appender, (void *)i);
+    }
+    for (int i = 0; i < APPENDER_NUM; i++) {
+        pthread_join(thread[i], NULL);
+    }
+
+    get_inode(appender_file, &inode);
+    read_file(&inode, inode.file_size, content);
+    memset(model, 0, inode.file_size);
+    for (int id = 0; id < APPENDER_NUM; id++) {
+        for (int i = 0; i < RECORD_NUM; i++) {
+            total += record_length[id][i];
+            for (int j = 0; j < record_length[id][i]; j++) {
+                int pos = record_pos[id][i] + j;
+                // *model counts the records covering each byte
+                bad += model[pos]++ != 0 || content[pos] != 'A' + id * 3 + i % 3;
+            }
+        }
+    }
+    if (bad != 0 || total != inode.file_size) {
+        printf("Error: %d bad bytes, %ld bytes appended into a file of %d\n", bad, total, inode.file_size);
+        return -1;
+    }
+    printf("%-20s %d threads x %d records, %d bytes\n", "atomic appends", APPENDER_NUM, RECORD_NUM, inode.file_size);
+    return 0;
+}
+
+// ------------------------------------------------
+// Main function
+// ------------------------------------------------
+int main() {
+    // * Initial the shared state and the in-memory disk
+    if (init_shared_state() == -1 || open_memory_device(BLOCK_NUM) == -1) {
+        fprintf(stderr, "Error: failed to allocate memory for the disk\n");
+        exit(1);
+    }
+
+    // * Run the checks
+    for (unsigned int run = 1; run <= RUN_NUM; run++) {
+        if (check_edits(run, 0) == -1 || check_edits(run, 1) == -1) {
+            exit(1);
+        }
+    }
+    if (check_atomic_appends() == -1) {
+        exit(1);
+    }
+    printf("all checks passed\n");
+    return 0;
+}
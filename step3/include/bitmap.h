@@ -0,0 +1,450 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "block_device.h"
+// ---------------------------------
+// Block bitmap
+// ---------------------------------
+// bit i of BITMAP->block_bitmap is 1 when block i is used, 0 when it is free
+// only BITMAP->block_bitmap is stored on disk, in the first BITMAP_SECTOR_NUM sectors;
+// the summaries below are rebuilt from it whenever it is loaded
+// ---------------------------------
+// level 0: BITMAP->block_bitmap, 64 blocks per word
+// level 1: BITMAP->bitmap_full_word, one word per group, bit w is 1 when word w of the group is full
+// level 2: BITMAP->bitmap_free_group, bit g is 1 when group g has a free block
+// every group also keeps its free count in BITMAP->bitmap_group_free
+// ---------------------------------
+// the bitmap in memory is the source of truth; BITMAP->bitmap_dirty_sector remembers which
+// bitmap sectors changed since they were last stored, so only those are written back
+// ---------------------------------
+// cylinder groups: GROUP_CYLINDERS neighbouring cylinders of the BDS form a group, and
+// BITMAP->cylinder_group_free counts the free blocks of every group for the allocator
+// ---------------------------------
+// log-structured layout (LOG_STRUCTURED 1): every new block, data or metadata, is taken at
+// BITMAP->log_head; the log fills the free blocks of its segment, one cylinder, then moves
+// on to the lowest clean segment, so new blocks reach the BDS nearly in sector order and
+// stay close to the journal at the front of the disk; the cleaner empties segments with
+// few used blocks, and the log skips BITMAP->log_victim, the segment being cleaned
+// ---------------------------------
+// a block freed by a command stays taken until its group is committed: the journal may
+// still hold an inode that points at it, and a replay after a crash would bring that back,
+// so new data must not land in it before the commit; mark_block_free only records the
+// block in BITMAP->pending_free, store_bitmap stores it as free, and journal_commit calls
+// release_freed_blocks once the transaction is on the disk
+// ---------------------------------
+// BITMAP->lock is recursive: the functions that change the bitmap take it, and so does a
+// caller that searches for a free block and then marks it, so no other command can take
+// the same block in between; block_is_used reads one word and does not lock
+// ---------------------------------
+#ifndef BLOCK_NUM
+#define BLOCK_NUM 1024
+#endif
+#define BITMAP_WORD_NUM ((BLOCK_NUM + 63) / 64)
+#define BITMAP_GROUP_WORDS 64
+#define BITMAP_GROUP_BLOCKS (BITMAP_GROUP_WORDS * 64)
+#define BITMAP_GROUP_NUM ((BITMAP_WORD_NUM + BITMAP_GROUP_WORDS - 1) / BITMAP_GROUP_WORDS)
+#define BITMAP_SECTOR_NUM ((BITMAP_WORD_NUM * 8 + 255) / 256)
+#ifndef GROUP_CYLINDERS
+#define GROUP_CYLINDERS 4
+#endif
+#define CYLINDER_GROUP_BLOCKS (GROUP_CYLINDERS * CYLINDER_SECTORS)
+#define CYLINDER_GROUP_NUM ((BLOCK_NUM + CYLINDER_GROUP_BLOCKS - 1) / CYLINDER_GROUP_BLOCKS)
+#ifndef LOG_STRUCTURED
+#define LOG_STRUCTURED 0
+#endif
+#define SEGMENT_BLOCKS CYLINDER_SECTORS
+#define SEGMENT_NUM ((BLOCK_NUM + SEGMENT_BLOCKS - 1) / SEGMENT_BLOCKS)
+// the bitmap state lives in the shared state of the sessions
+struct Bitmap_state {
+    pthread_mutex_t lock;
+    uint64_t block_bitmap[BITMAP_SECTOR_NUM * 32];
+    uint64_t bitmap_full_word[BITMAP_GROUP_NUM];
+    int bitmap_group_free[BITMAP_GROUP_NUM];
+    uint64_t bitmap_free_group[(BITMAP_GROUP_NUM + 63) / 64];
+    uint64_t bitmap_dirty_sector[(BITMAP_SECTOR_NUM + 63) / 64];
+    uint64_t pending_free[BITMAP_SECTOR_NUM * 32];  // freed in the running group
+    int cylinder_group_free[CYLINDER_GROUP_NUM];
+    int log_head;
+    int log_victim;  // -1 when the cleaner is idle
+    long cleaned_num;
+    long log_block_num;  // blocks the log has taken
+};
+struct Bitmap_state* BITMAP = NULL;
+// ---------------------------------
+// take or release the bitmap lock
+// ---------------------------------
+void lock_bitmap() {
+    pthread_mutex_lock(&BITMAP->lock);
+}
+void unlock_bitmap() {
+    pthread_mutex_unlock(&BITMAP->lock);
+}
+// ---------------------------------
+// whether the block is used
+// ---------------------------------
+int block_is_used(int id) {
+    return (BITMAP->block_bitmap[id >> 6] >> (id & 63)) & 1;
+}
+// ---------------------------------
+// rebuild all summaries from BITMAP->block_bitmap
+// ---------------------------------
+void rebuild_bitmap_summary() {
+    // the bits after the last block never become free
+    if (BLOCK_NUM % 64 != 0) {
+        BITMAP->block_bitmap[BITMAP_WORD_NUM - 1] |= ~0ULL << (BLOCK_NUM % 64);
+    }
+    memset(BITMAP->bitmap_free_group, 0, sizeof(BITMAP->bitmap_free_group));
+    for (int g = 0; g < BITMAP_GROUP_NUM; g++) {
+        uint64_t full = 0;
+        int free_num = 0;
+        for (int k = 0; k < BITMAP_GROUP_WORDS; k++) {
+            int w = g * BITMAP_GROUP_WORDS + k;
+            if (w >= BITMAP_WORD_NUM || BITMAP->block_bitmap[w] == ~0ULL) {
+                full |= 1ULL << k;
+            } else {
+                free_num += 64 - __builtin_popcountll(BITMAP->block_bitmap[w]);
+            }
+        }
+        BITMAP->bitmap_full_word[g] = full;
+        BITMAP->bitmap_group_free[g] = free_num;
+        if (free_num > 0) {
+            BITMAP->bitmap_free_group[g >> 6] |= 1ULL << (g & 63);
+        }
+    }
+    for (int c = 0; c < CYLINDER_GROUP_NUM; c++) {
+        BITMAP->cylinder_group_free[c] = 0;
+    }
+    for (int id = 0; id < BLOCK_NUM; id++) {
+        if (!block_is_used(id)) {
+            BITMAP->cylinder_group_free[id / CYLINDER_GROUP_BLOCKS]++;
+        }
+    }
+    // nothing is waiting for a commit
+    memset(BITMAP->pending_free, 0, sizeof(BITMAP->pending_free));
+    // the log starts over at the first clean segment
+    BITMAP->log_head = 0;
+    BITMAP->log_victim = -1;
+}
+// ---------------------------------
+// mark the bitmap sector holding word w as dirty
+// ---------------------------------
+void mark_bitmap_dirty(int w) {
+    int sector = w / 32;
+    BITMAP->bitmap_dirty_sector[sector >> 6] |= 1ULL << (sector & 63);
+}
+// ---------------------------------
+// clear the whole bitmap
+// ---------------------------------
+void clear_bitmap() {
+    lock_bitmap();
+    memset(BITMAP->block_bitmap, 0, sizeof(BITMAP->block_bitmap));
+    rebuild_bitmap_summary();
+    for (int i = 0; i < BITMAP_SECTOR_NUM; i++) {
+        BITMAP->bitmap_dirty_sector[i >> 6] |= 1ULL << (i & 63);
+    }
+    unlock_bitmap();
+}
+// ---------------------------------
+// whether the block was freed in the running group
+// ---------------------------------
+int block_is_pending_free(int id) {
+    return (BITMAP->pending_free[id >> 6] >> (id & 63)) & 1;
+}
+// ---------------------------------
+// mark the block as used
+// ---------------------------------
+void mark_block_used(int id) {
+    lock_bitmap();
+    // *a block freed in the running group is taken back before it was ever free
+    if (block_is_pending_free(id)) {
+        BITMAP->pending_free[id >> 6] &= ~(1ULL << (id & 63));
+        mark_bitmap_dirty(id >> 6);
+    } else if (!block_is_used(id)) {
+        int w = id >> 6;
+        int g = w / BITMAP_GROUP_WORDS;
+        BITMAP->block_bitmap[w] |= 1ULL << (id & 63);
+        mark_bitmap_dirty(w);
+        BITMAP->cylinder_group_free[id / CYLINDER_GROUP_BLOCKS]--;
+        if (BITMAP->block_bitmap[w] == ~0ULL) {
+            BITMAP->bitmap_full_word[g] |= 1ULL << (w % BITMAP_GROUP_WORDS);
+        }
+        if (--BITMAP->bitmap_group_free[g] == 0) {
+            BITMAP->bitmap_free_group[g >> 6] &= ~(1ULL << (g & 63));
+        }
+    }
+    unlock_bitmap();
+}
+// ---------------------------------
+// give the block back to the allocator
+// ---------------------------------
+void release_block(int id) {
+    if (block_is_used(id)) {
+        int w = id >> 6;
+        int g = w / BITMAP_GROUP_WORDS;
+        BITMAP->block_bitmap[w] &= ~(1ULL << (id & 63));
+        mark_bitmap_dirty(w);
+        BITMAP->cylinder_group_free[id / CYLINDER_GROUP_BLOCKS]++;
+        BITMAP->bitmap_full_word[g] &= ~(1ULL << (w % BITMAP_GROUP_WORDS));
+        if (BITMAP->bitmap_group_free[g]++ == 0) {
+            BITMAP->bitmap_free_group[g >> 6] |= 1ULL << (g & 63);
+        }
+    }
+}
+// ---------------------------------
+// mark the block as free, the allocator gets it once the group is committed
+// ---------------------------------
+void mark_block_free(int id) {
+    lock_bitmap();
+    if (block_is_used(id) && !block_is_pending_free(id)) {
+        BITMAP->pending_free[id >> 6] |= 1ULL << (id & 63);
+        mark_bitmap_dirty(id >> 6);
+    }
+    unlock_bitmap();
+}
+// ---------------------------------
+// the group is committed: the blocks it freed can be allocated again
+// ---------------------------------
+void release_freed_blocks() {
+    lock_bitmap();
+    for (int w = 0; w < BITMAP_WORD_NUM; w++) {
+        while (BITMAP->pending_free[w] != 0) {
+            int id = w * 64 + __builtin_ctzll(BITMAP->pending_free[w]);
+            BITMAP->pending_free[w] &= BITMAP->pending_free[w] - 1;
+            release_block(id);
+        }
+    }
+    unlock_bitmap();
+}
+// ---------------------------------
+// find the lowest free block without marking it
+// each level is searched with one count-trailing-zeros, so the cost does not
+// grow with the number of used blocks in front of the free one
+// ---------------------------------
+int search_free_block() {
+    for (int i = 0; i < (BITMAP_GROUP_NUM + 63) / 64; i++) {
+        if (BITMAP->bitmap_free_group[i] == 0) {
+            continue;
+        }
+        int g = i * 64 + __builtin_ctzll(BITMAP->bitmap_free_group[i]);
+        int w = g * BITMAP_GROUP_WORDS + __builtin_ctzll(~BITMAP->bitmap_full_word[g]);
+        return w * 64 + __builtin_ctzll(~BITMAP->block_bitmap[w]);
+    }
+    return -1;
+}
+// ---------------------------------
+// find the first free block at or after goal without marking it
+// it falls back to the lowest free block, so a file grows into the block right
+// after its last one whenever that block is still free
+// ---------------------------------
+int search_free_block_from(int goal) {
+    if (goal <= 0 || goal >= BLOCK_NUM) {
+        return search_free_block();
+    }
+    // the word of the goal
+    int w = goal >> 6;
+    uint64_t free_bits = ~BITMAP->block_bitmap[w] & (~0ULL << (goal & 63));
+    if (free_bits != 0) {
+        return w * 64 + __builtin_ctzll(free_bits);
+    }
+    // the later words of the same group
+    int g = w / BITMAP_GROUP_WORDS;
+    int k = w % BITMAP_GROUP_WORDS;
+    uint64_t free_words = k == BITMAP_GROUP_WORDS - 1 ? 0 : ~BITMAP->bitmap_full_word[g] & (~0ULL << (k + 1));
+    if (free_words != 0) {
+        w = g * BITMAP_GROUP_WORDS + __builtin_ctzll(free_words);
+        return w * 64 + __builtin_ctzll(~BITMAP->block_bitmap[w]);
+    }
+    // the later groups
+    for (int i = (g + 1) >> 6; i < (BITMAP_GROUP_NUM + 63) / 64; i++) {
+        uint64_t free_groups = BITMAP->bitmap_free_group[i];
+        if (i == (g + 1) >> 6) {
+            free_groups &= ~0ULL << ((g + 1) & 63);
+        }
+        if (free_groups == 0) {
+            continue;
+        }
+        int h = i * 64 + __builtin_ctzll(free_groups);
+        w = h * BITMAP_GROUP_WORDS + __builtin_ctzll(~BITMAP->bitmap_full_word[h]);
+        return w * 64 + __builtin_ctzll(~BITMAP->block_bitmap[w]);
+    }
+    return search_free_block();
+}
+// ---------------------------------
+// find the first free block at or after pos, BLOCK_NUM if there is none
+// ---------------------------------
+int next_free_block(int pos) {
+    int w = pos >> 6;
+    uint64_t free_bits = ~BITMAP->block_bitmap[w] & (~0ULL << (pos & 63));
+    while (free_bits == 0) {
+        if (++w >= BITMAP_WORD_NUM) {
+            return BLOCK_NUM;
+        }
+        free_bits = ~BITMAP->block_bitmap[w];
+    }
+    int id = w * 64 + __builtin_ctzll(free_bits);
+    return id < BLOCK_NUM ? id : BLOCK_NUM;
+}
+// ---------------------------------
+// find the first used block at or after pos, BLOCK_NUM if there is none
+// ---------------------------------
+int next_used_block(int pos) {
+    int w = pos >> 6;
+    uint64_t used_bits = BITMAP->block_bitmap[w] & (~0ULL << (pos & 63));
+    while (used_bits == 0) {
+        if (++w >= BITMAP_WORD_NUM) {
+            return BLOCK_NUM;
+        }
+        used_bits = BITMAP->block_bitmap[w];
+    }
+    int id = w * 64 + __builtin_ctzll(used_bits);
+    return id < BLOCK_NUM ? id : BLOCK_NUM;
+}
+// ---------------------------------
+// find a run of want free blocks without marking it
+// first fit from goal to the end of the disk, then from the start to goal;
+// without a run that long, the longest run is returned
+// return the first block of the run and its usable length in length, -1 if the disk is full
+// ---------------------------------
+int search_free_run(int goal, int want, int* length) {
+    int best_start = -1;
+    int best_length = 0;
+    if (goal < 0 || goal >= BLOCK_NUM) {
+        goal = 0;
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        int pos = pass == 0 ? goal : 0;
+        int stop = pass == 0 ? BLOCK_NUM : goal;
+        while (pos < stop) {
+            int start = next_free_block(pos);
+            if (start >= stop) {
+                break;
+            }
+            int end = next_used_block(start);
+            if (end - start >= want) {
+                *length = want;
+                return start;
+            }
+            if (end - start > best_length) {
+                best_start = start;
+                best_length = end - start;
+            }
+            pos = end;
+        }
+    }
+    *length = best_length;
+    return best_start;
+}
+// ---------------------------------
+// find a free block in the cylinder group of goal without marking it
+// first at or after goal, then from the start of the group; a full group spills
+// over to the following blocks
+// ---------------------------------
+int search_free_block_near(int goal) {
+    if (goal < 0 || goal >= BLOCK_NUM) {
+        return search_free_block();
+    }
+    int group_start = goal - goal % CYLINDER_GROUP_BLOCKS;
+    int group_end = group_start + CYLINDER_GROUP_BLOCKS < BLOCK_NUM ? group_start + CYLINDER_GROUP_BLOCKS : BLOCK_NUM;
+    int id = next_free_block(goal);
+    if (id < group_end) {
+        return id;
+    }
+    id = next_free_block(group_start);
+    if (id < goal) {
+        return id;
+    }
+    return search_free_block_from(goal);
+}
+// ---------------------------------
+// the cylinder group with the most free blocks, the lowest one on a tie
+// ---------------------------------
+int least_used_cylinder_group() {
+    int best = 0;
+    for (int c = 1; c < CYLINDER_GROUP_NUM; c++) {
+        if (BITMAP->cylinder_group_free[c] > BITMAP->cylinder_group_free[best]) {
+            best = c;
+        }
+    }
+    return best;
+}
+// ---------------------------------
+// the number of free blocks
+// ---------------------------------
+int free_block_num() {
+    int free_num = 0;
+    for (int c = 0; c < CYLINDER_GROUP_NUM; c++) {
+        free_num += BITMAP->cylinder_group_free[c];
+    }
+    return free_num;
+}
+// ---------------------------------
+// the number of used blocks in the segment
+// ---------------------------------
+int segment_used(int segment) {
+    int end = (segment + 1) * SEGMENT_BLOCKS < BLOCK_NUM ? (segment + 1) * SEGMENT_BLOCKS : BLOCK_NUM;
+    int used = 0;
+    for (int id = segment * SEGMENT_BLOCKS; id < end; id++) {
+        used += block_is_used(id);
+    }
+    return used;
+}
+// ---------------------------------
+// the number of free blocks a new block can be taken from: the victim of the cleaner is
+// left out, and a block freed in the running group is not free yet
+// ---------------------------------
+int allocatable_block_num() {
+    int free_num = free_block_num();
+    if (BITMAP->log_victim != -1) {
+        int start = BITMAP->log_victim * SEGMENT_BLOCKS;
+        int end = start + SEGMENT_BLOCKS < BLOCK_NUM ? start + SEGMENT_BLOCKS : BLOCK_NUM;
+        free_num -= end - start - segment_used(BITMAP->log_victim);
+    }
+    return free_num;
+}
+// ---------------------------------
+// find the next run of at most want free blocks of the log without marking it, and move
+// the head of the log after it
+// the log fills its segment, then moves to the lowest clean segment, and only when no
+// segment is clean to the next free block around the disk; the victim of the cleaner
+// is never used
+// return the first block of the run and its length in length, -1 if the disk is full
+// ---------------------------------
+int search_log_run(int want, int* length) {
+    int victim = BITMAP->log_victim;
+    int segment = BITMAP->log_head / SEGMENT_BLOCKS;
+    int segment_end = (segment + 1) * SEGMENT_BLOCKS < BLOCK_NUM ? (segment + 1) * SEGMENT_BLOCKS : BLOCK_NUM;
+    int start = -1;
+    if (segment != victim && next_free_block(BITMAP->log_head) < segment_end) {
+        start = next_free_block(BITMAP->log_head);
+    }
+    for (int s = 0; start == -1 && s < SEGMENT_NUM; s++) {
+        if (s != segment && s != victim && segment_used(s) == 0) {
+            start = s * SEGMENT_BLOCKS;
+        }
+    }
+    for (int pass = 0; start == -1 && pass < 2; pass++) {
+        int pos = pass == 0 ? BITMAP->log_head : 0;
+        while (pos < BLOCK_NUM) {
+            int id = next_free_block(pos);
+            if (id >= BLOCK_NUM || id / SEGMENT_BLOCKS != victim) {
+                start = id < BLOCK_NUM ? id : -1;
+                break;
+            }
+            pos = (victim + 1) * SEGMENT_BLOCKS;
+        }
+    }
+    if (start == -1) {
+        return -1;
+    }
+    int end = next_used_block(start);
+    if (victim != -1 && start < victim * SEGMENT_BLOCKS && end > victim * SEGMENT_BLOCKS) {
+        end = victim * SEGMENT_BLOCKS;
+    }
+    *length = end - start < want ? end - start : want;
+    BITMAP->log_head = (start + *length) % BLOCK_NUM;
+    BITMAP->log_block_num += *length;
+    return start;
+}
+#endif
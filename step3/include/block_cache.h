@@ -0,0 +1,512 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "block_device.h"
+#include "journal.h"
+// ---------------------------------
+// Block buffer cache
+// ---------------------------------
+// a fixed number of sectors kept in memory in front of the block device
+// lookup: hash chains keyed by sector id
+// eviction: CLOCK, a dirty victim is written back before its slot is reused
+// write-back: a commit of the journal writes the dirty file data to its sectors and logs
+//             the dirty metadata, which stays dirty until a checkpoint or an eviction,
+//             see journal.h
+// metadata the journal has not committed, and data over a sector the journal still holds
+// an older copy of, may not reach its sector yet, so CLOCK passes over them; when nothing
+// else is left, a checkpoint unpins the data, and if every slot still holds uncommitted
+// metadata the cache grows into BLOCK_CACHE_SPARE_SIZE spare slots and the journal stops
+// starting commands, so the group commits and the cache shrinks back; the credits of the
+// journal keep the uncommitted metadata within JOURNAL_META_MAX blocks, far below the size
+// of the cache, so the spare slots never run out
+// ---------------------------------
+// the cache is shared by every session; each of the functions below holds BLOCK_CACHE->lock,
+// the device exchange of a miss or a write-back included, so the cache is never seen
+// half updated
+// ---------------------------------
+#ifndef BLOCK_CACHE_SIZE
+#define BLOCK_CACHE_SIZE 512
+#endif
+#ifndef BLOCK_CACHE_SPARE_SIZE
+#define BLOCK_CACHE_SPARE_SIZE BLOCK_CACHE_SIZE
+#endif
+#define BLOCK_CACHE_MAX_SIZE (BLOCK_CACHE_SIZE + BLOCK_CACHE_SPARE_SIZE)
+#define BLOCK_CACHE_HASH_SIZE (BLOCK_CACHE_SIZE * 2)
+struct Cache_entry {
+    int sector_id;   // -1 when the slot is empty
+    int dirty;       // the data differs from the device
+    int meta;        // the sector holds metadata, it is written through the journal
+    int logged;      // metadata: the data is committed to the journal
+    int referenced;  // CLOCK reference bit
+    int next;        // next slot in the hash chain
+    char data[SECTOR_SIZE];
+};
+// the cache lives in the shared state of the sessions, see init_shared_state
+struct Block_cache_state {
+    pthread_mutex_t lock;
+    struct Cache_entry entry[BLOCK_CACHE_MAX_SIZE];
+    int hash[BLOCK_CACHE_HASH_SIZE];
+    int hand;
+    int size;        // slots in use, more than BLOCK_CACHE_SIZE while the cache has grown
+    // statistics
+    long hit_num;
+    long miss_num;
+    long writeback_num;
+    long forced_num;
+    long grown_num;
+};
+struct Block_cache_state* BLOCK_CACHE = NULL;
+// ---------------------------------
+// empty the cache, dirty data is lost
+// ---------------------------------
+void reset_block_cache() {
+    for (int i = 0; i < BLOCK_CACHE_MAX_SIZE; i++) {
+        BLOCK_CACHE->entry[i].sector_id = -1;
+        BLOCK_CACHE->entry[i].dirty = 0;
+        BLOCK_CACHE->entry[i].meta = 0;
+        BLOCK_CACHE->entry[i].logged = 0;
+        BLOCK_CACHE->entry[i].referenced = 0;
+        BLOCK_CACHE->entry[i].next = -1;
+    }
+    for (int i = 0; i < BLOCK_CACHE_HASH_SIZE; i++) {
+        BLOCK_CACHE->hash[i] = -1;
+    }
+    BLOCK_CACHE->hand = 0;
+    BLOCK_CACHE->size = BLOCK_CACHE_SIZE;
+}
+// ---------------------------------
+// find the slot of the sector, -1 if it is not cached
+// ---------------------------------
+int lookup_block_cache(int sector_id) {
+    int slot = BLOCK_CACHE->hash[sector_id % BLOCK_CACHE_HASH_SIZE];
+    while (slot != -1 && BLOCK_CACHE->entry[slot].sector_id != sector_id) {
+        slot = BLOCK_CACHE->entry[slot].next;
+    }
+    return slot;
+}
+// ---------------------------------
+// remove the slot from its hash chain
+// ---------------------------------
+void unlink_block_cache(int slot) {
+    int* p = &BLOCK_CACHE->hash[BLOCK_CACHE->entry[slot].sector_id % BLOCK_CACHE_HASH_SIZE];
+    while (*p != slot) {
+        p = &BLOCK_CACHE->entry[*p].next;
+    }
+    *p = BLOCK_CACHE->entry[slot].next;
+}
+// ---------------------------------
+// compare two slots by sector id
+// ---------------------------------
+int compare_cache_slot(const void* a, const void* b) {
+    return BLOCK_CACHE->entry[*(const int*)a].sector_id - BLOCK_CACHE->entry[*(const int*)b].sector_id;
+}
+// ---------------------------------
+// write the slots, sorted by sector id, back in batches
+// ---------------------------------
+void write_back_block_cache(int* slot, int count) {
+    int batch_id[DEVICE_BATCH_NUM];
+    char batch_data[DEVICE_BATCH_NUM * SECTOR_SIZE];
+    for (int done = 0; done < count; done += DEVICE_BATCH_NUM) {
+        int batch = count - done < DEVICE_BATCH_NUM ? count - done : DEVICE_BATCH_NUM;
+        for (int i = 0; i < batch; i++) {
+            struct Cache_entry* entry = &BLOCK_CACHE->entry[slot[done + i]];
+            batch_id[i] = entry->sector_id;
+            memcpy(batch_data + i * SECTOR_SIZE, entry->data, SECTOR_SIZE);
+            entry->dirty = 0;
+        }
+        device_write_blocks(batch_id, batch, batch_data);
+        BLOCK_CACHE->writeback_num += batch;
+    }
+}
+// ---------------------------------
+// whether the dirty slot must wait for the journal
+// ---------------------------------
+int block_cache_pinned(int slot) {
+    struct Cache_entry* entry = &BLOCK_CACHE->entry[slot];
+    if (!entry->dirty) {
+        return 0;
+    }
+    if (entry->meta) {
+        return !entry->logged;
+    }
+    return JOURNAL->journal_pos[entry->sector_id] != -1;
+}
+// ---------------------------------
+// checkpoint: write the last committed copy of every sector in the journal to the sector,
+// then empty the ring
+// the copy is the cached block when it is logged and still dirty, otherwise it is read back
+// from the ring if the cached block has changed since, and a clean or evicted block is
+// already on its sector
+// ---------------------------------
+void checkpoint_block_cache() {
+    int batch_id[DEVICE_BATCH_NUM];
+    char batch_data[DEVICE_BATCH_NUM * SECTOR_SIZE];
+    int batch = 0;
+    for (int id = 0; id < BLOCK_NUM; id++) {
+        int pos = JOURNAL->journal_pos[id];
+        if (pos == -1) {
+            continue;
+        }
+        JOURNAL->journal_pos[id] = -1;
+        int slot = lookup_block_cache(id);
+        if (slot == -1 || !BLOCK_CACHE->entry[slot].dirty) {
+            continue;
+        }
+        struct Cache_entry* entry = &BLOCK_CACHE->entry[slot];
+        if (entry->meta && entry->logged) {
+            memcpy(batch_data + batch * SECTOR_SIZE, entry->data, SECTOR_SIZE);
+            entry->dirty = 0;
+        } else {
+            device_read_block(journal_sector(pos), batch_data + batch * SECTOR_SIZE);
+        }
+        batch_id[batch++] = id;
+        if (batch == DEVICE_BATCH_NUM) {
+            device_write_blocks(batch_id, batch, batch_data);
+            BLOCK_CACHE->writeback_num += batch;
+            batch = 0;
+        }
+    }
+    if (batch > 0) {
+        device_write_blocks(batch_id, batch, batch_data);
+        BLOCK_CACHE->writeback_num += batch;
+    }
+    // *every committed block is on its sector, so replay starts at head
+    JOURNAL->tail = JOURNAL->head;
+    JOURNAL->tail_sequence = JOURNAL->sequence;
+    JOURNAL->used = 0;
+    store_superblock();
+    JOURNAL->checkpoint_num++;
+}
+// ---------------------------------
+// pick a slot for the sector with CLOCK
+// ---------------------------------
+int allocate_block_cache(int sector_id) {
+    int slot;
+    int limit = 2 * BLOCK_CACHE->size;
+    int checkpointed = 0;
+    for (int step = 0;; step++) {
+        slot = BLOCK_CACHE->hand;
+        BLOCK_CACHE->hand = (BLOCK_CACHE->hand + 1) % BLOCK_CACHE->size;
+        if (BLOCK_CACHE->entry[slot].sector_id == -1) {
+            break;
+        }
+        if (BLOCK_CACHE->entry[slot].referenced) {
+            BLOCK_CACHE->entry[slot].referenced = 0;
+            continue;
+        }
+        // *two sweeps clear every reference bit; when they found no victim the ring is
+        //  checkpointed, which unpins the data and the committed metadata, and one more
+        //  sweep looks for them
+        if (block_cache_pinned(slot)) {
+            if (step < limit) {
+                continue;
+            }
+            if (!checkpointed) {
+                checkpoint_block_cache();
+                BLOCK_CACHE->forced_num++;
+                checkpointed = 1;
+                limit = step + BLOCK_CACHE->size;
+                continue;
+            }
+            // *only uncommitted metadata is left, it may not reach its sector before the
+            //  commit, so a spare slot is taken instead
+            if (BLOCK_CACHE->size < BLOCK_CACHE_MAX_SIZE) {
+                slot = BLOCK_CACHE->size++;
+                BLOCK_CACHE->grown_num++;
+                break;
+            }
+            fprintf(stderr, "Error: the block cache is full of uncommitted metadata\n");
+            exit(1);
+        }
+        // *the victim is written back under pressure
+        if (BLOCK_CACHE->entry[slot].dirty) {
+            device_write_block(BLOCK_CACHE->entry[slot].sector_id, BLOCK_CACHE->entry[slot].data);
+            BLOCK_CACHE->writeback_num++;
+        }
+        unlink_block_cache(slot);
+        break;
+    }
+    int bucket = sector_id % BLOCK_CACHE_HASH_SIZE;
+    BLOCK_CACHE->entry[slot].sector_id = sector_id;
+    BLOCK_CACHE->entry[slot].dirty = 0;
+    BLOCK_CACHE->entry[slot].meta = 0;
+    BLOCK_CACHE->entry[slot].logged = 0;
+    BLOCK_CACHE->entry[slot].referenced = 1;
+    BLOCK_CACHE->entry[slot].next = BLOCK_CACHE->hash[bucket];
+    BLOCK_CACHE->hash[bucket] = slot;
+    return slot;
+}
+// ---------------------------------
+// whether the cache has grown into its spare slots, the journal then stops starting
+// commands until the group commits
+// ---------------------------------
+int block_cache_grown() {
+    pthread_mutex_lock(&BLOCK_CACHE->lock);
+    int grown = BLOCK_CACHE->size > BLOCK_CACHE_SIZE;
+    pthread_mutex_unlock(&BLOCK_CACHE->lock);
+    return grown;
+}
+// ---------------------------------
+// count the metadata blocks the journal has not committed
+// ---------------------------------
+int block_cache_unlogged_num() {
+    int unlogged_num = 0;
+    pthread_mutex_lock(&BLOCK_CACHE->lock);
+    for (int i = 0; i < BLOCK_CACHE->size; i++) {
+        struct Cache_entry* entry = &BLOCK_CACHE->entry[i];
+        unlogged_num += entry->sector_id != -1 && entry->dirty && entry->meta && !entry->logged;
+    }
+    pthread_mutex_unlock(&BLOCK_CACHE->lock);
+    return unlogged_num;
+}
+// ---------------------------------
+// give the spare slots back after a commit
+// their metadata is logged now, so the dirty ones may be written to their sectors
+// ---------------------------------
+void shrink_block_cache() {
+    int dirty_slot[BLOCK_CACHE_SPARE_SIZE];
+    int dirty_num = 0;
+    for (int i = BLOCK_CACHE_SIZE; i < BLOCK_CACHE->size; i++) {
+        if (BLOCK_CACHE->entry[i].sector_id != -1 && BLOCK_CACHE->entry[i].dirty) {
+            dirty_slot[dirty_num++] = i;
+        }
+    }
+    qsort(dirty_slot, dirty_num, sizeof(int), compare_cache_slot);
+    write_back_block_cache(dirty_slot, dirty_num);
+    for (int i = BLOCK_CACHE_SIZE; i < BLOCK_CACHE->size; i++) {
+        if (BLOCK_CACHE->entry[i].sector_id != -1) {
+            unlink_block_cache(i);
+            BLOCK_CACHE->entry[i].sector_id = -1;
+        }
+    }
+    BLOCK_CACHE->size = BLOCK_CACHE_SIZE;
+    BLOCK_CACHE->hand %= BLOCK_CACHE_SIZE;
+}
+// ---------------------------------
+// read a sector through the cache
+// ---------------------------------
+int cache_read_block(int sector_id, char* data) {
+    pthread_mutex_lock(&BLOCK_CACHE->lock);
+    int slot = lookup_block_cache(sector_id);
+    if (slot != -1) {
+        BLOCK_CACHE->hit_num++;
+        BLOCK_CACHE->entry[slot].referenced = 1;
+        memcpy(data, BLOCK_CACHE->entry[slot].data, SECTOR_SIZE);
+        pthread_mutex_unlock(&BLOCK_CACHE->lock);
+        return 0;
+    }
+    BLOCK_CACHE->miss_num++;
+    slot = allocate_block_cache(sector_id);
+    if (device_read_block(sector_id, BLOCK_CACHE->entry[slot].data) == -1) {
+        unlink_block_cache(slot);
+        BLOCK_CACHE->entry[slot].sector_id = -1;
+        pthread_mutex_unlock(&BLOCK_CACHE->lock);
+        return -1;
+    }
+    memcpy(data, BLOCK_CACHE->entry[slot].data, SECTOR_SIZE);
+    pthread_mutex_unlock(&BLOCK_CACHE->lock);
+    return 0;
+}
+// ---------------------------------
+// write a sector into the cache
+// the whole sector is replaced, so a miss does not read the device
+// meta: the sector holds metadata
+// ---------------------------------
+int cache_write_block(int sector_id, char* data, int meta) {
+    pthread_mutex_lock(&BLOCK_CACHE->lock);
+    int slot = lookup_block_cache(sector_id);
+    if (slot == -1) {
+        slot = allocate_block_cache(sector_id);
+    }
+    memcpy(BLOCK_CACHE->entry[slot].data, data, SECTOR_SIZE);
+    BLOCK_CACHE->entry[slot].dirty = 1;
+    BLOCK_CACHE->entry[slot].meta = meta;
+    BLOCK_CACHE->entry[slot].logged = 0;
+    BLOCK_CACHE->entry[slot].referenced = 1;
+    pthread_mutex_unlock(&BLOCK_CACHE->lock);
+    return 0;
+}
+// ---------------------------------
+// read count sectors through the cache
+// all misses are fetched from the device in one batch
+// ---------------------------------
+int cache_read_blocks(int* sector_id, int count, char* data) {
+    int miss_id[DEVICE_BATCH_NUM];
+    int miss_index[DEVICE_BATCH_NUM];
+    char miss_data[DEVICE_BATCH_NUM * SECTOR_SIZE];
+    pthread_mutex_lock(&BLOCK_CACHE->lock);
+    for (int done = 0; done < count; done += DEVICE_BATCH_NUM) {
+        int batch = count - done < DEVICE_BATCH_NUM ? count - done : DEVICE_BATCH_NUM;
+        int miss_num = 0;
+        for (int i = done; i < done + batch; i++) {
+            int slot = lookup_block_cache(sector_id[i]);
+            if (slot != -1) {
+                BLOCK_CACHE->hit_num++;
+                BLOCK_CACHE->entry[slot].referenced = 1;
+                memcpy(data + i * SECTOR_SIZE, BLOCK_CACHE->entry[slot].data, SECTOR_SIZE);
+                continue;
+            }
+            BLOCK_CACHE->miss_num++;
+            miss_id[miss_num] = sector_id[i];
+            miss_index[miss_num] = i;
+            miss_num++;
+        }
+        if (miss_num == 0) {
+            continue;
+        }
+        if (device_read_blocks(miss_id, miss_num, miss_data) == -1) {
+            pthread_mutex_unlock(&BLOCK_CACHE->lock);
+            return -1;
+        }
+        // *the fetched sectors enter the cache one by one, a sector asked twice only once
+        for (int j = 0; j < miss_num; j++) {
+            memcpy(data + miss_index[j] * SECTOR_SIZE, miss_data + j * SECTOR_SIZE, SECTOR_SIZE);
+            if (lookup_block_cache(miss_id[j]) == -1) {
+                int slot = allocate_block_cache(miss_id[j]);
+                memcpy(BLOCK_CACHE->entry[slot].data, miss_data + j * SECTOR_SIZE, SECTOR_SIZE);
+            }
+        }
+    }
+    pthread_mutex_unlock(&BLOCK_CACHE->lock);
+    return 0;
+}
+// ---------------------------------
+// write count sectors into the cache
+// ---------------------------------
+int cache_write_blocks(int* sector_id, int count, char* data, int meta) {
+    for (int i = 0; i < count; i++) {
+        cache_write_block(sector_id[i], data + i * SECTOR_SIZE, meta);
+    }
+    return 0;
+}
+// ---------------------------------
+// log the metadata slots, sorted by sector id, as one transaction at the head of the ring
+// ---------------------------------
+void log_block_cache(int* slot, int count) {
+    int sector_id[JOURNAL_SECTOR_NUM];
+    char data[JOURNAL_SECTOR_NUM * SECTOR_SIZE];
+    int step = 0;
+    uint32_t checksum = 2166136261u;
+    for (int done = 0; done < count; done += DESCRIPTOR_BLOCK_NUM) {
+        int batch = count - done < DESCRIPTOR_BLOCK_NUM ? count - done : DESCRIPTOR_BLOCK_NUM;
+        struct Journal_block* descriptor = (struct Journal_block*)(data + step * SECTOR_SIZE);
+        memset(descriptor, 0, SECTOR_SIZE);
+        descriptor->magic = JOURNAL_MAGIC;
+        descriptor->type = JOURNAL_DESCRIPTOR;
+        descriptor->sequence = JOURNAL->sequence;
+        descriptor->count = batch;
+        sector_id[step] = journal_sector(JOURNAL->head + step);
+        step++;
+        for (int i = 0; i < batch; i++) {
+            struct Cache_entry* entry = &BLOCK_CACHE->entry[slot[done + i]];
+            descriptor->sector_id[i] = entry->sector_id;
+            memcpy(data + step * SECTOR_SIZE, entry->data, SECTOR_SIZE);
+            checksum = journal_checksum(checksum, entry->sector_id, entry->data);
+            sector_id[step] = journal_sector(JOURNAL->head + step);
+            step++;
+        }
+    }
+    struct Journal_block* commit = (struct Journal_block*)(data + step * SECTOR_SIZE);
+    memset(commit, 0, SECTOR_SIZE);
+    commit->magic = JOURNAL_MAGIC;
+    commit->type = JOURNAL_COMMIT;
+    commit->sequence = JOURNAL->sequence;
+    commit->count = count;
+    commit->checksum = checksum;
+    sector_id[step] = journal_sector(JOURNAL->head + step);
+    step++;
+    device_write_blocks(sector_id, step, data);
+    // *the position of every logged copy, past the descriptors before it
+    for (int i = 0; i < count; i++) {
+        struct Cache_entry* entry = &BLOCK_CACHE->entry[slot[i]];
+        entry->logged = 1;
+        JOURNAL->journal_pos[entry->sector_id] = (JOURNAL->head + i / DESCRIPTOR_BLOCK_NUM + 1 + i) % JOURNAL_SECTOR_NUM;
+    }
+    JOURNAL->head = (JOURNAL->head + step) % JOURNAL_SECTOR_NUM;
+    JOURNAL->used += step;
+    JOURNAL->sequence++;
+    JOURNAL->commit_num++;
+    JOURNAL->logged_num += count;
+}
+// ---------------------------------
+// commit the dirty blocks of the group: the file data goes to its sectors, then the
+// metadata to the journal
+// the caller holds JOURNAL->lock and no command is running, so the metadata is complete
+// ---------------------------------
+void commit_block_cache() {
+    int meta_slot[BLOCK_CACHE_MAX_SIZE];
+    int data_slot[BLOCK_CACHE_MAX_SIZE];
+    int meta_num = 0;
+    int data_num = 0;
+    int conflict = 0;
+    pthread_mutex_lock(&BLOCK_CACHE->lock);
+    for (int i = 0; i < BLOCK_CACHE->size; i++) {
+        struct Cache_entry* entry = &BLOCK_CACHE->entry[i];
+        if (entry->sector_id == -1 || !entry->dirty) {
+            continue;
+        }
+        if (!entry->meta) {
+            data_slot[data_num++] = i;
+            conflict |= JOURNAL->journal_pos[entry->sector_id] != -1;
+        } else if (!entry->logged) {
+            meta_slot[meta_num++] = i;
+        }
+    }
+    qsort(meta_slot, meta_num, sizeof(int), compare_cache_slot);
+    qsort(data_slot, data_num, sizeof(int), compare_cache_slot);
+    int need = meta_num == 0 ? 0 : meta_num + (meta_num + DESCRIPTOR_BLOCK_NUM - 1) / DESCRIPTOR_BLOCK_NUM + 1;
+    if (need > JOURNAL_SECTOR_NUM) {
+        // *the credits keep a group within the ring; writing it in place would leave a
+        //  half-done group on the disk after a crash, so the server stops instead
+        fprintf(stderr, "Error: %d metadata blocks do not fit in the journal\n", meta_num);
+        exit(1);
+    }
+    // *data over a sector the ring still holds metadata of would be overwritten by a replay,
+    //  so it waits for the checkpoint after the transaction
+    if (!conflict) {
+        write_back_block_cache(data_slot, data_num);
+    }
+    if (meta_num > 0) {
+        if (JOURNAL->used + need > JOURNAL_SECTOR_NUM) {
+            checkpoint_block_cache();
+        }
+        log_block_cache(meta_slot, meta_num);
+    }
+    if (conflict) {
+        checkpoint_block_cache();
+        write_back_block_cache(data_slot, data_num);
+    }
+    shrink_block_cache();
+    pthread_mutex_unlock(&BLOCK_CACHE->lock);
+}
+// ---------------------------------
+// write every committed block to its sector, so the device alone holds the FS
+// ---------------------------------
+void checkpoint_journal() {
+    pthread_mutex_lock(&BLOCK_CACHE->lock);
+    checkpoint_block_cache();
+    pthread_mutex_unlock(&BLOCK_CACHE->lock);
+}
+// ---------------------------------
+// the disk is being formatted: the cached blocks belong to the old FS, and the ring
+// starts empty
+// ---------------------------------
+void format_journal() {
+    pthread_mutex_lock(&BLOCK_CACHE->lock);
+    reset_block_cache();
+    reset_journal();
+    pthread_mutex_unlock(&BLOCK_CACHE->lock);
+}
+// ---------------------------------
+// print the cache statistics
+// ---------------------------------
+void print_block_cache_stats(FILE* fp) {
+    long total = BLOCK_CACHE->hit_num + BLOCK_CACHE->miss_num;
+    fprintf(fp, "Block cache: %ld hits, %ld misses (%.1f%% hit rate), %ld write-backs, %ld forced, %ld grown\n",
+            BLOCK_CACHE->hit_num, BLOCK_CACHE->miss_num, total == 0 ? 0.0 : 100.0 * BLOCK_CACHE->hit_num / total, BLOCK_CACHE->writeback_num,
+            BLOCK_CACHE->forced_num, BLOCK_CACHE->grown_num);
+}
+#endif
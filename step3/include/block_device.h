@@ -0,0 +1,234 @@
+#ifndef BLOCK_DEVICE_H
+#define BLOCK_DEVICE_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <semaphore.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "disk_client.h"
+// ---------------------------------
+// Block device
+// ---------------------------------
+// the FS reads and writes 256-byte sectors through one of three backends:
+// DEVICE_BDS: the block disk server behind SOCKET_FD
+// DEVICE_MEMORY: an in-process RAM disk, lost when the FS exits
+// DEVICE_IMAGE: an in-process disk file mapped like the BDS maps it,
+//               sector i lives at offset i * 256, so the BDS can serve the same file later
+// ---------------------------------
+// device_read_blocks and device_write_blocks move many sectors in one exchange: up to
+// DEVICE_BATCH_NUM requests are sent in one write, then all read answers are collected,
+// so a batch costs one round trip instead of one per sector
+// every session shares SOCKET_FD, so each exchange holds DEVICE_LOCK
+// ---------------------------------
+#define DEVICE_BDS 0
+#define DEVICE_MEMORY 1
+#define DEVICE_IMAGE 2
+#define SECTOR_SIZE 256
+#define DEVICE_BATCH_NUM 64
+// geometry of the BDS: sector id = cylinder * CYLINDER_SECTORS + sector in the cylinder;
+// the cylinder groups and log segments are sized from it at compile time, so the FS
+// refuses a BDS of another geometry, build with -DCYLINDER_SECTORS=<n> for that one
+#ifndef CYLINDER_SECTORS
+#define CYLINDER_SECTORS 32
+#endif
+static int SOCKET_FD;
+sem_t* DEVICE_LOCK = NULL;
+int DEVICE_TYPE = DEVICE_BDS;
+char* MEMORY_DISK = NULL;
+long MEMORY_DISK_SIZE = 0;
+// block I/O counters, updated under DEVICE_STATS_LOCK since every session thread does I/O
+pthread_mutex_t DEVICE_STATS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+long BLOCK_READ_NUM = 0;
+long BLOCK_WRITE_NUM = 0;
+// cylinders the BDS head would travel for the requests so far
+long SEEK_DISTANCE = 0;
+int last_cylinder = 0;
+// ---------------------------------
+// connect to the block disk server
+// return -1 if its geometry differs from CYLINDER_SECTORS
+// ---------------------------------
+void build_request(char* buffer, char op, int sector_id, char* data);
+int open_bds_device(char* server_address, int port) {
+    create_client(server_address, port, &SOCKET_FD);
+    DEVICE_TYPE = DEVICE_BDS;
+    // *ask the BDS for its geometry, the answer is "<cylinders> <sectors>"
+    char buffer[512];
+    char answer[256];
+    int cylinder_num;
+    int sector_num;
+    build_request(buffer, 'I', 0, NULL);
+    write_disk_client_all(SOCKET_FD, buffer, 512);
+    read_disk_client_all(SOCKET_FD, answer, 256);
+    answer[255] = '\0';
+    if (sscanf(answer, "%d %d", &cylinder_num, &sector_num) != 2) {
+        fprintf(stderr, "Error: the BDS did not report its geometry\n");
+        return -1;
+    }
+    if (sector_num != CYLINDER_SECTORS) {
+        fprintf(stderr, "Error: the BDS has %d sectors per cylinder, the FS is built for %d\n", sector_num, CYLINDER_SECTORS);
+        return -1;
+    }
+    // the lock lives in shared memory, so it still works after the sessions fork
+    DEVICE_LOCK = (sem_t*)mmap(NULL, sizeof(sem_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (DEVICE_LOCK == MAP_FAILED) {
+        DEVICE_LOCK = NULL;
+        return -1;
+    }
+    sem_init(DEVICE_LOCK, 1, 1);
+    return 0;
+}
+// ---------------------------------
+// create a RAM disk of sector_num sectors
+// ---------------------------------
+int open_memory_device(int sector_num) {
+    MEMORY_DISK_SIZE = (long)sector_num * SECTOR_SIZE;
+    MEMORY_DISK = (char*)mmap(NULL, MEMORY_DISK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (MEMORY_DISK == MAP_FAILED) {
+        MEMORY_DISK = NULL;
+        return -1;
+    }
+    DEVICE_TYPE = DEVICE_MEMORY;
+    return 0;
+}
+// ---------------------------------
+// map a disk image of at least sector_num sectors
+// ---------------------------------
+int open_image_device(char* file_name, int sector_num) {
+    int fd = open(file_name, O_RDWR | O_CREAT, 0666);
+    if (fd == -1) {
+        return -1;
+    }
+    // stretch the image when it is smaller than the FS needs
+    long size = lseek(fd, 0, SEEK_END);
+    if (size < (long)sector_num * SECTOR_SIZE) {
+        size = (long)sector_num * SECTOR_SIZE;
+        if (ftruncate(fd, size) == -1) {
+            close(fd);
+            return -1;
+        }
+    }
+    MEMORY_DISK = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MEMORY_DISK == MAP_FAILED) {
+        MEMORY_DISK = NULL;
+        return -1;
+    }
+    MEMORY_DISK_SIZE = size;
+    DEVICE_TYPE = DEVICE_IMAGE;
+    return 0;
+}
+// ---------------------------------
+// whether the sector is inside an in-process disk
+// ---------------------------------
+int memory_sector_valid(int sector_id) {
+    if (sector_id < 0 || (long)(sector_id + 1) * SECTOR_SIZE > MEMORY_DISK_SIZE) {
+        fprintf(stderr, "Error: the disk file is too small\n");
+        return 0;
+    }
+    return 1;
+}
+// ---------------------------------
+// count the requests and the head movement they cause
+// ---------------------------------
+void account_blocks(long* block_num, int* sector_id, int count) {
+    pthread_mutex_lock(&DEVICE_STATS_LOCK);
+    *block_num += count;
+    for (int i = 0; i < count; i++) {
+        int cylinder = sector_id[i] / CYLINDER_SECTORS;
+        SEEK_DISTANCE += cylinder > last_cylinder ? cylinder - last_cylinder : last_cylinder - cylinder;
+        last_cylinder = cylinder;
+    }
+    pthread_mutex_unlock(&DEVICE_STATS_LOCK);
+}
+// ---------------------------------
+// build one 512-byte BDS request
+// ---------------------------------
+void build_request(char* buffer, char op, int sector_id, char* data) {
+    // *code type:
+    // 0: R or W
+    // 2-255: sector_id
+    // 256-511: data, only for W
+    for (int i = 0; i < 256; i++) {
+        buffer[i] = ' ';
+    }
+    buffer[0] = op;
+    sprintf(buffer + 2, "%d", sector_id);
+    if (data != NULL) {
+        memcpy(buffer + 256, data, 256);
+    } else {
+        memset(buffer + 256, ' ', 256);
+    }
+}
+// ---------------------------------
+// write count sectors to the device
+// ---------------------------------
+int device_write_blocks(int* sector_id, int count, char* data) {
+    account_blocks(&BLOCK_WRITE_NUM, sector_id, count);
+    // *in-process backends
+    if (DEVICE_TYPE != DEVICE_BDS) {
+        for (int i = 0; i < count; i++) {
+            if (!memory_sector_valid(sector_id[i])) {
+                return -1;
+            }
+            memcpy(MEMORY_DISK + (long)sector_id[i] * SECTOR_SIZE, data + i * SECTOR_SIZE, SECTOR_SIZE);
+        }
+        return 0;
+    }
+    // *writes are not answered, so a batch is one write to the socket
+    char buffer[DEVICE_BATCH_NUM * 512];
+    for (int done = 0; done < count; done += DEVICE_BATCH_NUM) {
+        int batch = count - done < DEVICE_BATCH_NUM ? count - done : DEVICE_BATCH_NUM;
+        for (int i = 0; i < batch; i++) {
+            build_request(buffer + i * 512, 'W', sector_id[done + i], data + (done + i) * SECTOR_SIZE);
+        }
+        sem_wait(DEVICE_LOCK);
+        write_disk_client_all(SOCKET_FD, buffer, batch * 512);
+        sem_post(DEVICE_LOCK);
+    }
+    return 0;
+}
+// ---------------------------------
+// read count sectors from the device
+// ---------------------------------
+int device_read_blocks(int* sector_id, int count, char* data) {
+    account_blocks(&BLOCK_READ_NUM, sector_id, count);
+    // *in-process backends
+    if (DEVICE_TYPE != DEVICE_BDS) {
+        for (int i = 0; i < count; i++) {
+            if (!memory_sector_valid(sector_id[i])) {
+                return -1;
+            }
+            memcpy(data + i * SECTOR_SIZE, MEMORY_DISK + (long)sector_id[i] * SECTOR_SIZE, SECTOR_SIZE);
+        }
+        return 0;
+    }
+    // *send the whole batch, then collect the answers in order
+    char buffer[DEVICE_BATCH_NUM * 512];
+    for (int done = 0; done < count; done += DEVICE_BATCH_NUM) {
+        int batch = count - done < DEVICE_BATCH_NUM ? count - done : DEVICE_BATCH_NUM;
+        for (int i = 0; i < batch; i++) {
+            build_request(buffer + i * 512, 'R', sector_id[done + i], NULL);
+        }
+        sem_wait(DEVICE_LOCK);
+        write_disk_client_all(SOCKET_FD, buffer, batch * 512);
+        read_disk_client_all(SOCKET_FD, data + done * SECTOR_SIZE, batch * SECTOR_SIZE);
+        sem_post(DEVICE_LOCK);
+    }
+    return 0;
+}
+// ---------------------------------
+// write one sector to the device
+// ---------------------------------
+int device_write_block(int sector_id, char* data) {
+    return device_write_blocks(&sector_id, 1, data);
+}
+// ---------------------------------
+// read one sector from the device
+// ---------------------------------
+int device_read_block(int sector_id, char* data) {
+    return device_read_blocks(&sector_id, 1, data);
+}
+#endif
@@ -10,6 +10,21 @@ struct Naming_block {
 };
 // renaming basic Inode class to Directory
 typedef struct Inode Directory;
+// naming blocks read in one batch by a directory scan
+#define DIRECTORY_BATCH_NUM 16
+// ---------------------------------
+// read up to DIRECTORY_BATCH_NUM naming blocks from first
+// return the number of read blocks
+// ---------------------------------
+int read_naming_blocks(struct Inode* inode, int first, struct Naming_block* naming_block, int* sector_id) {
+    int count = inode->block_num - first < DIRECTORY_BATCH_NUM ? inode->block_num - first : DIRECTORY_BATCH_NUM;
+    if (count <= 0) {
+        return 0;
+    }
+    count = get_sector_ids(inode, first, count, sector_id);
+    read_blocks(sector_id, count, (char*)naming_block);
+    return count;
+}
 // ---------------------------------
 // find the inode id of the name
 // ---------------------------------
@@ -19,15 +34,15 @@ int find_name_id(struct Inode* inode, char* name, int* inode_id) {
         return -1;
     }
     // if it is a directory
-    int directory_num = inode->block_num;
-    for (int i = 0; i < directory_num; i++) {
-        struct Naming_block naming_block;
-        int id;
-        get_sector_id(inode, i, &id);
-        read_block(id, (char*)&naming_block);
-        if (strcmp(naming_block.name, name) == 0) {
-            *inode_id = naming_block.inode_sector_id;
-            return 0;
+    struct Naming_block naming_block[DIRECTORY_BATCH_NUM];
+    int sector_id[DIRECTORY_BATCH_NUM];
+    for (int first = 0; first < inode->block_num; first += DIRECTORY_BATCH_NUM) {
+        int count = read_naming_blocks(inode, first, naming_block, sector_id);
+        for (int i = 0; i < count; i++) {
+            if (strcmp(naming_block[i].name, name) == 0) {
+                *inode_id = naming_block[i].inode_sector_id;
+                return 0;
+            }
         }
     }
     return -1;
@@ -55,8 +70,8 @@ int add_name(struct Inode* inode, struct Inode* new_inode, char* name, int inode
     // write the new name to the new block
     write_block(new_block_id, (char*)&naming_block);
     new_inode->name_inode = new_block_id;
-    write_inode_to_disk(new_inode);
-    write_inode_to_disk(inode);
+    update_inode(new_inode);
+    update_inode(inode);
     return 0;
 }
 // ---------------------------------
@@ -77,18 +92,19 @@ int remove_name(struct Inode* inode, char* name) {
     get_sector_id(inode, tail_id, &tail_block_id);
     read_block(tail_block_id, (char*)&tail_naming_block);
     // remove the name
-    for (int i = 0; i < directory_num; i++) {
-        struct Naming_block naming_block;
-        int id;
-        get_sector_id(inode, i, &id);
-        read_block(id, (char*)&naming_block);
-        if (strcmp(naming_block.name, name) == 0 && i != tail_id) {
-            write_block(id, (char*)&tail_naming_block);
-            remove_tail_block(inode);
-            return 0;
-        } else if (strcmp(naming_block.name, name) == 0 && i == tail_id) {
-            remove_tail_block(inode);
-            return 0;
+    struct Naming_block naming_block[DIRECTORY_BATCH_NUM];
+    int sector_id[DIRECTORY_BATCH_NUM];
+    for (int first = 0; first < directory_num; first += DIRECTORY_BATCH_NUM) {
+        int count = read_naming_blocks(inode, first, naming_block, sector_id);
+        for (int i = 0; i < count; i++) {
+            if (strcmp(naming_block[i].name, name) == 0 && first + i != tail_id) {
+                write_block(sector_id[i], (char*)&tail_naming_block);
+                remove_tail_block(inode);
+                return 0;
+            } else if (strcmp(naming_block[i].name, name) == 0 && first + i == tail_id) {
+                remove_tail_block(inode);
+                return 0;
+            }
         }
     }
     return -1;  // if not found
@@ -102,15 +118,15 @@ int list_all_name(struct Inode* inode, char name[256][252], int* name_num) {
         return -1;
     }
     // if it is a directory
-    int directory_num = inode->block_num;
-    for (int i = 0; i < directory_num; i++) {
-        struct Naming_block naming_block;
-        int id;
-        get_sector_id(inode, i, &id);
-        read_block(id, (char*)&naming_block);
-        strcpy(name[i], naming_block.name);
+    struct Naming_block naming_block[DIRECTORY_BATCH_NUM];
+    int sector_id[DIRECTORY_BATCH_NUM];
+    for (int first = 0; first < inode->block_num; first += DIRECTORY_BATCH_NUM) {
+        int count = read_naming_blocks(inode, first, naming_block, sector_id);
+        for (int i = 0; i < count; i++) {
+            strcpy(name[first + i], naming_block[i].name);
+        }
     }
-    *name_num = directory_num;
+    *name_num = inode->block_num;
     return 0;
 }
 // ---------------------------------
@@ -1,6 +1,7 @@
 #ifndef DISK_CLIENT_H
 #define DISK_CLIENT_H
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -36,30 +37,56 @@ void create_client(char *server_address,
         exit(1);
     }
 
+    // * Send every request immediately
+    int flag = 1;
+    setsockopt(*sockfd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
     // * Print the connection message
     printf("Connected to the server\n");
 }
 // ------------------------------------------------
+// Read exactly length bytes
+// ------------------------------------------------
+void read_disk_client_all(int sockfd, char *buffer, int length) {
+    while (length > 0) {
+        int n = read(sockfd, buffer, length);
+        if (n < 0) {
+            perror("read");
+            exit(1);
+        }
+        if (n == 0) {
+            fprintf(stderr, "Error: the disk server closed the connection\n");
+            exit(1);
+        }
+        buffer += n;
+        length -= n;
+    }
+}
+// ------------------------------------------------
+// Write exactly length bytes
+// ------------------------------------------------
+void write_disk_client_all(int sockfd, char *buffer, int length) {
+    while (length > 0) {
+        int n = write(sockfd, buffer, length);
+        if (n < 0) {
+            perror("write");
+            exit(1);
+        }
+        buffer += n;
+        length -= n;
+    }
+}
+// ------------------------------------------------
 // Read
 // ------------------------------------------------
 void read_disk_client(int sockfd, char *buffer) {
-    int n;
-    n = read(sockfd, buffer, 256);
-    if (n < 0) {
-        perror("read");
-        exit(1);
-    }
+    read_disk_client_all(sockfd, buffer, 256);
 }
 // ------------------------------------------------
 // Write
 // ------------------------------------------------
 void write_disk_client(int sockfd, char *buffer) {
-    int n;
-    n = write(sockfd, buffer, 512);
-    if (n < 0) {
-        perror("write");
-        exit(1);
-    }
+    write_disk_client_all(sockfd, buffer, 512);
 }
 
 // ------------------------------------------------
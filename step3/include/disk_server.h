@@ -12,9 +12,55 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <limits.h>
+#include <errno.h>
 struct Inode ROOT;
 int root_sector_id;
 
+// --------------------------------------------------------------------------------------------
+// Sessions and workers
+// --------------------------------------------------------------------------------------------
+// one epoll reactor waits for the clients and hands every session with a command ready to a
+// worker queue; MAX_WORKER_NUM caps the workers, one per core, which serve their own queue
+// and steal from the others when it is empty; the commands run side by side under the
+// namespace and inode locks of begin_command and lock_file
+// --------------------------------------------------------------------------------------------
+#define MAX_WORKER_NUM 64
+struct Stream {
+    char *chunk[2];  // the chunk being sent and the next one, NULL when no stream runs
+    int current;     // chunk being sent
+    int size;        // its bytes
+    int sent;        // its bytes the kernel has taken
+    int next_size;   // bytes of the next chunk, 0 until it is read
+    int inode_id;    // file streamed
+    int pos;         // next byte of the file to read
+    int left;        // bytes not read yet
+};
+struct Session {
+    int sockfd;
+    int started;                   // the greeting has been sent
+    int watched;                   // the socket is in the epoll set
+    struct Inode cur_directory;    // current directory
+    struct Inode *held_root;       // the root and the current directory
+    struct Inode *held_directory;  // stay in the inode cache for the whole session
+    struct Stream stream;          // the rest of a cat the client has not taken yet
+    struct Session *next;          // next session in the work queue
+};
+struct Work_queue {
+    pthread_mutex_t lock;
+    struct Session *head;
+    struct Session *tail;
+};
+struct Work_queue WORK_QUEUE[MAX_WORKER_NUM];
+int WORKER_NUM = 1;
+int WORK_QUEUE_NEXT = 0;  // only the reactor pushes
+sem_t WORK_NUM;           // queued sessions
+int SERVER_EPOLL_FD = -1;
+
 // --------------------------------------------------------------------------------------------
 // Create the server to the port
 // --------------------------------------------------------------------------------------------
@@ -39,6 +85,23 @@ void create_server(int *sockfd,
     printf("Server is listening on port %d\n", port);
 }
 
+// --------------------------------------------------------------------------------------------
+// The number in the token, -1 if it is negative or does not fit in an int
+// --------------------------------------------------------------------------------------------
+int parse_number(char *token) {
+    long number = strtol(token, NULL, 10);
+    return number < 0 || number > INT_MAX ? -1 : (int)number;
+}
+// --------------------------------------------------------------------------------------------
+// Whether pos and length are numbers and the range pos .. pos + length fits in an int
+// --------------------------------------------------------------------------------------------
+int parse_range(char *pos, char *length) {
+    int p = parse_number(pos);
+    int l = parse_number(length);
+    return p != -1 && l != -1 && p <= INT_MAX - l;
+}
+// the data of a command is copied into one entry of command_array
+#define COMMAND_DATA_MAX 1023
 // --------------------------------------------------------------------------------------------
 // Parse the command line
 // --------------------------------------------------------------------------------------------
@@ -46,11 +109,14 @@ int parseLine(char *line,
               char command_array[10][1024]) {
     int i = 0;
     char *token;
+    char *save = NULL;  // commands are parsed on many workers at once
 
     printf("line: %s\n", line);
 
     // first token
-    token = strtok(line, " ");
+    token = strtok_r(line, " ", &save);
+    if (token == NULL)
+        return -1;
     printf("token: %s\n", token);
 
     // f
@@ -71,7 +137,7 @@ int parseLine(char *line,
     if (strcmp(token, "mk") == 0) {
         strcpy(command_array[i++], "mk");
 
-        token = strtok(NULL, " ");
+        token = strtok_r(NULL, " ", &save);
         if (token == NULL)
             return -1;
         strcpy(command_array[i++], token);
@@ -83,7 +149,7 @@ int parseLine(char *line,
     if (strcmp(token, "mkdir") == 0) {
         strcpy(command_array[i++], "mkdir");
 
-        token = strtok(NULL, " ");
+        token = strtok_r(NULL, " ", &save);
         if (token == NULL)
             return -1;
         strcpy(command_array[i++], token);
@@ -95,7 +161,7 @@ int parseLine(char *line,
     if (strcmp(token, "rm") == 0) {
         strcpy(command_array[i++], "rm");
 
-        token = strtok(NULL, " ");
+        token = strtok_r(NULL, " ", &save);
         if (token == NULL)
             return -1;
         strcpy(command_array[i++], token);
@@ -107,7 +173,7 @@ int parseLine(char *line,
     if (strcmp(token, "cd") == 0) {
         strcpy(command_array[i++], "cd");
 
-        token = strtok(NULL, " ");
+        token = strtok_r(NULL, " ", &save);
         if (token == NULL)
             return -1;
         strcpy(command_array[i++], token);
@@ -119,7 +185,7 @@ int parseLine(char *line,
     if (strcmp(token, "rmdir") == 0) {
         strcpy(command_array[i++], "rmdir");
 
-        token = strtok(NULL, " ");
+        token = strtok_r(NULL, " ", &save);
         if (token == NULL)
             return -1;
         strcpy(command_array[i++], token);
@@ -134,14 +200,28 @@ int parseLine(char *line,
         return i;
     }
 
-    // cat f
+    // cat f [pos l]
     if (strcmp(token, "cat") == 0) {
         strcpy(command_array[i++], "cat");
 
-        token = strtok(NULL, " ");
+        token = strtok_r(NULL, " ", &save);
         if (token == NULL)
             return -1;
         strcpy(command_array[i++], token);
+
+        // the range is optional, both or neither
+        token = strtok_r(NULL, " ", &save);
+        if (token == NULL)
+            return i;
+        strcpy(command_array[i++], token);
+
+        token = strtok_r(NULL, " ", &save);
+        if (token == NULL)
+            return -1;
+        strcpy(command_array[i++], token);
+
+        if (!parse_range(command_array[2], command_array[3]))
+            return -1;
         return i;
     }
 
@@ -149,21 +229,24 @@ int parseLine(char *line,
     if (strcmp(token, "d") == 0) {
         strcpy(command_array[i++], "d");
 
-        token = strtok(NULL, " ");
+        token = strtok_r(NULL, " ", &save);
         if (token == NULL)
             return -1;
         strcpy(command_array[i++], token);
 
-        token = strtok(NULL, " ");
+        token = strtok_r(NULL, " ", &save);
         if (token == NULL)
             return -1;
         strcpy(command_array[i++], token);
 
-        token = strtok(NULL, " ");
+        token = strtok_r(NULL, " ", &save);
         if (token == NULL)
             return -1;
         strcpy(command_array[i++], token);
 
+        if (!parse_range(command_array[2], command_array[3]))
+            return -1;
+
         return i;
     }
 
@@ -171,21 +254,21 @@ int parseLine(char *line,
     if (strcmp(token, "w") == 0) {
         strcpy(command_array[i++], "w");
 
-        token = strtok(NULL, " ");
+        token = strtok_r(NULL, " ", &save);
         if (token == NULL)
             return -1;
         strcpy(command_array[i++], token);
 
-        token = strtok(NULL, " ");
+        token = strtok_r(NULL, " ", &save);
         if (token == NULL)
             return -1;
         strcpy(command_array[i++], token);
 
-        int len = atoi(command_array[2]);
-        if (len <= 0)
+        int len = parse_number(command_array[2]);
+        if (len <= 0 || len > COMMAND_DATA_MAX)
             return -1;
 
-        token = strtok(NULL, "");
+        token = strtok_r(NULL, "", &save);
         if (token == NULL)
             return -1;
         strncpy(command_array[i++], token, len);
@@ -197,26 +280,149 @@ int parseLine(char *line,
     if (strcmp(token, "i") == 0) {
         strcpy(command_array[i++], "i");
 
-        token = strtok(NULL, " ");
+        token = strtok_r(NULL, " ", &save);
         if (token == NULL)
             return -1;
         strcpy(command_array[i++], token);
 
-        token = strtok(NULL, " ");
+        token = strtok_r(NULL, " ", &save);
         if (token == NULL)
             return -1;
         strcpy(command_array[i++], token);
 
-        token = strtok(NULL, " ");
+        token = strtok_r(NULL, " ", &save);
         if (token == NULL)
             return -1;
         strcpy(command_array[i++], token);
 
-        int len = atoi(command_array[3]);
-        if (len <= 0)
+        int len = parse_number(command_array[3]);
+        if (len <= 0 || len > COMMAND_DATA_MAX || !parse_range(command_array[2], command_array[3]))
             return -1;
 
-        token = strtok(NULL, "");
+        token = strtok_r(NULL, "", &save);
+        if (token == NULL)
+            return -1;
+        strncpy(command_array[i++], token, len);
+
+        return i;
+    }
+
+    // pw f pos l data
+    if (strcmp(token, "pw") == 0) {
+        strcpy(command_array[i++], "pw");
+
+        token = strtok_r(NULL, " ", &save);
+        if (token == NULL)
+            return -1;
+        strcpy(command_array[i++], token);
+
+        token = strtok_r(NULL, " ", &save);
+        if (token == NULL)
+            return -1;
+        strcpy(command_array[i++], token);
+
+        token = strtok_r(NULL, " ", &save);
+        if (token == NULL)
+            return -1;
+        strcpy(command_array[i++], token);
+
+        int len = parse_number(command_array[3]);
+        if (len <= 0 || len > COMMAND_DATA_MAX || !parse_range(command_array[2], command_array[3]))
+            return -1;
+
+        token = strtok_r(NULL, "", &save);
+        if (token == NULL)
+            return -1;
+        strncpy(command_array[i++], token, len);
+
+        return i;
+    }
+
+    // tr f size
+    if (strcmp(token, "tr") == 0) {
+        strcpy(command_array[i++], "tr");
+
+        token = strtok_r(NULL, " ", &save);
+        if (token == NULL)
+            return -1;
+        strcpy(command_array[i++], token);
+
+        token = strtok_r(NULL, " ", &save);
+        if (token == NULL)
+            return -1;
+        strcpy(command_array[i++], token);
+
+        if (parse_number(command_array[2]) == -1)
+            return -1;
+
+        return i;
+    }
+
+    // sd f pos, sh f pos
+    if (strcmp(token, "sd") == 0 || strcmp(token, "sh") == 0) {
+        strcpy(command_array[i++], token);
+
+        token = strtok_r(NULL, " ", &save);
+        if (token == NULL)
+            return -1;
+        strcpy(command_array[i++], token);
+
+        token = strtok_r(NULL, " ", &save);
+        if (token == NULL)
+            return -1;
+        strcpy(command_array[i++], token);
+
+        if (parse_number(command_array[2]) == -1)
+            return -1;
+
+        return i;
+    }
+
+    // a f l data
+    if (strcmp(token, "a") == 0) {
+        strcpy(command_array[i++], "a");
+
+        token = strtok_r(NULL, " ", &save);
+        if (token == NULL)
+            return -1;
+        strcpy(command_array[i++], token);
+
+        token = strtok_r(NULL, " ", &save);
+        if (token == NULL)
+            return -1;
+        strcpy(command_array[i++], token);
+
+        int len = parse_number(command_array[2]);
+        if (len <= 0 || len > COMMAND_DATA_MAX)
+            return -1;
+
+        token = strtok_r(NULL, "", &save);
+        if (token == NULL)
+            return -1;
+        strncpy(command_array[i++], token, len);
+
+        return i;
+    }
+
+    // aa f l data
+    if (strcmp(token, "aa") == 0) {
+        strcpy(command_array[i++], "aa");
+
+        token = strtok_r(NULL, " ", &save);
+        if (token == NULL)
+            return -1;
+        strcpy(command_array[i++], token);
+
+        token = strtok_r(NULL, " ", &save);
+        if (token == NULL)
+            return -1;
+        strcpy(command_array[i++], token);
+
+        int len = parse_number(command_array[2]);
+        if (len <= 0 || len > COMMAND_DATA_MAX)
+            return -1;
+
+        token = strtok_r(NULL, "", &save);
         if (token == NULL)
             return -1;
         strncpy(command_array[i++], token, len);
@@ -229,12 +435,12 @@ int parseLine(char *line,
     if (strcmp(token, "adduser") == 0) {
         strcpy(command_array[i++], "adduser");
 
-        token = strtok(NULL, " ");
+        token = strtok_r(NULL, " ", &save);
         if (token == NULL)
             return -1;
         strcpy(command_array[i++], token);
 
-        token = strtok(NULL, " ");
+        token = strtok_r(NULL, " ", &save);
         if (token == NULL)
             return -1;
         strcpy(command_array[i++], token);
@@ -247,12 +453,12 @@ int parseLine(char *line,
     if (strcmp(token, "su") == 0) {
         strcpy(command_array[i++], "su");
 
-        token = strtok(NULL, " ");
+        token = strtok_r(NULL, " ", &save);
         if (token == NULL)
             return -1;
         strcpy(command_array[i++], token);
 
-        token = strtok(NULL, " ");
+        token = strtok_r(NULL, " ", &save);
         if (token == NULL)
             return -1;
         strcpy(command_array[i++], token);
@@ -264,10 +470,14 @@ int parseLine(char *line,
 
 // --------------------------------------------------------------------------------------------
 // Read the command from the client
+// Return 0 when the client has gone
 // --------------------------------------------------------------------------------------------
 int read_command_from_client(int client_sockfd,
                              char *buf) {
-    int len = read(client_sockfd, buf, 1024);
+    int len = read(client_sockfd, buf, 1023);
+    // the client has gone
+    if (len <= 0)
+        return 0;
     if (len < 2) {
         fprintf(stderr, "Error: cannot read the command from the client\n");
         return -1;
@@ -293,358 +503,893 @@ void get_current_path(struct Inode *inode, char *name) {
 // Initial the bitmap
 // ------------------------------------------------
 void init_bitmap() {
-    int i;
-    for (i = 0; i < BLOCK_NUM; i++) {
-        block_bitmap[i] = '0';
+    clear_bitmap();
+    discard_inode_cache();
+    format_journal();
+    if (LOG_STRUCTURED) {
+        reset_inode_map();
     }
-    for (i = 0; i < BLOCK_NUM / 256; i++) {
-        block_bitmap[i] = '1';
+    // the bitmap sectors, the superblock, the journal and the inode map
+    for (int i = 0; i < RESERVED_SECTOR_NUM; i++) {
+        mark_block_used(i);
     }
     store_bitmap();
 }
 
 // --------------------------------------------------------------------------------------------
-// Importantly, the following function is the key function in this snippet
-// Execution for one client in the child process
+// Hold the inode of sector_id in the inode cache instead of the one held before
 // --------------------------------------------------------------------------------------------
-void Execution_for_one_client_in_child_process(int client_sockfd) {
-    // *initial the current directory in
-    get_inode(ROOT.sector_id, &ROOT);
-    struct Inode cur_directory = ROOT;
-    cd(&cur_directory, "public");
+void hold_inode(struct Inode **held,
+                int sector_id) {
+    if (*held != NULL && (*held)->sector_id == sector_id) {
+        return;
+    }
+    if (*held != NULL) {
+        iput(*held);
+    }
+    *held = iget(sector_id);
+}
 
-    // *main loop
+// --------------------------------------------------------------------------------------------
+// Whether the command adds, removes or formats names, then it runs alone
+// --------------------------------------------------------------------------------------------
+int command_changes_namespace(char *command) {
+    return strcmp(command, "f") == 0 ||
+           strcmp(command, "mk") == 0 ||
+           strcmp(command, "mkdir") == 0 ||
+           strcmp(command, "rm") == 0 ||
+           strcmp(command, "rmdir") == 0 ||
+           strcmp(command, "adduser") == 0;
+}
+
+// --------------------------------------------------------------------------------------------
+// Whether the command may change metadata, then it takes journal credits
+// --------------------------------------------------------------------------------------------
+int command_changes_metadata(char *command) {
+    return strcmp(command, "cd") != 0 &&
+           strcmp(command, "ls") != 0 &&
+           strcmp(command, "cat") != 0 &&
+           strcmp(command, "sd") != 0 &&
+           strcmp(command, "sh") != 0 &&
+           strcmp(command, "e") != 0;
+}
+
+// --------------------------------------------------------------------------------------------
+// Lock the file of the directory for the rest of the command
+// write: the command changes the file
+// a command that changes metadata also takes the journal credits for the extent tree of the
+// file; when the ring has no room for them, the command starts again with them before it
+// changes anything, and looks the file up again
+// --------------------------------------------------------------------------------------------
+void lock_file(struct Inode *directory,
+               char *name,
+               int write) {
     while (1) {
-        // *store the bitmap
-        store_bitmap();
-
-        // *print the current directory
-        char cur_name[4096];
-        bzero(cur_name, 4096);
-        get_current_path(&cur_directory, cur_name);
-        write(client_sockfd, cur_name, 1024);
-
-        // *read the command from the client
-        char buf[1024];
-        int len = read_command_from_client(client_sockfd, buf);
-        if (len == -1) {
-            fprintf(stderr, "Error: cannot read the command from the client\n");
-            char output[1024];
-            sprintf(output, "Error: cannot read the command from the client\n");
-            write(client_sockfd, output, 1024);
-            continue;
+        int inode_id;
+        struct Inode inode;
+        if (find_name_id(directory, name, &inode_id) == -1) {
+            return;
+        }
+        lock_inode(inode_id, write);
+        if (command_credit == 0 || get_inode(inode_id, &inode) == -1) {
+            return;
         }
+        int credit = COMMAND_META_NUM + edit_meta_num(&inode);
+        if (credit <= command_credit || extend_command(credit - command_credit) == 0) {
+            return;
+        }
+        restart_command(credit);
+        if (get_inode(directory->sector_id, directory) == -1 || !inode_is_used(directory->sector_id)) {
+            return;
+        }
+    }
+}
 
-        // *update the bitmap
-        load_bitmap();
+// --------------------------------------------------------------------------------------------
+// Streaming reads
+// --------------------------------------------------------------------------------------------
+// cat sends a 1024-byte header "Stream: <bytes>", then exactly that many bytes of the file;
+// the bytes go in chunks of STREAM_CHUNK_SIZE, each read as one batch under its own command,
+// so a slow client holds no lock and no journal handle while it drains the socket, and the
+// server keeps two chunks whatever the size of the file
+// the bytes are sent without waiting and the next chunk is read while the kernel still sends
+// the last one; when the socket is full the session waits in the reactor until the client
+// takes more, so a slow client holds no worker either
+// a file that shrinks while it is streamed ends with zeros, the header is already sent
+// --------------------------------------------------------------------------------------------
+#ifndef STREAM_CHUNK_SIZE
+#define STREAM_CHUNK_SIZE (DEVICE_BATCH_NUM * SECTOR_SIZE)
+#endif
 
-        // *update the current directory information
-        int current_sector_id = cur_directory.sector_id;
-        get_inode(current_sector_id, &cur_directory);
-        get_inode(root_sector_id, &ROOT);
+// --------------------------------------------------------------------------------------------
+// Read one chunk of the file under its own command, zeros past the end of the file
+// --------------------------------------------------------------------------------------------
+void read_stream_chunk(int inode_id,
+                       int pos,
+                       int length,
+                       char *chunk) {
+    struct Inode inode;
+    int read_num = 0;
+    begin_command(0, 0);
+    lock_inode(inode_id, 0);
+    if (inode_is_used(inode_id) && get_inode(inode_id, &inode) == 0 && inode.file_type == 0 && pos < inode.file_size) {
+        read_num = inode.file_size - pos < length ? inode.file_size - pos : length;
+        read_num = read_file_range(&inode, pos, read_num, chunk);
+        read_num = read_num < 0 ? 0 : read_num;
+    }
+    end_command();
+    memset(chunk + read_num, 0, length - read_num);
+}
 
-        // *if the current directory has been invalid
-        if (block_bitmap[cur_directory.sector_id] == '0') {
-            char output[1024];
-            bzero(output, 1024);
-            sprintf(output, "Error: the current directory is invalid\n");
-            write(client_sockfd, output, 1024);
-            cur_directory = ROOT;
-            cd(&cur_directory, "public");
-            continue;
+// --------------------------------------------------------------------------------------------
+// Read the chunk after the one being sent, if the stream has one left
+// --------------------------------------------------------------------------------------------
+void read_next_chunk(struct Stream *stream) {
+    if (stream->next_size > 0 || stream->left == 0) {
+        return;
+    }
+    stream->next_size = stream->left < STREAM_CHUNK_SIZE ? stream->left : STREAM_CHUNK_SIZE;
+    read_stream_chunk(stream->inode_id, stream->pos, stream->next_size, stream->chunk[1 - stream->current]);
+    stream->pos += stream->next_size;
+    stream->left -= stream->next_size;
+}
+
+// --------------------------------------------------------------------------------------------
+// Stop the stream of the session
+// --------------------------------------------------------------------------------------------
+void end_stream(struct Session *session) {
+    free(session->stream.chunk[0]);
+    free(session->stream.chunk[1]);
+    memset(&session->stream, 0, sizeof(struct Stream));
+}
+
+// --------------------------------------------------------------------------------------------
+// Send the stream until the socket is full, without a command running
+// return 0 when all of it is sent, 1 when the client has to take more first, -1 if it has gone
+// --------------------------------------------------------------------------------------------
+int send_stream(struct Session *session) {
+    struct Stream *stream = &session->stream;
+    while (1) {
+        if (stream->sent == stream->size) {
+            read_next_chunk(stream);
+            if (stream->next_size == 0) {
+                return 0;
+            }
+            stream->current = 1 - stream->current;
+            stream->size = stream->next_size;
+            stream->sent = 0;
+            stream->next_size = 0;
         }
+        int n = send(session->sockfd, stream->chunk[stream->current] + stream->sent, stream->size - stream->sent, MSG_DONTWAIT);
+        if (n > 0) {
+            stream->sent += n;
+        } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            read_next_chunk(stream);
+            return 1;
+        } else {
+            return -1;
+        }
+    }
+}
 
-        // *parse the command
-        char command_array[10][1024];
-        int command_num = parseLine(buf, command_array);
-        if (command_num == -1) {
-            fprintf(stderr, "Error: cannot parse the command\n");
-            char output[1024];
-            sprintf(output, "Error: cannot parse the command\n");
-            write(client_sockfd, output, 1024);
-            continue;
+// --------------------------------------------------------------------------------------------
+// Send the header of length bytes of the file from pos, the rest of the file if length is -1,
+// and start the stream of the session; the bytes go after the command
+// --------------------------------------------------------------------------------------------
+void stream_file(struct Session *session,
+                 char *name,
+                 int pos,
+                 int length) {
+    char output[1024];
+    bzero(output, 1024);
+    int inode_id;
+    struct Inode inode;
+    if (find_name_id(&session->cur_directory, name, &inode_id) == -1 || get_inode(inode_id, &inode) == -1 || inode.file_type == 1) {
+        sprintf(output, "Error: cannot read the file\n");
+        write(session->sockfd, output, 1024);
+        return;
+    }
+    lock_inode(inode_id, 0);
+    get_inode(inode_id, &inode);
+    if (pos > inode.file_size) {
+        pos = inode.file_size;
+    }
+    if (length == -1 || length > inode.file_size - pos) {
+        length = inode.file_size - pos;
+    }
+    // *two chunks: one is sent while the next is read
+    struct Stream *stream = &session->stream;
+    stream->chunk[0] = malloc(STREAM_CHUNK_SIZE);
+    stream->chunk[1] = malloc(STREAM_CHUNK_SIZE);
+    if (stream->chunk[0] == NULL || stream->chunk[1] == NULL) {
+        end_stream(session);
+        sprintf(output, "Error: failed to allocate memory for the stream\n");
+        write(session->sockfd, output, 1024);
+        return;
+    }
+    stream->inode_id = inode_id;
+    stream->pos = pos;
+    stream->left = length;
+    sprintf(output, "Stream: %d\n", length);
+    write(session->sockfd, output, 1024);
+}
+
+// --------------------------------------------------------------------------------------------
+// Importantly, the following function is the key function in this snippet
+// Execute one parsed command of the session, the caller has begun the command
+// Return 1 when the client exits
+// --------------------------------------------------------------------------------------------
+int execute_command(struct Session *session,
+                    char command_array[10][1024],
+                    int command_num) {
+    // *update the current directory information
+    int current_sector_id = session->cur_directory.sector_id;
+    struct Inode root;
+    get_inode(current_sector_id, &session->cur_directory);
+    get_inode(root_sector_id, &root);
+    hold_inode(&session->held_root, root_sector_id);
+    hold_inode(&session->held_directory, current_sector_id);
+
+    // *if the current directory has been invalid
+    if (!inode_is_used(session->cur_directory.sector_id)) {
+        char output[1024];
+        bzero(output, 1024);
+        sprintf(output, "Error: the current directory is invalid\n");
+        write(session->sockfd, output, 1024);
+        session->cur_directory = root;
+        cd(&session->cur_directory, "public");
+        return 0;
+    }
+
+    // *the command could not be parsed
+    if (command_num == -1) {
+        fprintf(stderr, "Error: cannot parse the command\n");
+        char output[1024];
+        sprintf(output, "Error: cannot parse the command\n");
+        write(session->sockfd, output, 1024);
+        return 0;
+    }
+
+    // ?debug
+    // printf("command_num: %d\n", command_num);
+    // for (int i = 0; i < command_num; i++) {
+    //     printf("command_array[%d]: %s\n", i, command_array[i]);
+    // }
+
+    // *f
+    if (strcmp(command_array[0], "f") == 0) {
+        init_bitmap();
+        create_root_directory(&ROOT);
+        create_public_directory(&ROOT);
+        root_sector_id = ROOT.sector_id;
+        set_journal_root(root_sector_id);
+        session->cur_directory = ROOT;
+        cd(&session->cur_directory, "public");
+        char output[1024];
+        bzero(output, 1024);
+        sprintf(output, "Successfully!\n");
+        write(session->sockfd, output, 1024);
+        update_inode(&ROOT);
+        return 0;
+    }
+
+    // *e
+    if (strcmp(command_array[0], "e") == 0) {
+        if (session->held_root != NULL) {
+            iput(session->held_root);
+            session->held_root = NULL;
+        }
+        if (session->held_directory != NULL) {
+            iput(session->held_directory);
+            session->held_directory = NULL;
         }
+        end_command();
+        print_block_cache_stats(stdout);
+        print_inode_cache_stats(stdout);
+        print_journal_stats(stdout);
+        print_log_stats(stdout);
+        char output[1024];
+        sprintf(output, "EXIT\n");
+        write(session->sockfd, output, 1024);
+        return 1;
+    }
 
-        // ?debug
-        // printf("command_num: %d\n", command_num);
-        // for (int i = 0; i < command_num; i++) {
-        //     printf("command_array[%d]: %s\n", i, command_array[i]);
-        // }
-
-        // *f
-        if (strcmp(command_array[0], "f") == 0) {
-            init_bitmap();
-            create_root_directory(&ROOT);
-            create_public_directory(&ROOT);
-            root_sector_id = ROOT.sector_id;
-            cur_directory = ROOT;
-            cd(&cur_directory, "public");
-            char output[1024];
-            bzero(output, 1024);
-            sprintf(output, "Successfully!\n");
-            write(client_sockfd, output, 1024);
-            write_inode_to_disk(&ROOT);
-            continue;
+    // *mk f
+    if (strcmp(command_array[0], "mk") == 0) {
+        int flag = mk_f(&session->cur_directory, command_array[1]);
+        char output[1024];
+        bzero(output, 1024);
+        if (flag == -1) {
+            sprintf(output, "Error: cannot create the file\n");
+            write(session->sockfd, output, 1024);
+            return 0;
         }
+        sprintf(output, "Successfully!\n");
+        write(session->sockfd, output, 1024);
+    }
 
-        // *e
-        if (strcmp(command_array[0], "e") == 0) {
-            char output[1024];
-            sprintf(output, "EXIT\n");
-            write(client_sockfd, output, 1024);
-            break;
+    // *mkdir d
+    if (strcmp(command_array[0], "mkdir") == 0) {
+        int flag = mk_dir(&session->cur_directory, command_array[1]);
+        char output[1024];
+        bzero(output, 1024);
+        if (flag == -1) {
+            sprintf(output, "Error: cannot create the directory\n");
+            write(session->sockfd, output, 1024);
+            return 0;
         }
+        sprintf(output, "Successfully!\n");
+        write(session->sockfd, output, 1024);
+    }
 
-        // *mk f
-        if (strcmp(command_array[0], "mk") == 0) {
-            int flag = mk_f(&cur_directory, command_array[1]);
-            char output[1024];
-            bzero(output, 1024);
-            if (flag == -1) {
-                sprintf(output, "Error: cannot create the file\n");
-                write(client_sockfd, output, 1024);
-                continue;
-            }
-            sprintf(output, "Successfully!\n");
-            write(client_sockfd, output, 1024);
+    // *rm f
+    if (strcmp(command_array[0], "rm") == 0) {
+        int flag = rm_f(&session->cur_directory, command_array[1]);
+        char output[1024];
+        bzero(output, 1024);
+        if (flag == -1) {
+            sprintf(output, "Error: cannot remove the file\n");
+            write(session->sockfd, output, 1024);
+            return 0;
         }
+        sprintf(output, "Successfully!\n");
+        write(session->sockfd, output, 1024);
+    }
 
-        // *mkdir d
-        if (strcmp(command_array[0], "mkdir") == 0) {
-            int flag = mk_dir(&cur_directory, command_array[1]);
-            char output[1024];
-            bzero(output, 1024);
-            if (flag == -1) {
-                sprintf(output, "Error: cannot create the directory\n");
-                write(client_sockfd, output, 1024);
-                continue;
-            }
-            sprintf(output, "Successfully!\n");
-            write(client_sockfd, output, 1024);
+    // *cd path
+    if (strcmp(command_array[0], "cd") == 0) {
+        int flag = cd(&session->cur_directory, command_array[1]);
+        char output[1024];
+        bzero(output, 1024);
+        if (flag == -1) {
+            sprintf(output, "Error: cannot change the directory\n");
+            write(session->sockfd, output, 1024);
+            return 0;
         }
+        sprintf(output, "Successfully!\n");
+        write(session->sockfd, output, 1024);
+    }
 
-        // *rm f
-        if (strcmp(command_array[0], "rm") == 0) {
-            int flag = rm_f(&cur_directory, command_array[1]);
-            char output[1024];
-            bzero(output, 1024);
-            if (flag == -1) {
-                sprintf(output, "Error: cannot remove the file\n");
-                write(client_sockfd, output, 1024);
-                continue;
-            }
-            sprintf(output, "Successfully!\n");
-            write(client_sockfd, output, 1024);
+    // *rmdir d
+    if (strcmp(command_array[0], "rmdir") == 0) {
+        int flag = rm_dir(&session->cur_directory, command_array[1]);
+        char output[1024];
+        bzero(output, 1024);
+        if (flag == -1) {
+            sprintf(output, "Error: cannot remove the directory\n");
+            write(session->sockfd, output, 1024);
+            return 0;
         }
+        sprintf(output, "Successfully!\n");
+        write(session->sockfd, output, 1024);
+    }
 
-        // *cd path
-        if (strcmp(command_array[0], "cd") == 0) {
-            int flag = cd(&cur_directory, command_array[1]);
-            char output[1024];
-            bzero(output, 1024);
-            if (flag == -1) {
-                sprintf(output, "Error: cannot change the directory\n");
-                write(client_sockfd, output, 1024);
-                continue;
-            }
+    // *ls
+    if (strcmp(command_array[0], "ls") == 0) {
+        char name[256][252];
+        int name_num = ls(&session->cur_directory, name);
+        char output[1024];
+        bzero(output, 1024);
+        printf("name_num: %d\n", name_num);
+        if (name_num < 0) {
+            sprintf(output, "Error: cannot list the directory\n");
+            write(session->sockfd, output, 1024);
+            return 0;
+        }
+        if (name_num == 0) {
             sprintf(output, "Successfully!\n");
-            write(client_sockfd, output, 1024);
+            write(session->sockfd, output, 1024);
+            return 0;
+        }
+        // write the answer to the client
+        for (int i = 0; i < name_num; i++) {
+            strcat(output, "\n");
+            strcat(output, name[i]);
         }
+        write(session->sockfd, output, 1024);
+    }
 
-        // *rmdir d
-        if (strcmp(command_array[0], "rmdir") == 0) {
-            int flag = rm_dir(&cur_directory, command_array[1]);
-            char output[1024];
-            bzero(output, 1024);
-            if (flag == -1) {
-                sprintf(output, "Error: cannot remove the directory\n");
-                write(client_sockfd, output, 1024);
-                continue;
-            }
-            sprintf(output, "Successfully!\n");
-            write(client_sockfd, output, 1024);
-        }
-
-        // *ls
-        if (strcmp(command_array[0], "ls") == 0) {
-            char name[256][252];
-            int name_num = ls(&cur_directory, name);
-            char output[1024];
-            bzero(output, 1024);
-            printf("name_num: %d\n", name_num);
-            if (name_num < 0) {
-                sprintf(output, "Error: cannot list the directory\n");
-                write(client_sockfd, output, 1024);
-                continue;
-            }
-            if (name_num == 0) {
-                sprintf(output, "Successfully!\n");
-                write(client_sockfd, output, 1024);
-                continue;
-            }
-            // write the answer to the client
-            for (int i = 0; i < name_num; i++) {
-                strcat(output, "\n");
-                strcat(output, name[i]);
-            }
-            write(client_sockfd, output, 1024);
-        }
-
-        // *cat f
-        if (strcmp(command_array[0], "cat") == 0) {
-            char content[4096];
-            int flag = cat_f(&cur_directory, command_array[1], content);
-            char output[1024];
-            bzero(output, 1024);
-            // if the file is empty
-            if (flag == 0) {
-                sprintf(output, "Successfully!\n");
-                write(client_sockfd, output, 1024);
-                continue;
-            }
-            if (flag == -1) {
-                sprintf(output, "Error: cannot read the file\n");
-                write(client_sockfd, output, 1024);
-                continue;
-            }
-            // write the answer to the client
-            memcpy(output, content, 1024);
-            write(client_sockfd, output, 1024);
-        }
-
-        // *d f pos l
-        if (strcmp(command_array[0], "d") == 0) {
-            int flag = d_f(&cur_directory, command_array[1], atoi(command_array[2]), atoi(command_array[3]));
-            char output[1024];
-            bzero(output, 1024);
-            if (flag == -1) {
-                sprintf(output, "Error: cannot delete the data\n");
-                write(client_sockfd, output, 1024);
-                continue;
-            }
-            sprintf(output, "Successfully!\n");
-            write(client_sockfd, output, 1024);
+    // *cat f [pos l]
+    if (strcmp(command_array[0], "cat") == 0) {
+        if (command_num == 4) {
+            stream_file(session, command_array[1], atoi(command_array[2]), atoi(command_array[3]));
+        } else {
+            stream_file(session, command_array[1], 0, -1);
         }
+    }
 
-        // *w f l data
-        if (strcmp(command_array[0], "w") == 0) {
-            int flag = w_f(&cur_directory, command_array[1], atoi(command_array[2]), command_array[3]);
-            char output[1024];
-            bzero(output, 1024);
-            if (flag == -1) {
-                sprintf(output, "Error: cannot write the data\n");
-                write(client_sockfd, output, 1024);
-                continue;
-            }
-            sprintf(output, "Successfully!\n");
-            write(client_sockfd, output, 1024);
+    // *d f pos l
+    if (strcmp(command_array[0], "d") == 0) {
+        lock_file(&session->cur_directory, command_array[1], 1);
+        int flag = d_f(&session->cur_directory, command_array[1], atoi(command_array[2]), atoi(command_array[3]));
+        char output[1024];
+        bzero(output, 1024);
+        if (flag == -1) {
+            sprintf(output, "Error: cannot delete the data\n");
+            write(session->sockfd, output, 1024);
+            return 0;
         }
+        sprintf(output, "Successfully!\n");
+        write(session->sockfd, output, 1024);
+    }
 
-        // *i f pos l data
-        if (strcmp(command_array[0], "i") == 0) {
-            int flag = i_f(&cur_directory, command_array[1], atoi(command_array[2]), atoi(command_array[3]), command_array[4]);
-            char output[1024];
-            bzero(output, 1024);
-            if (flag == -1) {
-                sprintf(output, "Error: cannot insert the data\n");
-                write(client_sockfd, output, 1024);
-                continue;
-            }
-            sprintf(output, "Successfully!\n");
-            write(client_sockfd, output, 1024);
-        }
-
-        // *adduser username password
-        if (strcmp(command_array[0], "adduser") == 0) {
-            get_inode(ROOT.sector_id, &ROOT);
-            int flag = create_user(&ROOT, command_array[1], command_array[2]);
-            char output[1024];
-            bzero(output, 1024);
-            if (flag == -1) {
-                sprintf(output, "Error: cannot add the user\n");
-                write(client_sockfd, output, 1024);
-                continue;
-            }
-            sprintf(output, "Successfully!\n");
-            write(client_sockfd, output, 1024);
-        }
-
-        // *su username password
-        if (strcmp(command_array[0], "su") == 0) {
-            get_inode(ROOT.sector_id, &ROOT);
-            struct Inode user_inode;
-            int flag = change_user(&ROOT, &user_inode, command_array[1], command_array[2]);
-            char output[1024];
-            bzero(output, 1024);
-            if (flag == -1) {
-                sprintf(output, "Error: cannot switch the user\n");
-                write(client_sockfd, output, 1024);
-                continue;
-            }
-            write_inode_to_disk(&cur_directory);
-            cur_directory = user_inode;
-            sprintf(output, "Successfully!\n");
-            write(client_sockfd, output, 1024);
+    // *w f l data
+    if (strcmp(command_array[0], "w") == 0) {
+        lock_file(&session->cur_directory, command_array[1], 1);
+        int flag = w_f(&session->cur_directory, command_array[1], atoi(command_array[2]), command_array[3]);
+        char output[1024];
+        bzero(output, 1024);
+        if (flag == -1) {
+            sprintf(output, "Error: cannot write the data\n");
+            write(session->sockfd, output, 1024);
+            return 0;
+        }
+        sprintf(output, "Successfully!\n");
+        write(session->sockfd, output, 1024);
+    }
+
+    // *i f pos l data
+    if (strcmp(command_array[0], "i") == 0) {
+        lock_file(&session->cur_directory, command_array[1], 1);
+        int flag = i_f(&session->cur_directory, command_array[1], atoi(command_array[2]), atoi(command_array[3]), command_array[4]);
+        char output[1024];
+        bzero(output, 1024);
+        if (flag == -1) {
+            sprintf(output, "Error: cannot insert the data\n");
+            write(session->sockfd, output, 1024);
+            return 0;
         }
+        sprintf(output, "Successfully!\n");
+        write(session->sockfd, output, 1024);
     }
+
+    // *pw f pos l data
+    if (strcmp(command_array[0], "pw") == 0) {
+        lock_file(&session->cur_directory, command_array[1], 1);
+        int flag = pw_f(&session->cur_directory, command_array[1], atoi(command_array[2]), atoi(command_array[3]), command_array[4]);
+        char output[1024];
+        bzero(output, 1024);
+        if (flag == -1) {
+            sprintf(output, "Error: cannot write the data\n");
+            write(session->sockfd, output, 1024);
+            return 0;
+        }
+        sprintf(output, "Successfully!\n");
+        write(session->sockfd, output, 1024);
+    }
+
+    // *tr f size
+    if (strcmp(command_array[0], "tr") == 0) {
+        lock_file(&session->cur_directory, command_array[1], 1);
+        int flag = tr_f(&session->cur_directory, command_array[1], atoi(command_array[2]));
+        char output[1024];
+        bzero(output, 1024);
+        if (flag == -1) {
+            sprintf(output, "Error: cannot truncate the file\n");
+            write(session->sockfd, output, 1024);
+            return 0;
+        }
+        sprintf(output, "Successfully!\n");
+        write(session->sockfd, output, 1024);
+    }
+
+    // *sd f pos, sh f pos
+    // the first byte from pos that holds data, or that lies in a hole
+    if (strcmp(command_array[0], "sd") == 0 || strcmp(command_array[0], "sh") == 0) {
+        lock_file(&session->cur_directory, command_array[1], 0);
+        int offset = seek_f(&session->cur_directory, command_array[1], atoi(command_array[2]), command_array[0][1] == 'h');
+        char output[1024];
+        bzero(output, 1024);
+        if (offset == -1) {
+            sprintf(output, "Error: no such offset\n");
+            write(session->sockfd, output, 1024);
+            return 0;
+        }
+        sprintf(output, "Offset: %d\n", offset);
+        write(session->sockfd, output, 1024);
+    }
+
+    // *a f l data
+    if (strcmp(command_array[0], "a") == 0) {
+        lock_file(&session->cur_directory, command_array[1], 1);
+        int flag = a_f(&session->cur_directory, command_array[1], atoi(command_array[2]), command_array[3]);
+        char output[1024];
+        bzero(output, 1024);
+        if (flag == -1) {
+            sprintf(output, "Error: cannot append the data\n");
+            write(session->sockfd, output, 1024);
+            return 0;
+        }
+        sprintf(output, "Successfully!\n");
+        write(session->sockfd, output, 1024);
+    }
+
+    // *aa f l data
+    // atomic append: appenders share the file lock and each gets its own range; a range over
+    // holes is appended again in a new command that holds the lock exclusively
+    if (strcmp(command_array[0], "aa") == 0) {
+        lock_file(&session->cur_directory, command_array[1], 0);
+        int pos;
+        int flag = aa_f(&session->cur_directory, command_array[1], atoi(command_array[2]), command_array[3], &pos, 0);
+        if (flag == -2) {
+            end_command();
+            begin_command(0, 1);
+            lock_file(&session->cur_directory, command_array[1], 1);
+            flag = aa_f(&session->cur_directory, command_array[1], atoi(command_array[2]), command_array[3], &pos, 1);
+        }
+        char output[1024];
+        bzero(output, 1024);
+        if (flag == -1) {
+            sprintf(output, "Error: cannot append the data\n");
+            write(session->sockfd, output, 1024);
+            return 0;
+        }
+        sprintf(output, "Successfully! at %d\n", pos);
+        write(session->sockfd, output, 1024);
+    }
+
+    // *adduser username password
+    if (strcmp(command_array[0], "adduser") == 0) {
+        int flag = create_user(&root, command_array[1], command_array[2]);
+        char output[1024];
+        bzero(output, 1024);
+        if (flag == -1) {
+            sprintf(output, "Error: cannot add the user\n");
+            write(session->sockfd, output, 1024);
+            return 0;
+        }
+        sprintf(output, "Successfully!\n");
+        write(session->sockfd, output, 1024);
+    }
+
+    // *su username password
+    if (strcmp(command_array[0], "su") == 0) {
+        struct Inode user_inode;
+        int flag = change_user(&root, &user_inode, command_array[1], command_array[2]);
+        char output[1024];
+        bzero(output, 1024);
+        if (flag == -1) {
+            sprintf(output, "Error: cannot switch the user\n");
+            write(session->sockfd, output, 1024);
+            return 0;
+        }
+        update_inode(&session->cur_directory);
+        session->cur_directory = user_inode;
+        sprintf(output, "Successfully!\n");
+        write(session->sockfd, output, 1024);
+    }
+    return 0;
 }
 
 // --------------------------------------------------------------------------------------------
-// Execution for one client
+// Stop serving the session and release what it holds
+// --------------------------------------------------------------------------------------------
+void close_session(struct Session *session) {
+    if (session->held_root != NULL) {
+        iput(session->held_root);
+    }
+    if (session->held_directory != NULL) {
+        iput(session->held_directory);
+    }
+    end_command();
+    end_stream(session);
+    epoll_ctl(SERVER_EPOLL_FD, EPOLL_CTL_DEL, session->sockfd, NULL);
+    close(session->sockfd);
+    free(session);
+}
+
+// --------------------------------------------------------------------------------------------
+// Wait for the next command of the session, or for room in its socket while it streams
+// The session is armed one shot, so only one worker serves it at a time
+// --------------------------------------------------------------------------------------------
+void watch_session(struct Session *session) {
+    struct epoll_event event;
+    event.events = (session->stream.chunk[0] != NULL ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+    event.data.ptr = session;
+    int op = session->watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    session->watched = 1;
+    if (epoll_ctl(SERVER_EPOLL_FD, op, session->sockfd, &event) == -1) {
+        fprintf(stderr, "Error: cannot watch the client\n");
+        begin_command(0, 0);
+        close_session(session);
+    }
+}
+
 // --------------------------------------------------------------------------------------------
-void Execution_for_one_client(int client_sockfd) {
-    // *fork a child process
-    int pid = fork();
-    if (pid == -1) {
-        fprintf(stderr, "Error: cannot fork a child process\n");
-        close(client_sockfd);
+// End a step of the session after its command: send what the client takes of the stream,
+// and once it is all sent, print the current directory and wait for the next command
+// --------------------------------------------------------------------------------------------
+void finish_step(struct Session *session) {
+    if (session->stream.chunk[0] != NULL) {
+        int result = send_stream(session);
+        if (result == -1) {
+            begin_command(0, 0);
+            close_session(session);
+            return;
+        }
+        if (result == 1) {
+            watch_session(session);
+            return;
+        }
+        end_stream(session);
+    }
+    char cur_name[4096];
+    bzero(cur_name, 4096);
+    begin_command(0, 0);
+    get_current_path(&session->cur_directory, cur_name);
+    end_command();
+    write(session->sockfd, cur_name, 1024);
+    watch_session(session);
+}
+
+// --------------------------------------------------------------------------------------------
+// Serve one step of the session: the greeting of a new client or one command
+// --------------------------------------------------------------------------------------------
+void serve_session(struct Session *session) {
+    // *the client has room for more of the stream
+    if (session->stream.chunk[0] != NULL) {
+        finish_step(session);
+        return;
+    }
+
+    // *read and parse the command from the client
+    char buf[1024];
+    char command_array[10][1024];
+    int command_num = -1;
+    int len = 0;
+    if (session->started) {
+        len = read_command_from_client(session->sockfd, buf);
+    }
+    if (len > 0) {
+        command_num = parseLine(buf, command_array);
+    }
+
+    // *start the command, a change of the namespace runs alone
+    begin_command(command_num > 0 && command_changes_namespace(command_array[0]),
+                  command_num > 0 && command_changes_metadata(command_array[0]));
+    if (!session->started) {
+        // *initial the current directory in
+        get_inode(root_sector_id, &session->cur_directory);
+        cd(&session->cur_directory, "public");
+        session->started = 1;
+    } else if (len == 0) {
+        // *the client has gone
+        close_session(session);
+        return;
+    } else if (len == -1) {
+        char output[1024];
+        sprintf(output, "Error: cannot read the command from the client\n");
+        write(session->sockfd, output, 1024);
+    } else if (execute_command(session, command_array, command_num) == 1) {
+        close_session(session);
         return;
     }
 
-    // *child process
-    if (pid == 0) {
-        // *handle one client's commands in the child process
-        Execution_for_one_client_in_child_process(client_sockfd);
+    // *write back what the command changed, the other sessions may go on
+    end_command();
+    finish_step(session);
+}
+
+// --------------------------------------------------------------------------------------------
+// Queue the session on a worker
+// --------------------------------------------------------------------------------------------
+void push_session(struct Session *session) {
+    struct Work_queue *queue = &WORK_QUEUE[WORK_QUEUE_NEXT];
+    WORK_QUEUE_NEXT = (WORK_QUEUE_NEXT + 1) % WORKER_NUM;
+    pthread_mutex_lock(&queue->lock);
+    session->next = NULL;
+    if (queue->tail == NULL) {
+        queue->head = session;
+    } else {
+        queue->tail->next = session;
+    }
+    queue->tail = session;
+    pthread_mutex_unlock(&queue->lock);
+    sem_post(&WORK_NUM);
+}
+
+// --------------------------------------------------------------------------------------------
+// Take the oldest session of the queue, NULL if it is empty
+// --------------------------------------------------------------------------------------------
+struct Session *pop_session(struct Work_queue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    struct Session *session = queue->head;
+    if (session != NULL) {
+        queue->head = session->next;
+        if (queue->head == NULL) {
+            queue->tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return session;
+}
+
+// --------------------------------------------------------------------------------------------
+// Worker thread
+// A worker serves its own queue first and steals from the others when it is empty
+// --------------------------------------------------------------------------------------------
+void *worker_thread(void *arg) {
+    int id = (int)(long)arg;
+    while (1) {
+        // *every queued session posted WORK_NUM once, so one is waiting in some queue
+        sem_wait(&WORK_NUM);
+        struct Session *session = NULL;
+        while (session == NULL) {
+            for (int i = 0; i < WORKER_NUM && session == NULL; i++) {
+                session = pop_session(&WORK_QUEUE[(id + i) % WORKER_NUM]);
+            }
+        }
+        serve_session(session);
+    }
+    return NULL;
+}
+
+// --------------------------------------------------------------------------------------------
+// Cleaner thread of the log-structured layout
+// Every CLEANER_INTERVAL_MS it cleans up to CLEANER_CLEAN_SEGMENTS segments while fewer than
+// that are clean, one batch of blocks per command; a segment it could not empty is skipped
+// the next time
+// A moved block rewrites its inode, which leaves a hole where the inode was, so on a full
+// disk cleaning can gain nothing; after such a round the cleaner waits until the log has
+// taken a segment of new blocks
+// --------------------------------------------------------------------------------------------
+#ifndef CLEANER_INTERVAL_MS
+#define CLEANER_INTERVAL_MS 100
+#endif
+#ifndef CLEANER_CLEAN_SEGMENTS
+#define CLEANER_CLEAN_SEGMENTS 4
+#endif
+// --------------------------------------------------------------------------------------------
+// Clean the segment, one command per batch, until it is empty, a batch moves nothing or an
+// inode cannot be moved
+// return the used blocks left in it
+// --------------------------------------------------------------------------------------------
+int clean_segment(int victim) {
+    int used = SEGMENT_BLOCKS + 1;
+    set_log_victim(victim);
+    while (1) {
+        lock_bitmap();
+        int now_used = segment_used(victim);
+        unlock_bitmap();
+        if (now_used == 0 || now_used >= used) {
+            used = now_used;
+            break;
+        }
+        used = now_used;
+        int budget = CLEANER_BATCH_BLOCKS;
+        begin_command(1, 1);
+        int result = clean_tree(root_sector_id, victim, &budget);
+        end_command();
+        if (result == -1) {
+            break;
+        }
     }
+    set_log_victim(-1);
+    return used;
+}
 
-    // *parent process
-    else {
-        // *close the client socket
-        close(client_sockfd);
+void *cleaner_thread(void *arg) {
+    (void)arg;
+    int skip = -1;
+    long stall = -1;  // log blocks taken when a round last gained nothing
+    while (1) {
+        usleep(CLEANER_INTERVAL_MS * 1000);
+        lock_bitmap();
+        long log_block_num = BITMAP->log_block_num;
+        unlock_bitmap();
+        if (stall != -1 && log_block_num - stall < SEGMENT_BLOCKS) {
+            continue;
+        }
+        stall = -1;
+        int clean_num = clean_segment_num();
+        for (int i = 0; i < CLEANER_CLEAN_SEGMENTS && clean_segment_num() < CLEANER_CLEAN_SEGMENTS; i++) {
+            int victim = choose_victim_segment(skip);
+            if (victim == -1) {
+                break;
+            }
+            skip = clean_segment(victim) > 0 ? victim : -1;
+        }
+        if (clean_segment_num() <= clean_num && clean_num < CLEANER_CLEAN_SEGMENTS) {
+            lock_bitmap();
+            stall = BITMAP->log_block_num;
+            unlock_bitmap();
+        }
     }
+    return NULL;
 }
 
 // --------------------------------------------------------------------------------------------
 // Build the server
 // Bind the server to the port
-// Accept the client
-// Execute the client's commands
+// Accept the clients and wait for their commands in one epoll reactor
+// Execute the client's commands on the worker threads, one per core
 // --------------------------------------------------------------------------------------------
 void create_disk_server(int port) {
     // *create FS server
     int sockfd;
     create_server(&sockfd, port);
 
+    // *a client that disconnects must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // *create the reactor
+    SERVER_EPOLL_FD = epoll_create1(0);
+    if (SERVER_EPOLL_FD == -1) {
+        fprintf(stderr, "Error: cannot create the epoll instance\n");
+        exit(1);
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(SERVER_EPOLL_FD, EPOLL_CTL_ADD, sockfd, &event);
+
+    // *start the workers
+    WORKER_NUM = sysconf(_SC_NPROCESSORS_ONLN);
+    if (WORKER_NUM < 1) {
+        WORKER_NUM = 1;
+    }
+    if (WORKER_NUM > MAX_WORKER_NUM) {
+        WORKER_NUM = MAX_WORKER_NUM;
+    }
+    sem_init(&WORK_NUM, 0, 0);
+    for (int i = 0; i < WORKER_NUM; i++) {
+        pthread_mutex_init(&WORK_QUEUE[i].lock, NULL);
+        WORK_QUEUE[i].head = NULL;
+        WORK_QUEUE[i].tail = NULL;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker_thread, (void *)(long)i) != 0) {
+            fprintf(stderr, "Error: cannot create the worker threads\n");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+    printf("Workers: %d\n", WORKER_NUM);
+    if (LOG_STRUCTURED) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, cleaner_thread, NULL) != 0) {
+            fprintf(stderr, "Error: cannot create the cleaner thread\n");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+
     // *client execution
+    struct epoll_event ready[MAX_WORKER_NUM];
     while (1) {
-        // *accept the client
-        struct sockaddr_in client_addr;
-        socklen_t client_addr_len = sizeof(client_addr);
-        int client_sockfd = accept(sockfd, (struct sockaddr *)&client_addr, &client_addr_len);
-
-        // *handle error or disconnection
-        if (client_sockfd == -1) {
-            fprintf(stderr, "Error: cannot accept the client\n");
-            continue;
-        }
+        int ready_num = epoll_wait(SERVER_EPOLL_FD, ready, MAX_WORKER_NUM, -1);
+        for (int i = 0; i < ready_num; i++) {
+            // *a client has sent a command
+            if (ready[i].data.ptr != NULL) {
+                push_session((struct Session *)ready[i].data.ptr);
+                continue;
+            }
+
+            // *accept the client
+            struct sockaddr_in client_addr;
+            socklen_t client_addr_len = sizeof(client_addr);
+            int client_sockfd = accept(sockfd, (struct sockaddr *)&client_addr, &client_addr_len);
+
+            // *handle error or disconnection
+            if (client_sockfd == -1) {
+                fprintf(stderr, "Error: cannot accept the client\n");
+                continue;
+            }
 
-        // *print the client's IP address and port
-        printf("Client %s:%d connected\n",
-               inet_ntoa(client_addr.sin_addr),
-               ntohs(client_addr.sin_port));
+            // *print the client's IP address and port
+            printf("Client %s:%d connected\n",
+                   inet_ntoa(client_addr.sin_addr),
+                   ntohs(client_addr.sin_port));
 
-        // *execute the client's commands
-        Execution_for_one_client(client_sockfd);
+            // *greet the client on a worker
+            struct Session *session = calloc(1, sizeof(struct Session));
+            if (session == NULL) {
+                fprintf(stderr, "Error: failed to allocate memory for the session\n");
+                close(client_sockfd);
+                continue;
+            }
+            session->sockfd = client_sockfd;
+            push_session(session);
+        }
     }
 }
 
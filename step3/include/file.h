@@ -1,5 +1,6 @@
 #ifndef FILE_H
 #define FILE_H
+#include <limits.h>
 #include "inode.h"
 #include "directory.h"
 // --------------------------------------------------------------------------------------------
@@ -48,6 +49,274 @@ int create_directory(struct Inode *inode, char *name) {
     add_name(inode, &new_inode, name, new_inode_id);
     return 0;
 }
+// *--------------------------------------------------------------------------------------------
+// * Byte map
+// *--------------------------------------------------------------------------------------------
+// a file block holds 256 bytes unless it is the partial last block of an extent, see inode.h;
+// a file without partial blocks maps byte pos to block pos / 256, the others walk their extents
+// --------------------------------------------------------------------------------------------
+struct File_piece {
+    int index;      // block of the file
+    int sector_id;  // its sector
+    int from;       // first byte of the range in the block
+    int bytes;      // bytes of the range in the block
+    int fill;       // bytes the block holds
+};
+// --------------------------------------------------------------------------------------------
+// Map bytes pos .. pos + length - 1 to the blocks holding them, one piece per block
+// the range must lie in the blocks of the file, block_num * 256 - gap_bytes bytes
+// return the number of pieces
+// --------------------------------------------------------------------------------------------
+int map_file_range(struct Inode *inode, int pos, int length, struct File_piece *piece) {
+    if (length <= 0) {
+        return 0;
+    }
+    int end = pos + length;
+    int count = 0;
+    if (inode->gap_bytes == 0) {
+        int first = pos / 256;
+        count = (end - 1) / 256 - first + 1;
+        int sector_id[count + 1];
+        get_sector_ids(inode, first, count, sector_id);
+        for (int i = 0; i < count; i++) {
+            int block_pos = (first + i) * 256;
+            piece[i].index = first + i;
+            piece[i].sector_id = sector_id[i];
+            piece[i].from = pos > block_pos ? pos - block_pos : 0;
+            piece[i].bytes = (end < block_pos + 256 ? end - block_pos : 256) - piece[i].from;
+            piece[i].fill = 256;
+        }
+        return count;
+    }
+    // *walk the runs of sectors, a run before the range is skipped whole
+    struct Bmap_iterator it;
+    int index, start, run;
+    int block_pos = 0;
+    bmap_begin(&it, inode, 0, inode->block_num);
+    while (block_pos < end && bmap_next(&it, &index, &start, &run)) {
+        int partial = index + run == it.extent.logical + it.extent.length && it.extent.tail != 0;
+        int run_bytes = run * 256 - (partial ? 256 - it.extent.tail : 0);
+        if (block_pos + run_bytes <= pos) {
+            block_pos += run_bytes;
+            continue;
+        }
+        for (int j = 0; j < run && block_pos < end; j++) {
+            int fill = partial && j == run - 1 ? it.extent.tail : 256;
+            if (block_pos + fill > pos) {
+                piece[count].index = index + j;
+                piece[count].sector_id = start == EXTENT_HOLE ? EXTENT_HOLE : start + j;
+                piece[count].from = pos > block_pos ? pos - block_pos : 0;
+                piece[count].bytes = (end < block_pos + fill ? end - block_pos : fill) - piece[count].from;
+                piece[count].fill = fill;
+                count++;
+            }
+            block_pos += fill;
+        }
+    }
+    return count;
+}
+// --------------------------------------------------------------------------------------------
+// Bound the blocks a range of length bytes may touch, a block holds at least one byte
+// --------------------------------------------------------------------------------------------
+int range_block_num(struct Inode *inode, int length) {
+    int bound = inode->gap_bytes == 0 ? length / 256 + 2 : length + 1;
+    return bound < inode->block_num + 1 ? bound : inode->block_num + 1;
+}
+// --------------------------------------------------------------------------------------------
+// Get the sector and the bytes of count blocks of the inode from first
+// --------------------------------------------------------------------------------------------
+void get_block_fills(struct Inode *inode, int first, int count, int *sector_id, int *fill) {
+    struct Bmap_iterator it;
+    int index, start, run;
+    bmap_begin(&it, inode, first, count);
+    while (bmap_next(&it, &index, &start, &run)) {
+        for (int j = 0; j < run; j++) {
+            sector_id[index - first + j] = start == EXTENT_HOLE ? EXTENT_HOLE : start + j;
+            fill[index - first + j] = 256;
+        }
+        if (index + run == it.extent.logical + it.extent.length && it.extent.tail != 0) {
+            fill[index - first + run - 1] = it.extent.tail;
+        }
+    }
+}
+// --------------------------------------------------------------------------------------------
+// Append a run of blocks to a list of extents, joining the last one when it follows it
+// a hole only joins a hole
+// --------------------------------------------------------------------------------------------
+void push_extent(struct Extent *list, int *count, int first_logical, int start, int length, int tail) {
+    struct Extent *last = *count > 0 ? &list[*count - 1] : NULL;
+    int follows = last != NULL && (last->start == EXTENT_HOLE ? start == EXTENT_HOLE
+                                                               : start != EXTENT_HOLE && last->start + last->length == start);
+    if (last != NULL && last->tail == 0 && follows) {
+        last->length += length;
+        last->tail = tail;
+        return;
+    }
+    list[*count].logical = last != NULL ? last->logical + last->length : first_logical;
+    list[*count].start = start;
+    list[*count].length = length;
+    list[*count].tail = tail;
+    (*count)++;
+}
+// --------------------------------------------------------------------------------------------
+// Count the index and leaf blocks of extent_num extents
+// --------------------------------------------------------------------------------------------
+int extent_tree_block_num(int extent_num) {
+    if (extent_num <= INLINE_EXTENT_NUM) {
+        return 0;
+    }
+    return 1 + (extent_num - INLINE_EXTENT_NUM + LEAF_EXTENT_NUM - 1) / LEAF_EXTENT_NUM;
+}
+// --------------------------------------------------------------------------------------------
+// Count the extent tree blocks one edit of the file may dirty: the tree it has, and the
+// tree built again with up to EDIT_EXTENT_NUM more extents, whose blocks may be new
+// --------------------------------------------------------------------------------------------
+#define EDIT_EXTENT_NUM 16
+int edit_meta_num(struct Inode *inode) {
+    int after = inode->extent_num + EDIT_EXTENT_NUM < MAX_EXTENT_NUM ? inode->extent_num + EDIT_EXTENT_NUM : MAX_EXTENT_NUM;
+    return extent_tree_block_num(inode->extent_num) + 2 * extent_tree_block_num(after);
+}
+// --------------------------------------------------------------------------------------------
+// Replace blocks first .. last of the file by count blocks, block i in sector_id[i] holding
+// fill[i] bytes; last = first - 1 puts them before block first
+// the extents from the one holding block first on are built again; the replaced blocks are
+// not freed
+// return -1 if the file would need more than MAX_EXTENT_NUM extents or the disk has no
+// room for its extent tree, the block map is then left as it was
+// --------------------------------------------------------------------------------------------
+int splice_blocks(struct Inode *inode, int first, int last, int *sector_id, int *fill, int count) {
+    int k = inode->extent_num;
+    if (first < inode->block_num) {
+        struct Bmap_iterator it;
+        bmap_begin(&it, inode, first, 1);
+        k = it.k;
+    }
+    int old_num = inode->extent_num - k;
+    struct Extent *old = malloc((old_num + 1) * sizeof(struct Extent));
+    struct Extent *list = malloc((old_num + count + 2) * sizeof(struct Extent));
+    if (old == NULL || list == NULL) {
+        free(old);
+        free(list);
+        return -1;
+    }
+    for (int j = 0; j < old_num; j++) {
+        read_extent(inode, k + j, &old[j]);
+    }
+    int first_logical = old_num > 0 ? old[0].logical : inode->block_num;
+    int n = 0;
+    // *the blocks before first, the new ones, then the blocks after last
+    for (int j = 0; j < old_num && old[j].logical < first; j++) {
+        int end = old[j].logical + old[j].length;
+        push_extent(list, &n, first_logical, old[j].start, (end < first ? end : first) - old[j].logical, end <= first ? old[j].tail : 0);
+    }
+    for (int i = 0; i < count; i++) {
+        push_extent(list, &n, first_logical, sector_id[i], 1, fill[i] == 256 ? 0 : fill[i]);
+    }
+    for (int j = 0; j < old_num; j++) {
+        int end = old[j].logical + old[j].length;
+        if (end <= last + 1) {
+            continue;
+        }
+        int from = old[j].logical > last + 1 ? old[j].logical : last + 1;
+        int start = old[j].start == EXTENT_HOLE ? EXTENT_HOLE : old[j].start + from - old[j].logical;
+        push_extent(list, &n, first_logical, start, end - from, old[j].tail);
+    }
+    // *the last block of the file ends where file_size says
+    if (n > 0) {
+        list[n - 1].tail = 0;
+    }
+    free(old);
+    // *the tree blocks of the extents from k on are taken anew, while the ones they leave
+    //  stay used until the group commits, so all of them must be free before anything goes;
+    //  the bitmap is held until the tree is built, so no other command takes them
+    lock_bitmap();
+    int tree_num = extent_tree_block_num(k + n) - extent_tree_block_num(k);
+    if (k + n > MAX_EXTENT_NUM || tree_num > allocatable_block_num()) {
+        unlock_bitmap();
+        free(list);
+        return -1;
+    }
+    while (inode->extent_num > k) {
+        remove_tail_extent(inode);
+    }
+    int result = 0;
+    for (int i = 0; i < n && result == 0; i++) {
+        result = append_extent(inode, &list[i]);
+    }
+    unlock_bitmap();
+    free(list);
+    if (result == -1) {
+        fprintf(stderr, "Error: no block for the extents of inode %d\n", inode->sector_id);
+        return -1;
+    }
+    inode->block_num += count - (last - first + 1);
+    update_inode(inode);
+    return 0;
+}
+// --------------------------------------------------------------------------------------------
+// Allocate count blocks for the middle of a file, near goal, in as few runs as the disk allows
+// --------------------------------------------------------------------------------------------
+int allocate_loose_blocks(int goal, int count, int *sector_id) {
+    lock_bitmap();
+    for (int allocated = 0; allocated < count;) {
+        int length;
+        int start = LOG_STRUCTURED ? search_log_run(count - allocated, &length) : search_free_run(goal, count - allocated, &length);
+        if (start == -1) {
+            for (int i = 0; i < allocated; i++) {
+                mark_block_free(sector_id[i]);
+            }
+            unlock_bitmap();
+            return -1;
+        }
+        for (int i = 0; i < length; i++) {
+            mark_block_used(start + i);
+            sector_id[allocated++] = start + i;
+        }
+        goal = start + length;
+    }
+    unlock_bitmap();
+    return 0;
+}
+// --------------------------------------------------------------------------------------------
+// Give sectors to the blocks of holes among count blocks of the file from first
+// output: the sectors of the count blocks, and whether each one was in a hole
+// --------------------------------------------------------------------------------------------
+int fill_holes(struct Inode *inode, int first, int count, int *sector_id, int *was_hole) {
+    int fill[count + 1];
+    get_block_fills(inode, first, count, sector_id, fill);
+    int hole_num = 0;
+    for (int i = 0; i < count; i++) {
+        was_hole[i] = sector_id[i] == EXTENT_HOLE;
+        hole_num += was_hole[i];
+    }
+    if (hole_num == 0) {
+        return 0;
+    }
+    // *near the block before the range when it has a sector
+    int goal = inode->sector_id + 1;
+    int before;
+    if (first > 0 && get_sector_id(inode, first - 1, &before) == 0 && before != EXTENT_HOLE) {
+        goal = before + 1;
+    }
+    int new_id[hole_num + 1];
+    if (allocate_loose_blocks(goal, hole_num, new_id) == -1) {
+        return -1;
+    }
+    for (int i = 0, j = 0; i < count; i++) {
+        if (was_hole[i]) {
+            sector_id[i] = new_id[j++];
+        }
+    }
+    if (splice_blocks(inode, first, first + count - 1, sector_id, fill, count) == -1) {
+        lock_bitmap();
+        for (int j = 0; j < hole_num; j++) {
+            mark_block_free(new_id[j]);
+        }
+        unlock_bitmap();
+        return -1;
+    }
+    return 0;
+}
 // --------------------------------------------------------------------------------------------
 // Clear the content of a file
 // --------------------------------------------------------------------------------------------
@@ -56,10 +325,8 @@ int clear_file(struct Inode *inode) {
     if (inode->file_type == 1) {
         return -1;
     }
-    // clear the content of the file
-    int block_num = inode->block_num;
-    for (int i = 0; i < block_num; i++)
-        remove_tail_block(inode);
+    // clear the content of the file in one pass
+    truncate_blocks(inode, 0);
     // update the inode
     get_inode(inode->sector_id, inode);
     return 0;
@@ -75,18 +342,366 @@ int write_file(struct Inode *inode, int length, char *content) {
     // clear the content of the file
     clear_file(inode);
     // printf("id: %d\n", inode->sector_id);
-    // write the content to the file
+    // *a small file lives in the inode, no block is allocated
+    if (length <= INLINE_DATA_SIZE) {
+        memset(inode->extent, 0, sizeof(inode->extent));
+        memcpy(inode->extent, content, length);
+        inode->file_size = length;
+        update_inode(inode);
+        return 0;
+    }
+    // *delayed allocation: the final size is known, so all blocks are allocated together
+    // as contiguous as the disk allows, and the inode is written once
     int block_num = (length + 255) / 256;
     inode->file_size = length;
-    for (int i = 0; i < block_num; i++) {
-        int id;
-        init_new_block(inode, &id);
-        write_block(id, content + i * 256);
+    int sector_id[block_num + 1];
+    if (allocate_blocks(inode, block_num, sector_id) == -1) {
+        // *the blocks it did get were never written, the file stays empty
+        truncate_blocks(inode, 0);
+        inode->file_size = 0;
+        update_inode(inode);
+        return -1;
+    }
+    // the full blocks in one batch, the last one padded so the content is never read past its end
+    int full_num = length / 256;
+    write_data_blocks(sector_id, full_num, content);
+    if (full_num < block_num) {
+        char tail[256];
+        memset(tail, 0, 256);
+        memcpy(tail, content + full_num * 256, length - full_num * 256);
+        write_data_blocks(&sector_id[full_num], 1, tail);
+    }
+    update_inode(inode);
+    return 0;
+}
+// --------------------------------------------------------------------------------------------
+// Move the inline content of a file to its first block, before the file outgrows the inode
+// --------------------------------------------------------------------------------------------
+int expand_inline_data(struct Inode *inode) {
+    int length = inode->file_size;
+    char block[256];
+    memset(block, 0, 256);
+    memcpy(block, inode->extent, length);
+    memset(inode->extent, 0, sizeof(inode->extent));
+    if (length == 0) {
+        return 0;
+    }
+    int sector_id;
+    if (allocate_blocks(inode, 1, &sector_id) == -1) {
+        memcpy(inode->extent, block, length);
+        update_inode(inode);
+        return -1;
+    }
+    write_data_blocks(&sector_id, 1, block);
+    return 0;
+}
+// --------------------------------------------------------------------------------------------
+// Overwrite length bytes of a file at pos
+// only the blocks of the range are written, and the two at its ends read first when they are
+// partly kept; blocks are allocated only when the file grows, a gap after the old end is
+// zero-filled, its whole blocks past the last block become a hole
+// --------------------------------------------------------------------------------------------
+int pwrite_file(struct Inode *inode, int pos, int length, char *content) {
+    // if it is a directory, return -1
+    if (inode->file_type == 1 || pos < 0 || length < 0 || pos > INT_MAX - length) {
+        return -1;
+    }
+    if (length == 0) {
+        return 0;
+    }
+    // *a small file is written in the inode while it fits there
+    if (has_inline_data(inode)) {
+        if (pos + length <= INLINE_DATA_SIZE) {
+            char *data = (char *)inode->extent;
+            if (pos > inode->file_size) {
+                memset(data + inode->file_size, 0, pos - inode->file_size);
+            }
+            memcpy(data + pos, content, length);
+            if (pos + length > inode->file_size) {
+                inode->file_size = pos + length;
+            }
+            update_inode(inode);
+            return 0;
+        }
+        if (expand_inline_data(inode) == -1) {
+            return -1;
+        }
+    }
+    int end = pos + length;
+    int start = pos < inode->file_size ? pos : inode->file_size;
+    int capacity = inode->block_num * 256 - inode->gap_bytes;
+    int block_num = inode->block_num;
+    // *whole blocks of a gap past the last block become a hole, which is never written
+    int hole_start = capacity;
+    if (pos >= capacity + 256) {
+        int hole_num = (pos - capacity) / 256;
+        if (append_hole(inode, hole_num) == -1) {
+            return -1;
+        }
+        capacity += hole_num * 256;
+    }
+    int hole_end = capacity;
+    if (end > capacity) {
+        int new_num = (end - capacity + 255) / 256;
+        int sector_id[new_num + 1];
+        if (allocate_blocks(inode, new_num, sector_id) == -1) {
+            // *no hole is left past the end of the file
+            if (inode->block_num > block_num) {
+                truncate_blocks(inode, block_num);
+            }
+            update_inode(inode);
+            return -1;
+        }
+    }
+    // *the range from start: the gap before the hole, then the gap after it and the content
+    int before = hole_end > hole_start ? hole_start - start : 0;
+    int after = hole_end > hole_start ? hole_end : start;
+    int bound = range_block_num(inode, before) + range_block_num(inode, end - after);
+    struct File_piece *piece = malloc(bound * sizeof(struct File_piece));
+    char *buffer = malloc((long)bound * 256);
+    if (piece == NULL || buffer == NULL) {
+        free(piece);
+        free(buffer);
+        return -1;
+    }
+    int split = map_file_range(inode, start, before, piece);
+    int count = split + map_file_range(inode, after, end - after, piece + split);
+    // *the blocks of holes the content falls in get sectors, a hole in the gap stays a hole
+    int first = split;
+    int offset = after;
+    while (first < count && offset + piece[first].bytes <= pos) {
+        offset += piece[first++].bytes;
+    }
+    int sector_id[count + 1];
+    int was_hole[count + 1];
+    int hole_num = 0;
+    for (int i = 0; i < count; i++) {
+        sector_id[i] = piece[i].sector_id;
+        was_hole[i] = 0;
+        hole_num += i >= first && sector_id[i] == EXTENT_HOLE;
+    }
+    if (hole_num > 0 && fill_holes(inode, piece[first].index, count - first, sector_id + first, was_hole + first) == -1) {
+        free(piece);
+        free(buffer);
+        return -1;
+    }
+    int write_num = 0;
+    offset = start;
+    for (int i = 0; i < count; i++) {
+        if (i == split) {
+            offset = after;
+        }
+        if (sector_id[i] == EXTENT_HOLE) {
+            offset += piece[i].bytes;
+            continue;
+        }
+        char *block = buffer + write_num * 256;
+        // *a block keeps the bytes of the file around the range
+        int kept_after = piece[i].from + piece[i].bytes < piece[i].fill && offset + piece[i].bytes < inode->file_size;
+        if ((piece[i].from > 0 || kept_after) && !was_hole[i]) {
+            read_block(sector_id[i], block);
+        } else {
+            memset(block, 0, 256);
+        }
+        // *the bytes before pos are the zeros of the gap
+        int gap = pos > offset ? (pos - offset < piece[i].bytes ? pos - offset : piece[i].bytes) : 0;
+        memset(block + piece[i].from, 0, gap);
+        if (gap < piece[i].bytes) {
+            memcpy(block + piece[i].from + gap, content + offset + gap - pos, piece[i].bytes - gap);
+        }
+        offset += piece[i].bytes;
+        sector_id[write_num++] = sector_id[i];
+    }
+    write_data_blocks(sector_id, write_num, buffer);
+    free(piece);
+    free(buffer);
+    // *an overwrite inside the file leaves the inode as it is
+    if (end > inode->file_size) {
+        inode->file_size = end;
+        update_inode(inode);
     }
-    write_inode_to_disk(inode);
     return 0;
 }
 // --------------------------------------------------------------------------------------------
+// Append length bytes to a file
+// only the partial last block is read, and blocks are allocated for the new tail only
+// --------------------------------------------------------------------------------------------
+int append_file(struct Inode *inode, int length, char *content) {
+    return pwrite_file(inode, inode->file_size, length, content);
+}
+// --------------------------------------------------------------------------------------------
+// Whether the blocks the file already has for length bytes from pos include a hole
+// --------------------------------------------------------------------------------------------
+int range_has_hole(struct Inode *inode, int pos, int length) {
+    int capacity = inode->block_num * 256 - inode->gap_bytes;
+    if (has_inline_data(inode) || pos >= capacity) {
+        return 0;
+    }
+    if (length > capacity - pos) {
+        length = capacity - pos;
+    }
+    struct File_piece *piece = malloc(range_block_num(inode, length) * sizeof(struct File_piece));
+    if (piece == NULL) {
+        return 1;
+    }
+    int count = map_file_range(inode, pos, length, piece);
+    int hole = 0;
+    for (int i = 0; i < count; i++) {
+        hole |= piece[i].sector_id == EXTENT_HOLE;
+    }
+    free(piece);
+    return hole;
+}
+// --------------------------------------------------------------------------------------------
+// Append length bytes to a file while other appenders may run, pos gets where they landed
+// the caller holds the inode lock shared: under the append slot an appender allocates the
+// blocks of the range after the last reserved one, reserves it and writes the blocks it shares
+// with the ranges around it; its whole blocks are written after the slot is released, and
+// the last appender to finish moves file_size to the end of all reserved ranges, so a
+// reader never sees a range before its data
+// a range over holes would change the block map under the readers, so with the lock shared
+// it returns -2 and changes nothing; exclusive: the caller holds the inode lock exclusively,
+// no other appender runs and the data is appended in place
+// --------------------------------------------------------------------------------------------
+int append_file_atomic(int inode_id, int length, char *content, int *pos, int exclusive) {
+    struct Append_slot *slot = &SHARED_STATE->append_slot[inode_id % INODE_LOCK_NUM];
+    struct Inode inode;
+    pthread_mutex_lock(&slot->lock);
+    if (get_inode(inode_id, &inode) == -1 || inode.file_type == 1 || length < 0) {
+        pthread_mutex_unlock(&slot->lock);
+        return -1;
+    }
+    // *an inode sharing the slot with pending appends appends in place, and so does a file
+    // in its inode, which has no pending appends
+    int in_place = exclusive || (slot->pending > 0 && slot->inode_id != inode_id) || has_inline_data(&inode);
+    *pos = in_place || slot->pending == 0 ? inode.file_size : slot->end;
+    if (!exclusive && range_has_hole(&inode, *pos, length)) {
+        pthread_mutex_unlock(&slot->lock);
+        return -2;
+    }
+    if (in_place) {
+        int result = append_file(&inode, length, content);
+        pthread_mutex_unlock(&slot->lock);
+        return result;
+    }
+    if (*pos > INT_MAX - length) {
+        pthread_mutex_unlock(&slot->lock);
+        return -1;
+    }
+    int end = *pos + length;
+    int capacity = inode.block_num * 256 - inode.gap_bytes;
+    if (end > capacity) {
+        int new_num = (end - capacity + 255) / 256;
+        int sector_id[new_num + 1];
+        int result = allocate_blocks(&inode, new_num, sector_id);
+        update_inode(&inode);
+        if (result == -1) {
+            pthread_mutex_unlock(&slot->lock);
+            return -1;
+        }
+    }
+    // *everything that can fail comes before the range is reserved, a reserved range is
+    //  published by the last appender whatever happens to its own
+    int bound = range_block_num(&inode, length);
+    struct File_piece *piece = malloc(bound * sizeof(struct File_piece));
+    char *buffer = malloc((long)bound * 256);
+    int *sector_id = malloc(bound * sizeof(int));
+    if (piece == NULL || buffer == NULL || sector_id == NULL) {
+        pthread_mutex_unlock(&slot->lock);
+        free(piece);
+        free(buffer);
+        free(sector_id);
+        return -1;
+    }
+    int count = map_file_range(&inode, *pos, length, piece);
+    if (slot->pending == 0) {
+        slot->inode_id = inode_id;
+    }
+    slot->end = end;
+    slot->pending++;
+    // *a block shared with another range is written under the slot
+    int result = 0;
+    int whole_num = 0;
+    int done = 0;
+    for (int i = 0; i < count; i++) {
+        char *block = buffer + whole_num * 256;
+        if (piece[i].bytes == 256) {
+            memcpy(block, content + done, 256);
+            sector_id[whole_num++] = piece[i].sector_id;
+        } else {
+            if (piece[i].from > 0) {
+                read_block(piece[i].sector_id, block);
+            }
+            memcpy(block + piece[i].from, content + done, piece[i].bytes);
+            result |= write_data_blocks(&piece[i].sector_id, 1, block);
+        }
+        done += piece[i].bytes;
+    }
+    pthread_mutex_unlock(&slot->lock);
+    result |= write_data_blocks(sector_id, whole_num, buffer);
+    // *the range is published with the others, so a failed one holds zeros, not old data
+    pthread_mutex_lock(&slot->lock);
+    if (result != 0) {
+        for (int i = 0; i < count; i++) {
+            char block[256];
+            memset(block, 0, 256);
+            if (piece[i].bytes < 256) {
+                read_block(piece[i].sector_id, block);
+                memset(block + piece[i].from, 0, piece[i].bytes);
+            }
+            write_data_blocks(&piece[i].sector_id, 1, block);
+        }
+    }
+    free(piece);
+    free(buffer);
+    free(sector_id);
+    // *the last appender publishes every range
+    if (--slot->pending == 0) {
+        get_inode(inode_id, &inode);
+        if (slot->end > inode.file_size) {
+            inode.file_size = slot->end;
+            update_inode(&inode);
+        }
+    }
+    pthread_mutex_unlock(&slot->lock);
+    return result == 0 ? 0 : -1;
+}
+// --------------------------------------------------------------------------------------------
+// Read length bytes of a file from pos
+// return the number of bytes read, -1 if the range is not in the file
+// --------------------------------------------------------------------------------------------
+int read_file_range(struct Inode *inode, int pos, int length, char *content) {
+    if (inode->file_type == 1 || pos < 0 || length < 0 || pos > inode->file_size - length) {
+        return -1;
+    }
+    if (has_inline_data(inode)) {
+        memcpy(content, (char *)inode->extent + pos, length);
+        return length;
+    }
+    int bound = range_block_num(inode, length);
+    struct File_piece *piece = malloc(bound * sizeof(struct File_piece));
+    char *buffer = malloc((long)bound * 256);
+    if (piece == NULL || buffer == NULL) {
+        free(piece);
+        free(buffer);
+        return -1;
+    }
+    int count = map_file_range(inode, pos, length, piece);
+    int sector_id[count + 1];
+    for (int i = 0; i < count; i++) {
+        sector_id[i] = piece[i].sector_id;
+    }
+    read_file_blocks(sector_id, count, buffer);
+    int done = 0;
+    for (int i = 0; i < count; i++) {
+        memcpy(content + done, buffer + i * 256 + piece[i].from, piece[i].bytes);
+        done += piece[i].bytes;
+    }
+    free(piece);
+    free(buffer);
+    return done;
+}
+// --------------------------------------------------------------------------------------------
 // Read from a file
 // --------------------------------------------------------------------------------------------
 int read_file(struct Inode *inode, int length, char *content) {
@@ -99,12 +714,16 @@ int read_file(struct Inode *inode, int length, char *content) {
     if (length > file_size) {
         return -1;
     }
-    // read the content from the file
-    int block_num = (length + 255) / 256;
-    read_inode(inode, 0, content);
-    for (int i = 0; i < block_num; i++) {
-        read_inode(inode, i, content + i * 256);
+    // *partial blocks inside the file are joined piece by piece
+    if (inode->gap_bytes != 0 || has_inline_data(inode)) {
+        read_file_range(inode, 0, length, content);
+        return file_size;
     }
+    // read the content from the file in one batch
+    int block_num = (length + 255) / 256;
+    int sector_id[block_num + 1];
+    get_sector_ids(inode, 0, block_num, sector_id);
+    read_file_blocks(sector_id, block_num, content);
 
     return file_size;
 }
@@ -112,6 +731,293 @@ int read_whole_file(struct Inode *inode, char *content) {
     return read_file(inode, inode->file_size, content);
 }
 // --------------------------------------------------------------------------------------------
+// Write a file again in full blocks, when its partial blocks need too many extents
+// the copy goes to new blocks and the old ones are freed only once the extents point at it,
+// so a disk without room for the copy leaves the file as it was
+// --------------------------------------------------------------------------------------------
+int repack_file(struct Inode *inode) {
+    int length = inode->file_size;
+    int old_num = inode->block_num;
+    int new_num = (length + 255) / 256;
+    char *content = malloc((long)new_num * 256 + 256);
+    int *old_id = malloc((old_num + 1) * sizeof(int));
+    int *sector_id = malloc((new_num + 1) * sizeof(int));
+    int *fill = malloc((new_num + 1) * sizeof(int));
+    if (content == NULL || old_id == NULL || sector_id == NULL || fill == NULL) {
+        free(content);
+        free(old_id);
+        free(sector_id);
+        free(fill);
+        return -1;
+    }
+    memset(content, 0, (long)new_num * 256);
+    read_file(inode, length, content);
+    get_sector_ids(inode, 0, old_num, old_id);
+    for (int i = 0; i < new_num; i++) {
+        fill[i] = i < new_num - 1 ? 256 : length - i * 256;
+    }
+    int result = allocate_loose_blocks(inode->sector_id + 1, new_num, sector_id);
+    if (result == 0) {
+        write_data_blocks(sector_id, new_num, content);
+        result = splice_blocks(inode, 0, old_num - 1, sector_id, fill, new_num);
+        // *the blocks of the old or of the new copy are no longer needed
+        int *unused = result == 0 ? old_id : sector_id;
+        int unused_num = result == 0 ? old_num : new_num;
+        lock_bitmap();
+        for (int i = 0; i < unused_num; i++) {
+            if (unused[i] != EXTENT_HOLE) {
+                mark_block_free(unused[i]);
+            }
+        }
+        unlock_bitmap();
+    }
+    free(content);
+    free(old_id);
+    free(sector_id);
+    free(fill);
+    return result;
+}
+// --------------------------------------------------------------------------------------------
+// Insert length bytes into a file at pos
+// the block holding pos is split: its bytes before pos, the content and its bytes after pos
+// go to it and to new blocks after it, the last of them partial; the rest of the file stays
+// where it is and only the extents after pos are written again
+// --------------------------------------------------------------------------------------------
+int insert_file(struct Inode *inode, int pos, int length, char *content) {
+    // if it is a directory, return -1
+    if (inode->file_type == 1 || pos < 0 || length < 0 || pos > INT_MAX - length) {
+        return -1;
+    }
+    if (length == 0) {
+        return 0;
+    }
+    if (pos >= inode->file_size) {
+        return pwrite_file(inode, inode->file_size, length, content);
+    }
+    // *a small file is changed in the inode while it fits there
+    if (has_inline_data(inode)) {
+        if (inode->file_size + length <= INLINE_DATA_SIZE) {
+            char *data = (char *)inode->extent;
+            memmove(data + pos + length, data + pos, inode->file_size - pos);
+            memcpy(data + pos, content, length);
+            inode->file_size += length;
+            update_inode(inode);
+            return 0;
+        }
+        if (expand_inline_data(inode) == -1) {
+            return -1;
+        }
+    }
+    struct File_piece at;
+    map_file_range(inode, pos, 1, &at);
+    // *the last block of the file holds only the bytes up to file_size
+    int block_pos = pos - at.from;
+    int used = at.index == inode->block_num - 1 ? inode->file_size - block_pos : at.fill;
+    int total = used + length;
+    int new_num = (total + 255) / 256;
+    char *buffer = malloc((long)new_num * 256);
+    int *sector_id = malloc(new_num * sizeof(int));
+    int *fill = malloc(new_num * sizeof(int));
+    if (buffer == NULL || sector_id == NULL || fill == NULL) {
+        free(buffer);
+        free(sector_id);
+        free(fill);
+        return -1;
+    }
+    char block[256];
+    if (at.sector_id == EXTENT_HOLE) {
+        memset(block, 0, 256);
+    } else {
+        read_block(at.sector_id, block);
+    }
+    memset(buffer, 0, (long)new_num * 256);
+    memcpy(buffer, block, at.from);
+    memcpy(buffer + at.from, content, length);
+    memcpy(buffer + at.from + length, block + at.from, used - at.from);
+    for (int i = 0; i < new_num; i++) {
+        fill[i] = i < new_num - 1 ? 256 : total - i * 256;
+    }
+    // *the block keeps its sector, one in a hole gets a sector like the new blocks
+    sector_id[0] = at.sector_id;
+    int kept = at.sector_id == EXTENT_HOLE ? 0 : 1;
+    int goal = kept ? at.sector_id + 1 : inode->sector_id + 1;
+    int result = -1;
+    if (new_num == kept || allocate_loose_blocks(goal, new_num - kept, sector_id + kept) == 0) {
+        result = splice_blocks(inode, at.index, at.index, sector_id, fill, new_num);
+    } else {
+        new_num = kept;
+    }
+    if (result == 0) {
+        write_data_blocks(sector_id, new_num, buffer);
+        inode->file_size += length;
+        update_inode(inode);
+    } else {
+        for (int i = kept; i < new_num; i++) {
+            mark_block_free(sector_id[i]);
+        }
+    }
+    free(buffer);
+    free(sector_id);
+    free(fill);
+    // *too many extents or no room for the blocks: pack the file into full blocks and try once more
+    if (result == -1) {
+        if (inode->gap_bytes == 0 || repack_file(inode) == -1) {
+            return -1;
+        }
+        return insert_file(inode, pos, length, content);
+    }
+    return 0;
+}
+// --------------------------------------------------------------------------------------------
+// Delete length bytes of a file from pos
+// the kept bytes of the blocks at both ends of the range are joined in the first of them,
+// or in both when they do not fit in one; the blocks between are freed
+// --------------------------------------------------------------------------------------------
+int delete_file_range(struct Inode *inode, int pos, int length) {
+    // if it is a directory, return -1
+    if (inode->file_type == 1 || pos < 0 || length < 0) {
+        return -1;
+    }
+    if (pos >= inode->file_size || length == 0) {
+        return 0;
+    }
+    if (has_inline_data(inode)) {
+        char *data = (char *)inode->extent;
+        int end = length < inode->file_size - pos ? pos + length : inode->file_size;
+        memmove(data + pos, data + end, inode->file_size - end);
+        inode->file_size -= end - pos;
+        update_inode(inode);
+        return 0;
+    }
+    // *a range up to the end truncates the file
+    if (pos + length >= inode->file_size) {
+        int keep = 0;
+        if (pos > 0) {
+            struct File_piece last;
+            map_file_range(inode, pos - 1, 1, &last);
+            keep = last.index + 1;
+        }
+        truncate_blocks(inode, keep);
+        inode->file_size = pos;
+        update_inode(inode);
+        return 0;
+    }
+    struct File_piece first, last;
+    map_file_range(inode, pos, 1, &first);
+    map_file_range(inode, pos + length, 1, &last);
+    int used = last.index == inode->block_num - 1 ? inode->file_size - (pos + length - last.from) : last.fill;
+    int total = first.from + used - last.from;
+    char buffer[512];
+    char block[256];
+    memset(buffer, 0, first.from);
+    if (first.from > 0 && first.sector_id != EXTENT_HOLE) {
+        read_block(first.sector_id, buffer);
+    }
+    memset(block, 0, 256);
+    if (last.sector_id != EXTENT_HOLE) {
+        read_block(last.sector_id, block);
+    }
+    memcpy(buffer + first.from, block + last.from, used - last.from);
+    // *the kept blocks: the first one, and the last one when the bytes do not fit in one
+    int sector_id[2] = {first.sector_id, last.sector_id};
+    int fill[2] = {total < 256 ? total : 256, total - 256};
+    int count = total == 0 ? 0 : total <= 256 ? 1 : 2;
+    // *the blocks that leave the file, found before the extents change
+    int *freed = malloc((last.index - first.index + 2) * sizeof(int));
+    if (freed == NULL) {
+        return -1;
+    }
+    int freed_num = get_sector_ids(inode, first.index + 1, last.index - first.index - 1, freed);
+    if (count < 1) {
+        freed[freed_num++] = first.sector_id;
+    }
+    if (count < 2 && last.index != first.index) {
+        freed[freed_num++] = last.sector_id;
+    }
+    // *a kept block of a hole gets a sector
+    int new_id[2];
+    int new_num = 0;
+    for (int i = 0; i < count; i++) {
+        if (sector_id[i] == EXTENT_HOLE) {
+            if (allocate_loose_blocks(inode->sector_id + 1, 1, &new_id[new_num]) == -1) {
+                for (int j = 0; j < new_num; j++) {
+                    mark_block_free(new_id[j]);
+                }
+                free(freed);
+                return -1;
+            }
+            sector_id[i] = new_id[new_num++];
+        }
+    }
+    if (splice_blocks(inode, first.index, last.index, sector_id, fill, count) == -1) {
+        free(freed);
+        for (int j = 0; j < new_num; j++) {
+            mark_block_free(new_id[j]);
+        }
+        if (inode->gap_bytes == 0 || repack_file(inode) == -1) {
+            return -1;
+        }
+        return delete_file_range(inode, pos, length);
+    }
+    write_data_blocks(sector_id, count, buffer);
+    lock_bitmap();
+    for (int i = 0; i < freed_num; i++) {
+        if (freed[i] != EXTENT_HOLE) {
+            mark_block_free(freed[i]);
+        }
+    }
+    unlock_bitmap();
+    free(freed);
+    inode->file_size -= length;
+    update_inode(inode);
+    return 0;
+}
+// --------------------------------------------------------------------------------------------
+// Set the size of a file
+// a smaller size frees the blocks past it in one pass, a larger one fills the gap with zeros
+// --------------------------------------------------------------------------------------------
+int truncate_file(struct Inode *inode, int size) {
+    // if it is a directory, return -1
+    if (inode->file_type == 1 || size < 0) {
+        return -1;
+    }
+    if (size < inode->file_size) {
+        return delete_file_range(inode, size, inode->file_size - size);
+    }
+    if (size > inode->file_size) {
+        char zero = 0;
+        return pwrite_file(inode, size - 1, 1, &zero);
+    }
+    return 0;
+}
+// --------------------------------------------------------------------------------------------
+// Find the first byte from pos that holds data, or with hole set, that lies in a hole
+// the end of the file counts as a hole
+// return its position, -1 if there is none
+// --------------------------------------------------------------------------------------------
+int seek_file(struct Inode *inode, int pos, int hole) {
+    if (inode->file_type == 1 || pos < 0 || pos >= inode->file_size) {
+        return -1;
+    }
+    // *a file in its inode has no hole
+    if (has_inline_data(inode)) {
+        return hole ? inode->file_size : pos;
+    }
+    struct Bmap_iterator it;
+    int index, start, run;
+    int block_pos = 0;
+    bmap_begin(&it, inode, 0, inode->block_num);
+    while (block_pos < inode->file_size && bmap_next(&it, &index, &start, &run)) {
+        int partial = index + run == it.extent.logical + it.extent.length && it.extent.tail != 0;
+        int run_bytes = run * 256 - (partial ? 256 - it.extent.tail : 0);
+        if (block_pos + run_bytes > pos && (start == EXTENT_HOLE) == hole) {
+            return block_pos > pos ? block_pos : pos;
+        }
+        block_pos += run_bytes;
+    }
+    return hole ? inode->file_size : -1;
+}
+// --------------------------------------------------------------------------------------------
 // Remove a file
 // inode: the inode of the parent directory
 // --------------------------------------------------------------------------------------------
@@ -131,9 +1037,8 @@ int remove_file(struct Inode *inode, char *name) {
     clear_file(&file_inode);
     // remove the file name from the directory
     remove_name(inode, name);
-    // free the block
-    block_bitmap[inode_id] = '0';
-    store_bitmap();
+    // free the inode
+    free_inode(inode_id);
     return 0;
 }
 // --------------------------------------------------------------------------------------------
@@ -153,11 +1058,15 @@ int remove_directory(struct Inode *inode, char *name) {
     // clear the content of the directory
     struct Inode directory_inode;
     get_inode(inode_id, &directory_inode);
-    int block_num = directory_inode.block_num;
-    for (int i = 0; i < block_num; i++) {
+    // removing a name moves the last name to its place, so always take the first one
+    while (directory_inode.block_num > 0) {
+        // *a large directory does not fit in one transaction
+        if (make_command_room(COMMAND_META_NUM) == -1) {
+            return -1;
+        }
         // get the sub name
         int id;
-        get_sector_id(&directory_inode, i, &id);
+        get_sector_id(&directory_inode, 0, &id);
         struct Naming_block naming_block;
         read_block(id, (char *)&naming_block);
         // get the sub inode
@@ -165,19 +1074,25 @@ int remove_directory(struct Inode *inode, char *name) {
         struct Inode sub_inode;
         get_inode(sub_inode_id, &sub_inode);
         // if it is a file, remove the file
+        int flag;
         if (sub_inode.file_type == 0) {
-            remove_file(&directory_inode, naming_block.name);
+            flag = remove_file(&directory_inode, naming_block.name);
         }
         // if it is a directory, remove the directory
         else {
-            remove_directory(&directory_inode, naming_block.name);
+            flag = remove_directory(&directory_inode, naming_block.name);
+        }
+        if (flag == -1) {
+            return -1;
         }
     }
+    if (make_command_room(COMMAND_META_NUM) == -1) {
+        return -1;
+    }
     // remove the directory name from the directory
     remove_name(inode, name);
-    // free the block
-    block_bitmap[inode_id] = '0';
-    store_bitmap();
+    // free the inode
+    free_inode(inode_id);
     return 0;
 }
 // --------------------------------------------------------------------------------------------
@@ -190,7 +1105,7 @@ int change_to_parentdir(struct Inode *inode) {
     if (inode->pre_inode_sector_id == -1) {
         return -1;
     }
-    write_inode_to_disk(inode);
+    update_inode(inode);
     get_inode(inode->pre_inode_sector_id, inode);
     return 0;
 }
@@ -210,7 +1125,7 @@ int change_to_subdir(struct Inode *inode, char *name) {
     if (sub_inode.file_type == 0) {
         return -1;
     }
-    write_inode_to_disk(inode);
+    update_inode(inode);
     get_inode(inode_id, inode);
     return 0;
 }
@@ -261,16 +1176,79 @@ int w_f(struct Inode *parent_directory, char *name, int length, char *content) {
     return write_file(&inode, length, content);
 }
 // -------------------------------------------------------------------------------------------
+// pw_f
+// -------------------------------------------------------------------------------------------
+int pw_f(struct Inode *parent_directory, char *name, int pos, int length, char *content) {
+    int inode_id;
+    if (find_name_id(parent_directory, name, &inode_id) == -1) {
+        return -1;
+    }
+    struct Inode inode;
+    get_inode(inode_id, &inode);
+    return pwrite_file(&inode, pos, length, content);
+}
+// -------------------------------------------------------------------------------------------
+// a_f
+// -------------------------------------------------------------------------------------------
+int a_f(struct Inode *parent_directory, char *name, int length, char *content) {
+    int inode_id;
+    if (find_name_id(parent_directory, name, &inode_id) == -1) {
+        return -1;
+    }
+    struct Inode inode;
+    get_inode(inode_id, &inode);
+    return append_file(&inode, length, content);
+}
+// -------------------------------------------------------------------------------------------
+// aa_f
+// -------------------------------------------------------------------------------------------
+int aa_f(struct Inode *parent_directory, char *name, int length, char *content, int *pos, int exclusive) {
+    int inode_id;
+    if (find_name_id(parent_directory, name, &inode_id) == -1) {
+        return -1;
+    }
+    return append_file_atomic(inode_id, length, content, pos, exclusive);
+}
+// -------------------------------------------------------------------------------------------
+// tr_f
+// -------------------------------------------------------------------------------------------
+int tr_f(struct Inode *parent_directory, char *name, int size) {
+    int inode_id;
+    if (find_name_id(parent_directory, name, &inode_id) == -1) {
+        return -1;
+    }
+    struct Inode inode;
+    get_inode(inode_id, &inode);
+    return truncate_file(&inode, size);
+}
+// -------------------------------------------------------------------------------------------
+// seek_f
+// -------------------------------------------------------------------------------------------
+int seek_f(struct Inode *parent_directory, char *name, int pos, int hole) {
+    int inode_id;
+    if (find_name_id(parent_directory, name, &inode_id) == -1) {
+        return -1;
+    }
+    struct Inode inode;
+    get_inode(inode_id, &inode);
+    return seek_file(&inode, pos, hole);
+}
+// -------------------------------------------------------------------------------------------
 // cat_f
 // -------------------------------------------------------------------------------------------
-int cat_f(struct Inode *parent_directory, char *name, char *content) {
+int cat_f(struct Inode *parent_directory, char *name, char *content, int size) {
     int inode_id;
     if (find_name_id(parent_directory, name, &inode_id) == -1) {
         return -1;
     }
     struct Inode inode;
     get_inode(inode_id, &inode);
-    int length = read_whole_file(&inode, content);
+    // *at most size - 1 bytes, the client gets larger files from stream_file
+    int length = inode.file_size < size - 1 ? inode.file_size : size - 1;
+    length = read_file_range(&inode, 0, length, content);
+    if (length == -1) {
+        return -1;
+    }
     content[length] = '\0';
     return length;
 }
@@ -280,12 +1258,13 @@ int cat_f(struct Inode *parent_directory, char *name, char *content) {
 int parse_cd(char *path, char token[256][256], int *token_num) {
     *token_num = 0;
     char tmp_path[256];
+    char *save = NULL;
     strcpy(tmp_path, path);
-    char *p = strtok(tmp_path, "/");
+    char *p = strtok_r(tmp_path, "/", &save);
     while (p != NULL) {
         strcpy(token[*token_num], p);
         (*token_num)++;
-        p = strtok(NULL, "/");
+        p = strtok_r(NULL, "/", &save);
     }
     return 0;
 }
@@ -293,7 +1272,7 @@ int cd(struct Inode *inode, char *path) {
     char token[256][256];
     int token_num = 0;
     parse_cd(path, token, &token_num);
-    write_inode_to_disk(inode);
+    update_inode(inode);
     // trace the path
     struct Inode tmp_inode = *inode;
     for (int i = 0; i < token_num; i++) {
@@ -328,19 +1307,7 @@ int i_f(struct Inode *parent_directory, char *name, int pos, int length, char *c
     if (pos > inode.file_size) {
         pos = inode.file_size;
     }
-    // copy the data from the file to buffer
-    int new_length = inode.file_size + length;
-    char buffer[new_length + 256];
-    read_whole_file(&inode, buffer);
-    // insert the length of data to the position
-    for (int i = new_length - 1; i >= pos + length; i--) {
-        buffer[i] = buffer[i - length];
-    }
-    for (int i = 0; i < length; i++) {
-        buffer[pos + i] = content[i];
-    }
-    // write the data to the file
-    return write_file(&inode, new_length, buffer);
+    return insert_file(&inode, pos, length, content);
 }
 // --------------------------------------------------------------------------------------------
 // d_f
@@ -353,21 +1320,10 @@ int d_f(struct Inode *parent_directory, char *name, int pos, int length) {
     struct Inode inode;
     get_inode(inode_id, &inode);
     // the length if larger than the file size
-    if (length > inode.file_size) {
+    if (pos < inode.file_size && length > inode.file_size - pos) {
         length = inode.file_size - pos;
     }
-    // copy the data from the file to buffer
-    int pre_length = inode.file_size;
-    int new_length = inode.file_size - length;
-    char buffer[pre_length + 256];
-    read_whole_file(&inode, buffer);
-    // delete the length of data from the position
-    for (int i = pos; i < new_length; i++) {
-        buffer[i] = buffer[i + length];
-    }
-    // write the data to the file
-    write_file(&inode, new_length, buffer);
-    return 0;
+    return delete_file_range(&inode, pos, length);
 }
 
 // --------------------------------------------------------------------------------------------
@@ -409,9 +1365,15 @@ int create_user(struct Inode *root, char *name, char *password) {
     char user_info_name[256];
 
     sprintf(user_info_name, "%s_%s", name, "user_info");
+    if (make_command_room(COMMAND_META_NUM) == -1) {
+        return -1;
+    }
     mk_f(root, user_info_name);
 
     // write the password to the user file
+    if (make_command_room(COMMAND_META_NUM) == -1) {
+        return -1;
+    }
     w_f(root, user_info_name, strlen(password), password);
 
     return 0;
@@ -440,11 +1402,250 @@ int change_user(struct Inode *root, struct Inode *user_inode, char *name, char *
     }
     // read the password from the user file
     char buffer[4096];
-    cat_f(root, user_info_name, buffer);
+    cat_f(root, user_info_name, buffer, sizeof(buffer));
     // check the password
     if (strcmp(buffer, password) != 0) {
         return -1;
     }
     return 0;
 }
+// *--------------------------------------------------------------------------------------------
+// * Log cleaner
+// *--------------------------------------------------------------------------------------------
+// in the log-structured layout the cleaner turns a segment with few used blocks into a clean
+// one: the used blocks of the segment, file blocks, extent tree blocks and inodes, are written
+// again at the head of the log and their owners point at the new copies
+// it runs as commands holding the namespace exclusive, so nothing else changes meanwhile;
+// one command moves about CLEANER_BATCH_BLOCKS blocks, and commits what it has moved when
+// the journal is short of room for the next inode
+// --------------------------------------------------------------------------------------------
+#ifndef CLEANER_MARGIN
+#define CLEANER_MARGIN 8  // free blocks kept for the extent trees of the moved files
+#endif
+#ifndef CLEANER_BATCH_BLOCKS
+#define CLEANER_BATCH_BLOCKS 16
+#endif
+#ifndef CLEANER_MIN_GAIN
+#define CLEANER_MIN_GAIN 8  // free blocks a segment must have to be worth cleaning
+#endif
+// --------------------------------------------------------------------------------------------
+// whether an extent tree block of the inode lies in the segment
+// --------------------------------------------------------------------------------------------
+int extent_tree_in_segment(struct Inode *inode, int segment) {
+    if (inode->extent_tree == -1) {
+        return 0;
+    }
+    if (inode->extent_tree / SEGMENT_BLOCKS == segment) {
+        return 1;
+    }
+    struct Extent_index index[EXTENT_INDEX_NUM];
+    read_block(inode->extent_tree, (char *)index);
+    for (int i = 0; i < EXTENT_INDEX_NUM; i++) {
+        if (index[i].sector_id != -1 && index[i].sector_id / SEGMENT_BLOCKS == segment) {
+            return 1;
+        }
+    }
+    return 0;
+}
+// --------------------------------------------------------------------------------------------
+// Move the blocks of the inode that lie in the segment to the head of the log
+// the extents are built again around the new blocks, which also moves the extent tree;
+// the entries of a directory find their names in the moved naming blocks
+// return the number of moved blocks, -1 if the disk is full
+// --------------------------------------------------------------------------------------------
+int relocate_inode_blocks(struct Inode *inode, int segment) {
+    int block_num = inode->block_num;
+    int *sector_id = malloc((block_num + 1) * sizeof(int));
+    int *fill = malloc((block_num + 1) * sizeof(int));
+    int *moved = malloc((block_num + 1) * sizeof(int));
+    if (sector_id == NULL || fill == NULL || moved == NULL) {
+        free(sector_id);
+        free(fill);
+        free(moved);
+        return -1;
+    }
+    get_block_fills(inode, 0, block_num, sector_id, fill);
+    int moved_num = 0;
+    for (int i = 0; i < block_num; i++) {
+        if (sector_id[i] != EXTENT_HOLE && sector_id[i] / SEGMENT_BLOCKS == segment) {
+            moved[moved_num++] = i;
+        }
+    }
+    // *only the moved blocks are held, a sparse file may have many more
+    char *content = malloc((long)moved_num * 256 + 256);
+    if (content == NULL || (moved_num == 0 && !extent_tree_in_segment(inode, segment))) {
+        free(sector_id);
+        free(fill);
+        free(moved);
+        free(content);
+        return content == NULL ? -1 : 0;
+    }
+    // *the old and the new extent tree, the inode, and for a directory each moved naming
+    //  block with the inode pointing at it
+    int after = inode->extent_num + moved_num < MAX_EXTENT_NUM ? inode->extent_num + moved_num : MAX_EXTENT_NUM;
+    int meta_num = extent_tree_block_num(inode->extent_num) + extent_tree_block_num(after) + 1;
+    if (make_command_room(meta_num + (inode->file_type == 0 ? 0 : 2 * moved_num)) == -1) {
+        fprintf(stderr, "Error: the journal has no room for inode %d\n", inode->sector_id);
+        free(sector_id);
+        free(fill);
+        free(moved);
+        free(content);
+        return -1;
+    }
+    // *read the moved blocks, then give each of them a block at the head of the log
+    for (int i = 0; i < moved_num; i++) {
+        read_block(sector_id[moved[i]], content + i * 256);
+    }
+    int old_id[moved_num + 1];
+    for (int i = 0; i < moved_num; i++) {
+        old_id[i] = sector_id[moved[i]];
+    }
+    lock_bitmap();
+    int allocated = 0;
+    while (allocated < moved_num) {
+        int length;
+        int start = search_log_run(moved_num - allocated, &length);
+        if (start == -1) {
+            break;
+        }
+        for (int j = 0; j < length; j++) {
+            mark_block_used(start + j);
+            sector_id[moved[allocated++]] = start + j;
+        }
+    }
+    // *build the extents again from the new block map, partial blocks keep their bytes;
+    //  only then do the old blocks go, so a failure leaves the file as it was
+    if (allocated < moved_num || splice_blocks(inode, 0, block_num - 1, sector_id, fill, block_num) == -1) {
+        for (int i = 0; i < allocated; i++) {
+            mark_block_free(sector_id[moved[i]]);
+        }
+        unlock_bitmap();
+        fprintf(stderr, "Error: the cleaner has no room for inode %d\n", inode->sector_id);
+        free(sector_id);
+        free(fill);
+        free(moved);
+        free(content);
+        return -1;
+    }
+    for (int i = 0; i < moved_num; i++) {
+        mark_block_free(old_id[i]);
+    }
+    unlock_bitmap();
+    // *write the moved blocks to their new sectors
+    for (int i = 0; i < moved_num; i++) {
+        int id = sector_id[moved[i]];
+        if (inode->file_type == 0) {
+            write_data_blocks(&id, 1, content + i * 256);
+            continue;
+        }
+        write_block(id, content + i * 256);
+        struct Naming_block *naming_block = (struct Naming_block *)(content + i * 256);
+        struct Inode sub_inode;
+        if (get_inode(naming_block->inode_sector_id, &sub_inode) == 0) {
+            sub_inode.name_inode = id;
+            update_inode(&sub_inode);
+        }
+    }
+    free(sector_id);
+    free(fill);
+    free(moved);
+    free(content);
+    return moved_num;
+}
+// --------------------------------------------------------------------------------------------
+// Move the blocks in the segment of every inode under inode_id, until budget blocks are moved
+// return -1 if an inode could not be moved, the cleaner then stops
+// --------------------------------------------------------------------------------------------
+int clean_tree(int inode_id, int segment, int *budget) {
+    struct Inode inode;
+    if (*budget <= 0 || get_inode(inode_id, &inode) == -1) {
+        return 0;
+    }
+    int moved_num = relocate_inode_blocks(&inode, segment);
+    if (moved_num == -1) {
+        return -1;
+    }
+    *budget -= moved_num;
+    // *a dirty inode moves to the head of the log when it is written back
+    if (get_inode_location(inode_id) / SEGMENT_BLOCKS == segment) {
+        if (make_command_room(1) == -1) {
+            return -1;
+        }
+        update_inode(&inode);
+        *budget -= 1;
+    }
+    if (inode.file_type == 0) {
+        return 0;
+    }
+    struct Naming_block naming_block[DIRECTORY_BATCH_NUM];
+    int sector_id[DIRECTORY_BATCH_NUM];
+    for (int first = 0; first < inode.block_num && *budget > 0; first += DIRECTORY_BATCH_NUM) {
+        int count = read_naming_blocks(&inode, first, naming_block, sector_id);
+        for (int i = 0; i < count; i++) {
+            if (clean_tree(naming_block[i].inode_sector_id, segment, budget) == -1) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+// --------------------------------------------------------------------------------------------
+// Count the clean segments
+// --------------------------------------------------------------------------------------------
+int clean_segment_num() {
+    int clean_num = 0;
+    lock_bitmap();
+    for (int s = 0; s < SEGMENT_NUM; s++) {
+        clean_num += segment_used(s) == 0;
+    }
+    unlock_bitmap();
+    return clean_num;
+}
+// --------------------------------------------------------------------------------------------
+// Choose the segment to clean: the one with the fewest used blocks, if it has at least
+// CLEANER_MIN_GAIN free blocks and the disk outside it has room for the used ones; never a
+// reserved segment, the one of the log head or skip
+// return -1 if there is none
+// --------------------------------------------------------------------------------------------
+int choose_victim_segment(int skip) {
+    int victim = -1;
+    int victim_used = SEGMENT_BLOCKS;
+    int free_num = 0;
+    lock_bitmap();
+    for (int s = 0; s < SEGMENT_NUM; s++) {
+        int used = segment_used(s);
+        free_num += SEGMENT_BLOCKS - used;
+        if (s * SEGMENT_BLOCKS < RESERVED_SECTOR_NUM || s == BITMAP->log_head / SEGMENT_BLOCKS || s == skip) {
+            continue;
+        }
+        if (used > 0 && used <= SEGMENT_BLOCKS - CLEANER_MIN_GAIN && used < victim_used) {
+            victim = s;
+            victim_used = used;
+        }
+    }
+    unlock_bitmap();
+    if (victim != -1 && free_num - (SEGMENT_BLOCKS - victim_used) < victim_used + CLEANER_MARGIN) {
+        return -1;
+    }
+    return victim;
+}
+// --------------------------------------------------------------------------------------------
+// Set the segment the log must not use while it is cleaned, -1 when the cleaner is done
+// --------------------------------------------------------------------------------------------
+void set_log_victim(int segment) {
+    lock_bitmap();
+    if (segment == -1 && BITMAP->log_victim != -1 && segment_used(BITMAP->log_victim) == 0) {
+        BITMAP->cleaned_num++;
+    }
+    BITMAP->log_victim = segment;
+    unlock_bitmap();
+}
+// --------------------------------------------------------------------------------------------
+// Print the log statistics
+// --------------------------------------------------------------------------------------------
+void print_log_stats(FILE *fp) {
+    if (LOG_STRUCTURED) {
+        fprintf(fp, "Log: %d clean segments of %d, %ld cleaned\n", clean_segment_num(), SEGMENT_NUM, BITMAP->cleaned_num);
+    }
+}
 #endif
\ No newline at end of file
@@ -4,14 +4,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <semaphore.h>
-#include "disk_client.h"
-// block bitmap: '1' means the block is used, '0' means the block is free
-// global variable
-#define BLOCK_NUM 1024
-char block_bitmap[BLOCK_NUM];
-static int SOCKET_FD;
-sem_t block_semaphore[BLOCK_NUM];
+#include <pthread.h>
+#include <sys/mman.h>
+#include "block_device.h"
+#include "block_cache.h"
+#include "bitmap.h"
+// ---------------------------------
+// Extent
+// ---------------------------------
+// logical block logical .. logical + length - 1 of the file lives in
+// sector start .. start + length - 1
+// every block holds 256 bytes of the file, except the last block of an extent with a tail,
+// which holds tail bytes: insert and delete leave such partial blocks inside a file, and the
+// last extent of a file always has tail 0, its last block ends where file_size says
+// a hole is an extent with start EXTENT_HOLE: its blocks have no sectors, are always full
+// and read as zeros; a write into a hole gives its blocks sectors
+// ---------------------------------
+#define EXTENT_HOLE -1
+struct Extent {
+    int logical;  // first block index in the file
+    int start;    // first sector id
+    int length;   // number of blocks
+    int tail;     // bytes in the last block, 0 when it is full
+};
 // ---------------------------------
 // Inode
 // size: 256 bytes
@@ -19,87 +34,229 @@ sem_t block_semaphore[BLOCK_NUM];
 // file size(4 byte): 4 bytes
 // sector id: 4 bytes
 // pre_inode sector id: 4 bytes
-// directory_num: 4 bytes(if file type is directory)
 // file type: 4 bytes
-// direct block: 40 * 4 bytes
-// indirect block: 10 * 4 bytes
-// double indirect block: 9 * 4 bytes
+// block num: 4 bytes
+// name inode: 4 bytes
+// extent num: 4 bytes
+// extent tree: 4 bytes
+// gap bytes: 4 bytes
+// inline extent: 13 * 16 bytes, or the content of a small file
+// reserved: 3 * 4 bytes
 // ---------------------------------
+// a file without blocks keeps its content, up to INLINE_DATA_SIZE bytes, in the inline
+// extent area; it takes its first block when it grows past that, so a small file costs
+// only its inode sector
+// ---------------------------------
+// the first INLINE_EXTENT_NUM extents are stored in the inode; the rest live in the
+// extent tree: extent_tree is an index block of EXTENT_INDEX_NUM (first logical block,
+// leaf sector id) pairs, and every leaf block holds LEAF_EXTENT_NUM extents
+// extents are kept in logical order and every one but the last leaf is full; a change in
+// the middle of a file removes the extents after it and appends them again
+// gap_bytes counts the bytes the partial blocks miss, so a file without them maps byte pos
+// to block pos / 256 directly
+// ---------------------------------
+#define INLINE_EXTENT_NUM 13
+#define LEAF_EXTENT_NUM 15
+#define EXTENT_INDEX_NUM 32
+#define MAX_EXTENT_NUM (INLINE_EXTENT_NUM + EXTENT_INDEX_NUM * LEAF_EXTENT_NUM)
+#define INLINE_DATA_SIZE (INLINE_EXTENT_NUM * 16)
 struct Inode {
     // ---------------------------------
     // data
     // ---------------------------------
-    int file_size;                 // the stored file size
-    int sector_id;                 // self sector id
-    int pre_inode_sector_id;       // pre inode sector id
-    int file_type;                 // file type
-    int block_num;                 // directory num
-    int name_inode;                // name inode
-    int direct_block[40];          // direct block
-    int indirect_block[10];        // indirect block
-    int double_indirect_block[8];  // double indirect block
+    int file_size;                               // the stored file size
+    int sector_id;                               // self sector id
+    int pre_inode_sector_id;                     // pre inode sector id
+    int file_type;                               // file type
+    int block_num;                               // directory num
+    int name_inode;                              // name inode
+    int extent_num;                              // number of extents
+    int extent_tree;                             // extent index block, -1 if there is none
+    int gap_bytes;                               // bytes missing from the partial blocks
+    struct Extent extent[INLINE_EXTENT_NUM];     // inline extents, or inline data
+    int reserved[3];                             // reserved
+};
+struct Extent_index {
+    int first_logical;  // first block index of the leaf
+    int sector_id;      // leaf sector id, -1 if it is not used
+};
+struct Extent_leaf {
+    struct Extent extent[LEAF_EXTENT_NUM];
+    int reserved[4];
+};
+// ---------------------------------
+// Block map cache
+// ---------------------------------
+// the last extent each inode resolved, so the following blocks of the same extent are
+// mapped without touching the extent tree; one entry per inode, direct mapped by the
+// inode sector id, and forgotten whenever the extents of the inode change
+// ---------------------------------
+#ifndef BMAP_CACHE_SIZE
+#define BMAP_CACHE_SIZE 64
+#endif
+struct Bmap_entry {
+    int inode_sector_id;   // -1 when the entry is empty
+    int k;                 // position of the extent in the inode
+    struct Extent extent;  // the extent
+};
+struct Bmap_cache_state {
+    pthread_mutex_t lock;
+    struct Bmap_entry entry[BMAP_CACHE_SIZE];
+    // statistics
+    long hit_num;
+    long miss_num;
 };
+struct Bmap_cache_state* BMAP_CACHE = NULL;
+// ---------------------------------
+// empty the block map cache
+// ---------------------------------
+void reset_bmap_cache() {
+    for (int i = 0; i < BMAP_CACHE_SIZE; i++) {
+        BMAP_CACHE->entry[i].inode_sector_id = -1;
+    }
+}
+// ---------------------------------
+// forget the cached extent of the inode
+// ---------------------------------
+void invalidate_bmap(int inode_sector_id) {
+    struct Bmap_entry* entry = &BMAP_CACHE->entry[inode_sector_id % BMAP_CACHE_SIZE];
+    pthread_mutex_lock(&BMAP_CACHE->lock);
+    if (entry->inode_sector_id == inode_sector_id) {
+        entry->inode_sector_id = -1;
+    }
+    pthread_mutex_unlock(&BMAP_CACHE->lock);
+}
 // ---------------------------------
 // write block data
+// write_block and write_blocks write metadata, which goes through the journal;
+// write_data_blocks writes file data
 // ---------------------------------
 int write_block(int sector_id, char* data) {
-    // *semaphore wait
-    sem_wait(&block_semaphore[sector_id]);
+    if (sector_id < 0 || sector_id >= BLOCK_NUM) {
+        fprintf(stderr, "Error: invalid sector id %d\n", sector_id);
+        return -1;
+    }
     // *write data to the sector id
-    char buffer[512];
-    // *code type:
-    // 0: W
-    // 2-255: sector_id
-    // 256-511: data
-    for (int i = 0; i < 256; i++) {
-        buffer[i] = ' ';
-    }
-    buffer[0] = 'W';
-    sprintf(buffer + 2, "%d", sector_id);
-    memcpy(buffer + 256, data, 256);
-    // ?debug
-    // for (int i = 0; i < 512; i++) {
-    // printf("%d", (int)buffer[i]);
-    // }
-    // printf("\n");
-
-    write_disk_client(SOCKET_FD, buffer);
-    // *semaphore signal
-    sem_post(&block_semaphore[sector_id]);
+    cache_write_block(sector_id, data, 1);
     return 0;
 }
 // ---------------------------------
 // read block data
 // ---------------------------------
 void read_block(int sector_id, char* data) {
-    // *semaphore wait
-    sem_wait(&block_semaphore[sector_id]);
+    if (sector_id < 0 || sector_id >= BLOCK_NUM) {
+        fprintf(stderr, "Error: invalid sector id %d\n", sector_id);
+        memset(data, 0, 256);
+        return;
+    }
     // *read data from the sector id
-    char buffer[512];
-    // *code type
-    // 0: R
-    // 2-255: sector_id
-    // else: space
-    for (int i = 0; i < 256; i++) {
-        buffer[i] = ' ';
-    }
-    buffer[0] = 'R';
-    sprintf(buffer + 2, "%d", sector_id);
-    write_disk_client(SOCKET_FD, buffer);
-    read_disk_client(SOCKET_FD, data);
-    // *semaphore signal
-    sem_post(&block_semaphore[sector_id]);
+    cache_read_block(sector_id, data);
+}
+// ---------------------------------
+// check a list of sector ids
+// ---------------------------------
+int blocks_valid(int* sector_id, int count) {
+    for (int i = 0; i < count; i++) {
+        if (sector_id[i] < 0 || sector_id[i] >= BLOCK_NUM) {
+            fprintf(stderr, "Error: invalid sector id %d\n", sector_id[i]);
+            return 0;
+        }
+    }
+    return 1;
+}
+// ---------------------------------
+// write the data of count sectors, sector i from data + i * 256
+// ---------------------------------
+int write_blocks(int* sector_id, int count, char* data) {
+    if (count <= 0) {
+        return 0;
+    }
+    if (!blocks_valid(sector_id, count)) {
+        return -1;
+    }
+    cache_write_blocks(sector_id, count, data, 1);
+    return 0;
+}
+// ---------------------------------
+// write the file data of count sectors, sector i from data + i * 256
+// ---------------------------------
+int write_data_blocks(int* sector_id, int count, char* data) {
+    if (count <= 0) {
+        return 0;
+    }
+    if (!blocks_valid(sector_id, count)) {
+        return -1;
+    }
+    cache_write_blocks(sector_id, count, data, 0);
+    return 0;
+}
+// ---------------------------------
+// read the data of count sectors, sector i into data + i * 256
+// the sectors missing from the cache are fetched in one batch
+// ---------------------------------
+int read_blocks(int* sector_id, int count, char* data) {
+    if (count <= 0) {
+        return 0;
+    }
+    if (!blocks_valid(sector_id, count)) {
+        memset(data, 0, count * 256);
+        return -1;
+    }
+    return cache_read_blocks(sector_id, count, data);
+}
+// ---------------------------------
+// read the blocks of a file like read_blocks, a hole reads as zeros without a request
+// ---------------------------------
+int read_file_blocks(int* sector_id, int count, char* data) {
+    int hole_num = 0;
+    for (int i = 0; i < count; i++) {
+        hole_num += sector_id[i] == EXTENT_HOLE;
+    }
+    if (hole_num == 0) {
+        return read_blocks(sector_id, count, data);
+    }
+    // *read the backed blocks in one batch, then put them in place
+    int backed_id[count - hole_num + 1];
+    int backed_num = 0;
+    for (int i = 0; i < count; i++) {
+        if (sector_id[i] != EXTENT_HOLE) {
+            backed_id[backed_num++] = sector_id[i];
+        }
+    }
+    int result = read_blocks(backed_id, backed_num, data + hole_num * 256);
+    int next = hole_num;
+    for (int i = 0; i < count; i++) {
+        if (sector_id[i] == EXTENT_HOLE) {
+            memset(data + i * 256, 0, 256);
+        } else {
+            memmove(data + i * 256, data + next++ * 256, 256);
+        }
+    }
+    return result;
 }
 // ---------------------------------
 // store the bitmap into the disk
 // ---------------------------------
 int store_bitmap() {
-    // write the bitmap to the disk
-    for (int i = 0; i < BLOCK_NUM; i += 256) {
-        char buffer[256];
-        memcpy(buffer, block_bitmap + i, 256);
-        write_block(i / 256, buffer);
+    // write the dirty bitmap sectors to the disk
+    int sector_id[BITMAP_SECTOR_NUM];
+    char data[BITMAP_SECTOR_NUM * 256];
+    int dirty_num = 0;
+    lock_bitmap();
+    for (int i = 0; i < BITMAP_SECTOR_NUM; i++) {
+        if (BITMAP->bitmap_dirty_sector[i >> 6] & (1ULL << (i & 63))) {
+            sector_id[dirty_num] = i;
+            // the blocks freed in the running group are free on the disk
+            for (int k = 0; k < 32; k++) {
+                uint64_t word = BITMAP->block_bitmap[i * 32 + k] & ~BITMAP->pending_free[i * 32 + k];
+                memcpy(data + dirty_num * 256 + k * 8, &word, 8);
+            }
+            dirty_num++;
+        }
     }
+    write_blocks(sector_id, dirty_num, data);
+    memset(BITMAP->bitmap_dirty_sector, 0, sizeof(BITMAP->bitmap_dirty_sector));
+    unlock_bitmap();
     return 0;
 }
 // ---------------------------------
@@ -107,131 +264,1038 @@ int store_bitmap() {
 // ---------------------------------
 int load_bitmap() {
     // read the bitmap from the disk
-    for (int i = 0; i < BLOCK_NUM; i += 256) {
-        char buffer[256];
-        read_block(i / 256, buffer);
-        memcpy(block_bitmap + i, buffer, 256);
+    int sector_id[BITMAP_SECTOR_NUM];
+    for (int i = 0; i < BITMAP_SECTOR_NUM; i++) {
+        sector_id[i] = i;
     }
+    lock_bitmap();
+    read_blocks(sector_id, BITMAP_SECTOR_NUM, (char*)BITMAP->block_bitmap);
+    rebuild_bitmap_summary();
+    memset(BITMAP->bitmap_dirty_sector, 0, sizeof(BITMAP->bitmap_dirty_sector));
+    unlock_bitmap();
     return 0;
 }
 
+
 // ---------------------------------
-// find free block
+// find the block of a new inode, FFS style:
+// a directory starts in the least used cylinder group, so directories spread over the disk,
+// and a file stays in the cylinder group of its directory, right after it when possible;
+// the data of both then grows after the inode
 // ---------------------------------
-int find_free_block() {
-    load_bitmap();  // read only
-    for (int i = 0; i < BLOCK_NUM; i++) {
-        if (block_bitmap[i] == '0') {
-            return i;
+int find_inode_block(int pre_inode_sector_id, int file_type) {
+    if (file_type == 1 || pre_inode_sector_id < 0) {
+        return search_free_block_near(least_used_cylinder_group() * CYLINDER_GROUP_BLOCKS);
+    }
+    return search_free_block_near(pre_inode_sector_id);
+}
+// ---------------------------------
+// find a free block near goal without marking it, at the head of the log in the
+// log-structured layout
+// ---------------------------------
+int search_new_block(int goal) {
+    if (LOG_STRUCTURED) {
+        int length;
+        return search_log_run(1, &length);
+    }
+    return search_free_block_near(goal);
+}
+// ---------------------------------
+// Inode cache
+// ---------------------------------
+// decoded inodes kept in memory, keyed by their sector id
+// lookup: hash chains, eviction: CLOCK over the entries nobody holds
+// refcount: iget takes a reference and iput drops it; a held inode is never evicted,
+//           so the session keeps its root and current directory resident
+// dirty: update_inode only changes the cached copy; flush_inode_cache is the one place
+//        that writes inodes back, at the end of every command or when a dirty
+//        entry is evicted
+// lock: the functions from iget on hold INODE_CACHE->lock, the ones above expect it held
+// ---------------------------------
+// inode map: in the log-structured layout the sector id of an inode is only its number;
+// INODE_CACHE->inode_map holds the sector of its latest version, -1 for a free number and
+// -2 for an inode never written, and every write-back moves the inode to the head of the
+// log; the map is stored after the journal, the dirty sectors at the end of every command
+// ---------------------------------
+#ifndef INODE_CACHE_SIZE
+#define INODE_CACHE_SIZE 128
+#endif
+#define INODE_CACHE_HASH_SIZE (INODE_CACHE_SIZE * 2)
+struct Inode_entry {
+    struct Inode inode;  // inode.sector_id is -1 when the slot is empty
+    int refcount;        // number of iget without iput
+    int dirty;           // the inode differs from its sector
+    int referenced;      // CLOCK reference bit
+    int next;            // next slot in the hash chain
+};
+struct Inode_cache_state {
+    pthread_mutex_t lock;
+    struct Inode_entry entry[INODE_CACHE_SIZE];
+    int hash[INODE_CACHE_HASH_SIZE];
+    int hand;
+    int inode_map[BLOCK_NUM];
+    uint64_t inode_map_dirty[INODE_MAP_SECTOR_NUM / 64 + 1];
+    // statistics
+    long hit_num;
+    long miss_num;
+};
+struct Inode_cache_state* INODE_CACHE = NULL;
+#define INODE_UNWRITTEN -2
+// ---------------------------------
+// empty the inode cache, dirty inodes are lost
+// ---------------------------------
+void reset_inode_cache() {
+    for (int i = 0; i < INODE_CACHE_SIZE; i++) {
+        INODE_CACHE->entry[i].inode.sector_id = -1;
+        INODE_CACHE->entry[i].refcount = 0;
+        INODE_CACHE->entry[i].dirty = 0;
+        INODE_CACHE->entry[i].referenced = 0;
+        INODE_CACHE->entry[i].next = -1;
+    }
+    for (int i = 0; i < INODE_CACHE_HASH_SIZE; i++) {
+        INODE_CACHE->hash[i] = -1;
+    }
+    INODE_CACHE->hand = 0;
+    reset_bmap_cache();
+}
+// ---------------------------------
+// find the slot of the inode, -1 if it is not cached
+// ---------------------------------
+int lookup_inode_cache(int sector_id) {
+    int slot = INODE_CACHE->hash[sector_id % INODE_CACHE_HASH_SIZE];
+    while (slot != -1 && INODE_CACHE->entry[slot].inode.sector_id != sector_id) {
+        slot = INODE_CACHE->entry[slot].next;
+    }
+    return slot;
+}
+// ---------------------------------
+// remove the slot from its hash chain and empty it
+// ---------------------------------
+void unlink_inode_cache(int slot) {
+    int* p = &INODE_CACHE->hash[INODE_CACHE->entry[slot].inode.sector_id % INODE_CACHE_HASH_SIZE];
+    while (*p != slot) {
+        p = &INODE_CACHE->entry[*p].next;
+    }
+    *p = INODE_CACHE->entry[slot].next;
+    INODE_CACHE->entry[slot].inode.sector_id = -1;
+    INODE_CACHE->entry[slot].dirty = 0;
+}
+// ---------------------------------
+// whether the inode number is in use
+// ---------------------------------
+int inode_number_used(int sector_id) {
+    if (sector_id < 0 || sector_id >= BLOCK_NUM) {
+        return 0;
+    }
+    if (LOG_STRUCTURED) {
+        return INODE_CACHE->inode_map[sector_id] != -1;
+    }
+    return block_is_used(sector_id);
+}
+// ---------------------------------
+// the sector holding the inode, -1 if it has none
+// ---------------------------------
+int inode_location(int sector_id) {
+    if (LOG_STRUCTURED) {
+        return INODE_CACHE->inode_map[sector_id] >= 0 ? INODE_CACHE->inode_map[sector_id] : -1;
+    }
+    return sector_id;
+}
+// ---------------------------------
+// mark the inode map sector of the inode as dirty
+// ---------------------------------
+void mark_inode_map_dirty(int sector_id) {
+    int sector = sector_id / (SECTOR_SIZE / 4);
+    INODE_CACHE->inode_map_dirty[sector >> 6] |= 1ULL << (sector & 63);
+}
+// ---------------------------------
+// the sector the inode is written to: its own one, or in the log-structured layout a new
+// one at the head of the log, the old one is freed
+// return -1 if the disk is full
+// ---------------------------------
+int relocate_inode(int sector_id) {
+    if (!LOG_STRUCTURED) {
+        return sector_id;
+    }
+    int length;
+    lock_bitmap();
+    int location = search_log_run(1, &length);
+    if (location != -1) {
+        mark_block_used(location);
+        if (INODE_CACHE->inode_map[sector_id] >= 0) {
+            mark_block_free(INODE_CACHE->inode_map[sector_id]);
+        }
+        INODE_CACHE->inode_map[sector_id] = location;
+        mark_inode_map_dirty(sector_id);
+    }
+    unlock_bitmap();
+    if (location == -1) {
+        fprintf(stderr, "Error: no block for inode %d\n", sector_id);
+    }
+    return location;
+}
+// ---------------------------------
+// write one cached inode back to its sector
+// ---------------------------------
+void write_back_inode(int slot) {
+    char inode_data[256];
+    memcpy(inode_data, &INODE_CACHE->entry[slot].inode, 256);
+    int location = relocate_inode(INODE_CACHE->entry[slot].inode.sector_id);
+    if (location != -1) {
+        write_block(location, inode_data);
+    }
+    INODE_CACHE->entry[slot].dirty = 0;
+}
+// ---------------------------------
+// pick a slot for the inode with CLOCK
+// return -1 if every inode is held
+// ---------------------------------
+int allocate_inode_cache(int sector_id) {
+    int slot = -1;
+    // two sweeps clear every reference bit, so a third finds a victim if there is one
+    for (int i = 0; i < 3 * INODE_CACHE_SIZE; i++) {
+        int k = INODE_CACHE->hand;
+        INODE_CACHE->hand = (INODE_CACHE->hand + 1) % INODE_CACHE_SIZE;
+        if (INODE_CACHE->entry[k].inode.sector_id == -1) {
+            slot = k;
+            break;
+        }
+        if (INODE_CACHE->entry[k].refcount > 0) {
+            continue;
         }
+        if (INODE_CACHE->entry[k].referenced) {
+            INODE_CACHE->entry[k].referenced = 0;
+            continue;
+        }
+        // *the victim is written back under pressure
+        if (INODE_CACHE->entry[k].dirty) {
+            write_back_inode(k);
+        }
+        unlink_inode_cache(k);
+        slot = k;
+        break;
     }
-    return -1;
+    if (slot == -1) {
+        return -1;
+    }
+    int bucket = sector_id % INODE_CACHE_HASH_SIZE;
+    INODE_CACHE->entry[slot].inode.sector_id = sector_id;
+    INODE_CACHE->entry[slot].refcount = 0;
+    INODE_CACHE->entry[slot].dirty = 0;
+    INODE_CACHE->entry[slot].referenced = 1;
+    INODE_CACHE->entry[slot].next = INODE_CACHE->hash[bucket];
+    INODE_CACHE->hash[bucket] = slot;
+    return slot;
+}
+// ---------------------------------
+// get the slot of the inode, reading it on a miss
+// return -1 if the sector is not a used block or every inode is held
+// ---------------------------------
+int load_inode_cache(int sector_id) {
+    if (!inode_number_used(sector_id)) {
+        return -1;
+    }
+    int slot = lookup_inode_cache(sector_id);
+    if (slot != -1) {
+        INODE_CACHE->hit_num++;
+        INODE_CACHE->entry[slot].referenced = 1;
+        return slot;
+    }
+    INODE_CACHE->miss_num++;
+    slot = allocate_inode_cache(sector_id);
+    if (slot == -1) {
+        return -1;
+    }
+    char inode_data[256];
+    memset(inode_data, 0, 256);
+    if (inode_location(sector_id) != -1) {
+        read_block(inode_location(sector_id), inode_data);
+    }
+    memcpy(&INODE_CACHE->entry[slot].inode, inode_data, 256);
+    // the sector may hold anything, the key must stay the sector id
+    INODE_CACHE->entry[slot].inode.sector_id = sector_id;
+    return slot;
+}
+// ---------------------------------
+// take a reference to the cached inode
+// return NULL if it cannot be cached
+// ---------------------------------
+struct Inode* iget(int sector_id) {
+    pthread_mutex_lock(&INODE_CACHE->lock);
+    int slot = load_inode_cache(sector_id);
+    if (slot == -1) {
+        pthread_mutex_unlock(&INODE_CACHE->lock);
+        return NULL;
+    }
+    INODE_CACHE->entry[slot].refcount++;
+    pthread_mutex_unlock(&INODE_CACHE->lock);
+    return &INODE_CACHE->entry[slot].inode;
+}
+// ---------------------------------
+// drop a reference taken by iget
+// ---------------------------------
+void iput(struct Inode* inode) {
+    struct Inode_entry* entry = (struct Inode_entry*)inode;
+    pthread_mutex_lock(&INODE_CACHE->lock);
+    if (entry->refcount > 0) {
+        entry->refcount--;
+    }
+    pthread_mutex_unlock(&INODE_CACHE->lock);
+}
+// ---------------------------------
+// forget the inode of a freed block, its dirty copy must not reach the disk
+// a held inode stays in its slot so the holder's pointer remains valid
+// ---------------------------------
+void drop_inode(int sector_id) {
+    invalidate_bmap(sector_id);
+    pthread_mutex_lock(&INODE_CACHE->lock);
+    int slot = lookup_inode_cache(sector_id);
+    if (slot != -1) {
+        INODE_CACHE->entry[slot].dirty = 0;
+        if (INODE_CACHE->entry[slot].refcount == 0) {
+            unlink_inode_cache(slot);
+        }
+    }
+    pthread_mutex_unlock(&INODE_CACHE->lock);
+}
+// ---------------------------------
+// write all dirty inodes back to the block cache
+// return the number of written inodes
+// ---------------------------------
+int flush_inode_cache() {
+    int dirty_num = 0;
+    pthread_mutex_lock(&INODE_CACHE->lock);
+    for (int i = 0; i < INODE_CACHE_SIZE; i++) {
+        if (INODE_CACHE->entry[i].inode.sector_id != -1 && INODE_CACHE->entry[i].dirty) {
+            write_back_inode(i);
+            dirty_num++;
+        }
+    }
+    pthread_mutex_unlock(&INODE_CACHE->lock);
+    return dirty_num;
+}
+// ---------------------------------
+// the disk has been formatted: no cached inode may be written back
+// ---------------------------------
+void discard_inode_cache() {
+    pthread_mutex_lock(&BMAP_CACHE->lock);
+    reset_bmap_cache();
+    pthread_mutex_unlock(&BMAP_CACHE->lock);
+    pthread_mutex_lock(&INODE_CACHE->lock);
+    for (int i = 0; i < INODE_CACHE_SIZE; i++) {
+        if (INODE_CACHE->entry[i].inode.sector_id != -1 && INODE_CACHE->entry[i].refcount == 0) {
+            unlink_inode_cache(i);
+        }
+        INODE_CACHE->entry[i].dirty = 0;
+    }
+    pthread_mutex_unlock(&INODE_CACHE->lock);
+}
+// ---------------------------------
+// print the inode cache statistics
+// ---------------------------------
+void print_inode_cache_stats(FILE* fp) {
+    long total = INODE_CACHE->hit_num + INODE_CACHE->miss_num;
+    long bmap_total = BMAP_CACHE->hit_num + BMAP_CACHE->miss_num;
+    fprintf(fp, "Inode cache: %ld hits, %ld misses (%.1f%% hit rate)\n",
+            INODE_CACHE->hit_num, INODE_CACHE->miss_num, total == 0 ? 0.0 : 100.0 * INODE_CACHE->hit_num / total);
+    fprintf(fp, "Block map cache: %ld hits, %ld misses (%.1f%% hit rate)\n",
+            BMAP_CACHE->hit_num, BMAP_CACHE->miss_num, bmap_total == 0 ? 0.0 : 100.0 * BMAP_CACHE->hit_num / bmap_total);
 }
 // ---------------------------------
 // get the inode by its sector id
 // ---------------------------------
 int get_inode(int sector_id, struct Inode* inode) {
-    load_bitmap();  // read only
-    if (sector_id < 0 || sector_id >= BLOCK_NUM || block_bitmap[sector_id] == '0') {
+    pthread_mutex_lock(&INODE_CACHE->lock);
+    if (!inode_number_used(sector_id)) {
+        pthread_mutex_unlock(&INODE_CACHE->lock);
         return -1;
     }
-
-    // read the inode data from the disk
-    char inode_data[256];
-    read_block(sector_id, inode_data);
-    memcpy(inode, inode_data, 256);
+    int slot = load_inode_cache(sector_id);
+    // *every inode is held, read around the cache
+    if (slot == -1) {
+        char inode_data[256];
+        memset(inode_data, 0, 256);
+        if (inode_location(sector_id) != -1) {
+            read_block(inode_location(sector_id), inode_data);
+        }
+        memcpy(inode, inode_data, 256);
+    } else {
+        *inode = INODE_CACHE->entry[slot].inode;
+    }
+    pthread_mutex_unlock(&INODE_CACHE->lock);
     return 0;
 }
 // ---------------------------------
-// write back to disk
+// update the cached inode, it is written back by flush_inode_cache
 // ---------------------------------
-int write_inode_to_disk(struct Inode* inode) {
-    // write the inode data to the disk
-    char inode_data[256];
-    memcpy(inode_data, inode, 256);
-    write_block(inode->sector_id, inode_data);
+int update_inode(struct Inode* inode) {
+    pthread_mutex_lock(&INODE_CACHE->lock);
+    int slot = lookup_inode_cache(inode->sector_id);
+    if (slot == -1) {
+        slot = allocate_inode_cache(inode->sector_id);
+    }
+    // *every inode is held, write around the cache
+    if (slot == -1) {
+        char inode_data[256];
+        memcpy(inode_data, inode, 256);
+        int location = relocate_inode(inode->sector_id);
+        if (location != -1) {
+            write_block(location, inode_data);
+        }
+    } else {
+        if (&INODE_CACHE->entry[slot].inode != inode) {
+            INODE_CACHE->entry[slot].inode = *inode;
+        }
+        INODE_CACHE->entry[slot].dirty = 1;
+        INODE_CACHE->entry[slot].referenced = 1;
+    }
+    pthread_mutex_unlock(&INODE_CACHE->lock);
+    return 0;
+}
+// ---------------------------------
+// whether the inode exists
+// ---------------------------------
+int inode_is_used(int sector_id) {
+    pthread_mutex_lock(&INODE_CACHE->lock);
+    int used = inode_number_used(sector_id);
+    pthread_mutex_unlock(&INODE_CACHE->lock);
+    return used;
+}
+// ---------------------------------
+// the sector holding the inode, -1 if it has none
+// ---------------------------------
+int get_inode_location(int sector_id) {
+    pthread_mutex_lock(&INODE_CACHE->lock);
+    int location = inode_number_used(sector_id) ? inode_location(sector_id) : -1;
+    pthread_mutex_unlock(&INODE_CACHE->lock);
+    return location;
+}
+// ---------------------------------
+// take a free inode number of the log-structured layout, the lowest one
+// return -1 if every number is taken
+// ---------------------------------
+int allocate_inode_number() {
+    int sector_id = -1;
+    pthread_mutex_lock(&INODE_CACHE->lock);
+    for (int i = RESERVED_SECTOR_NUM; i < BLOCK_NUM; i++) {
+        if (INODE_CACHE->inode_map[i] == -1) {
+            INODE_CACHE->inode_map[i] = INODE_UNWRITTEN;
+            mark_inode_map_dirty(i);
+            sector_id = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&INODE_CACHE->lock);
+    return sector_id;
+}
+// ---------------------------------
+// free the inode and its sector
+// ---------------------------------
+void free_inode(int sector_id) {
+    drop_inode(sector_id);
+    if (!LOG_STRUCTURED) {
+        mark_block_free(sector_id);
+        return;
+    }
+    pthread_mutex_lock(&INODE_CACHE->lock);
+    if (INODE_CACHE->inode_map[sector_id] >= 0) {
+        mark_block_free(INODE_CACHE->inode_map[sector_id]);
+    }
+    INODE_CACHE->inode_map[sector_id] = -1;
+    mark_inode_map_dirty(sector_id);
+    pthread_mutex_unlock(&INODE_CACHE->lock);
+}
+// ---------------------------------
+// the disk has been formatted: every inode number is free
+// ---------------------------------
+void reset_inode_map() {
+    pthread_mutex_lock(&INODE_CACHE->lock);
+    for (int i = 0; i < BLOCK_NUM; i++) {
+        INODE_CACHE->inode_map[i] = -1;
+    }
+    for (int i = 0; i < INODE_MAP_SECTOR_NUM; i++) {
+        INODE_CACHE->inode_map_dirty[i >> 6] |= 1ULL << (i & 63);
+    }
+    pthread_mutex_unlock(&INODE_CACHE->lock);
+}
+// ---------------------------------
+// store the dirty sectors of the inode map
+// ---------------------------------
+int store_inode_map() {
+    int sector_id[INODE_MAP_SECTOR_NUM + 1];
+    char data[(INODE_MAP_SECTOR_NUM + 1) * 256];
+    int dirty_num = 0;
+    pthread_mutex_lock(&INODE_CACHE->lock);
+    for (int i = 0; i < INODE_MAP_SECTOR_NUM; i++) {
+        if (INODE_CACHE->inode_map_dirty[i >> 6] & (1ULL << (i & 63))) {
+            sector_id[dirty_num] = INODE_MAP_START + i;
+            memcpy(data + dirty_num * 256, (char*)INODE_CACHE->inode_map + i * 256, 256);
+            dirty_num++;
+        }
+    }
+    write_blocks(sector_id, dirty_num, data);
+    memset(INODE_CACHE->inode_map_dirty, 0, sizeof(INODE_CACHE->inode_map_dirty));
+    pthread_mutex_unlock(&INODE_CACHE->lock);
     return 0;
 }
 // ---------------------------------
+// load the inode map
+// ---------------------------------
+int load_inode_map() {
+    if (!LOG_STRUCTURED) {
+        return 0;
+    }
+    int sector_id[INODE_MAP_SECTOR_NUM + 1];
+    for (int i = 0; i < INODE_MAP_SECTOR_NUM; i++) {
+        sector_id[i] = INODE_MAP_START + i;
+    }
+    pthread_mutex_lock(&INODE_CACHE->lock);
+    read_blocks(sector_id, INODE_MAP_SECTOR_NUM, (char*)INODE_CACHE->inode_map);
+    memset(INODE_CACHE->inode_map_dirty, 0, sizeof(INODE_CACHE->inode_map_dirty));
+    pthread_mutex_unlock(&INODE_CACHE->lock);
+    return 0;
+}
+
+// ---------------------------------
+// Shared state
+// ---------------------------------
+// the sessions share one copy of the bitmap, the block cache, the inode cache, the journal
+// and the locks: init_shared_state maps them shared, so they stay one copy for the worker
+// threads of the server and for any process forked from it
+// ---------------------------------
+// lock manager: a command takes its locks once, in begin_command and lock_inode, and
+// end_command releases them, always in the order namespace lock, inode lock, then the
+// short internal locks of the bitmap and the caches
+// namespace_lock: a command that adds, removes or formats names holds it exclusive, every
+//                 other command holds it shared, so directories do not change under a lookup
+// inode_lock: a reader of a file holds the lock of its inode shared and a writer holds it
+//             exclusive; INODE_LOCK_NUM locks are striped over the inode sector ids
+// append_slot: atomic appenders hold the inode lock shared and reserve their ranges in the
+//              slot of the inode, striped like inode_lock, see append_file_atomic
+// ---------------------------------
+#ifndef INODE_LOCK_NUM
+#define INODE_LOCK_NUM 256
+#endif
+struct Append_slot {
+    pthread_mutex_t lock;
+    int inode_id;  // inode whose appends are pending
+    int end;       // end of the last reserved range
+    int pending;   // appends that reserved a range and have not finished
+};
+struct Shared_state {
+    struct Bitmap_state bitmap;
+    struct Block_cache_state block_cache;
+    struct Inode_cache_state inode_cache;
+    struct Bmap_cache_state bmap_cache;
+    struct Journal_state journal;
+    pthread_rwlock_t namespace_lock;
+    pthread_rwlock_t inode_lock[INODE_LOCK_NUM];
+    struct Append_slot append_slot[INODE_LOCK_NUM];
+};
+struct Shared_state* SHARED_STATE = NULL;
+// metadata blocks a command may dirty besides the extent tree of its file: the inode, a
+// pair of directory blocks with their tree path, a new inode, the bitmap and the inode map
+#ifndef COMMAND_META_NUM
+#define COMMAND_META_NUM 24
+#endif
+#if COMMAND_META_NUM + 3 * (1 + EXTENT_INDEX_NUM) > JOURNAL_META_MAX
+#error "the journal cannot hold the metadata of one command"
+#endif
+// the locks and the journal credits this thread holds for its command
+__thread int command_active = 0;
+__thread int command_exclusive = 0;
+__thread int command_credit = 0;
+__thread pthread_rwlock_t* command_inode_lock = NULL;
+// ---------------------------------
+// map and initial the shared state
+// ---------------------------------
+int init_shared_state() {
+    SHARED_STATE = (struct Shared_state*)mmap(NULL, sizeof(struct Shared_state), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (SHARED_STATE == MAP_FAILED) {
+        SHARED_STATE = NULL;
+        return -1;
+    }
+    BITMAP = &SHARED_STATE->bitmap;
+    BLOCK_CACHE = &SHARED_STATE->block_cache;
+    INODE_CACHE = &SHARED_STATE->inode_cache;
+    BMAP_CACHE = &SHARED_STATE->bmap_cache;
+    JOURNAL = &SHARED_STATE->journal;
+    // *the internal locks, the bitmap one may be taken again by its holder
+    pthread_mutexattr_t mutex_attr;
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&BLOCK_CACHE->lock, &mutex_attr);
+    pthread_mutex_init(&INODE_CACHE->lock, &mutex_attr);
+    pthread_mutex_init(&BMAP_CACHE->lock, &mutex_attr);
+    pthread_mutex_init(&JOURNAL->lock, &mutex_attr);
+    for (int i = 0; i < INODE_LOCK_NUM; i++) {
+        pthread_mutex_init(&SHARED_STATE->append_slot[i].lock, &mutex_attr);
+    }
+    pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&BITMAP->lock, &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&JOURNAL->group_done, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    // *the command locks, a waiting writer keeps new readers out so it cannot starve
+    pthread_rwlockattr_t rwlock_attr;
+    pthread_rwlockattr_init(&rwlock_attr);
+    pthread_rwlockattr_setpshared(&rwlock_attr, PTHREAD_PROCESS_SHARED);
+    pthread_rwlockattr_setkind_np(&rwlock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&SHARED_STATE->namespace_lock, &rwlock_attr);
+    for (int i = 0; i < INODE_LOCK_NUM; i++) {
+        pthread_rwlock_init(&SHARED_STATE->inode_lock[i], &rwlock_attr);
+    }
+    pthread_rwlockattr_destroy(&rwlock_attr);
+    reset_block_cache();
+    reset_inode_cache();
+    return 0;
+}
+// ---------------------------------
+// journal handles, see journal.h
+// a command starts its handle before it takes a lock, so a full group never waits for a
+// command that waits for a lock
+// credit: the metadata blocks the command may dirty; a handle starts only while they fit
+// in the ring beside the uncommitted metadata and the credits of the running handles,
+// otherwise the group is closed, and committed once its last handle stops
+// ---------------------------------
+void journal_commit();
+void journal_start(int credit) {
+    pthread_mutex_lock(&JOURNAL->lock);
+    while (JOURNAL->locked || credit > JOURNAL_META_MAX - block_cache_unlogged_num() - JOURNAL->credit_num) {
+        if (!JOURNAL->locked) {
+            JOURNAL->locked = 1;
+            journal_commit();
+            continue;
+        }
+        pthread_cond_wait(&JOURNAL->group_done, &JOURNAL->lock);
+    }
+    JOURNAL->active++;
+    JOURNAL->credit_num += credit;
+    pthread_mutex_unlock(&JOURNAL->lock);
+}
+// ---------------------------------
+// commit the group when no command is running, the caller holds JOURNAL->lock
+// ---------------------------------
+void journal_commit() {
+    if (JOURNAL->active == 0) {
+        commit_block_cache();
+        release_freed_blocks();
+        JOURNAL->group_num = 0;
+        JOURNAL->locked = 0;
+        pthread_cond_broadcast(&JOURNAL->group_done);
+    }
+}
+// ---------------------------------
+// end the handle of a command, handle is 0 outside a command
+// ---------------------------------
+void journal_stop(int handle, int credit) {
+    pthread_mutex_lock(&JOURNAL->lock);
+    if (handle) {
+        JOURNAL->active--;
+        JOURNAL->credit_num -= credit;
+        // *a full group, a cache full of its metadata, or a ring with no room for another
+        //  command lets the running commands finish
+        if (++JOURNAL->group_num >= JOURNAL_GROUP_NUM || block_cache_grown() ||
+            JOURNAL_META_MAX - block_cache_unlogged_num() - JOURNAL->credit_num < COMMAND_META_NUM) {
+            JOURNAL->locked = 1;
+        }
+    }
+    journal_commit();
+    pthread_mutex_unlock(&JOURNAL->lock);
+}
+// ---------------------------------
+// command boundaries
+// every FS command runs between begin_command and end_command; at the end the dirty
+// inodes and the dirty bitmap sectors are written to the block cache, and the journal
+// commits the group once its last command ends
+// end_command outside a command commits when no command is running
+// exclusive: the command changes the namespace
+// write: the command may change metadata, it takes COMMAND_META_NUM credits, and
+//        lock_file takes more for the extent tree of the file
+// ---------------------------------
+void start_command(int exclusive, int credit) {
+    if (command_active) {
+        return;
+    }
+    journal_start(credit);
+    if (exclusive) {
+        pthread_rwlock_wrlock(&SHARED_STATE->namespace_lock);
+    } else {
+        pthread_rwlock_rdlock(&SHARED_STATE->namespace_lock);
+    }
+    command_active = 1;
+    command_exclusive = exclusive;
+    command_credit = credit;
+}
+void begin_command(int exclusive, int write) {
+    start_command(exclusive, write ? COMMAND_META_NUM : 0);
+}
+void end_command() {
+    flush_inode_cache();
+    store_inode_map();
+    store_bitmap();
+    if (command_inode_lock != NULL) {
+        pthread_rwlock_unlock(command_inode_lock);
+        command_inode_lock = NULL;
+    }
+    int handle = command_active;
+    if (command_active) {
+        command_active = 0;
+        pthread_rwlock_unlock(&SHARED_STATE->namespace_lock);
+    }
+    journal_stop(handle, command_credit);
+    command_credit = 0;
+}
+// ---------------------------------
+// end the command and start it again with credit credits, nothing it changed is lost
+// ---------------------------------
+void restart_command(int credit) {
+    int exclusive = command_exclusive;
+    end_command();
+    start_command(exclusive, credit);
+}
+// ---------------------------------
+// take extra credits for the running command without waiting
+// return -1 if the ring has no room for them
+// ---------------------------------
+int extend_command(int extra) {
+    int result = -1;
+    pthread_mutex_lock(&JOURNAL->lock);
+    if (extra <= JOURNAL_META_MAX - block_cache_unlogged_num() - JOURNAL->credit_num) {
+        JOURNAL->credit_num += extra;
+        command_credit += extra;
+        result = 0;
+    }
+    pthread_mutex_unlock(&JOURNAL->lock);
+    return result;
+}
+// ---------------------------------
+// commit what the running command has changed so far
+// only a command holding the namespace exclusive may, the other running handles wait for
+// the namespace lock and have changed nothing
+// ---------------------------------
+void commit_running_command() {
+    flush_inode_cache();
+    store_inode_map();
+    store_bitmap();
+    pthread_mutex_lock(&JOURNAL->lock);
+    commit_block_cache();
+    release_freed_blocks();
+    JOURNAL->credit_num -= command_credit;
+    command_credit = 0;
+    pthread_mutex_unlock(&JOURNAL->lock);
+}
+// ---------------------------------
+// make room in the ring for n more metadata blocks of a long command, such as rmdir or
+// the cleaner; a command holding the namespace exclusive commits what it has changed when
+// the ring is short of room
+// return -1 if there is no room
+// ---------------------------------
+int make_command_room(int n) {
+    if (!command_active) {
+        return 0;
+    }
+    if (extend_command(n) == 0) {
+        return 0;
+    }
+    if (!command_exclusive) {
+        return -1;
+    }
+    commit_running_command();
+    return extend_command(n);
+}
+// ---------------------------------
+// lock the inode for the rest of the command, one inode per command
+// write: the command changes the inode or its data
+// ---------------------------------
+void lock_inode(int sector_id, int write) {
+    if (!command_active || command_inode_lock != NULL || sector_id < 0) {
+        return;
+    }
+    command_inode_lock = &SHARED_STATE->inode_lock[sector_id % INODE_LOCK_NUM];
+    if (write) {
+        pthread_rwlock_wrlock(command_inode_lock);
+    } else {
+        pthread_rwlock_rdlock(command_inode_lock);
+    }
+}
+// ---------------------------------
 // init a new inode without apllying for a new block
 // ---------------------------------
 int initial_inode(struct Inode* inode, uint32_t sector_id, uint32_t pre_inode_sector_id, uint32_t file_type) {
+    memset(inode, 0, sizeof(struct Inode));
     inode->file_size = 0;
     inode->sector_id = sector_id;
     inode->pre_inode_sector_id = pre_inode_sector_id;
     inode->file_type = file_type;
     inode->block_num = 0;
     inode->name_inode = -1;
-    for (int i = 0; i < 40; i++) {
-        inode->direct_block[i] = -1;
-    }
-    for (int i = 0; i < 10; i++) {
-        inode->indirect_block[i] = -1;
-    }
-    for (int i = 0; i < 8; i++) {
-        inode->double_indirect_block[i] = -1;
-    }
-    write_inode_to_disk(inode);
+    inode->extent_num = 0;
+    inode->extent_tree = -1;
+    update_inode(inode);
     return 0;
 }
 // ---------------------------------
 // init a new inode with apllying for a new block
 // ---------------------------------
 int init_new_inode(struct Inode* inode, int* sector_id, int pre_inode_sector_id, int file_type) {
+    // *log-structured: only a number, the inode gets its sector when it is written back
+    if (LOG_STRUCTURED) {
+        *sector_id = allocate_inode_number();
+        if (*sector_id == -1) {
+            return -1;
+        }
+        initial_inode(inode, *sector_id, pre_inode_sector_id, file_type);
+        update_inode(inode);
+        return 0;
+    }
     // if there is no free block
-    *sector_id = find_free_block();
+    lock_bitmap();
+    *sector_id = find_inode_block(pre_inode_sector_id, file_type);
     if (*sector_id == -1) {
+        unlock_bitmap();
         return -1;
     }
     // update the block bitmap
-    block_bitmap[*sector_id] = '1';
-    store_bitmap();
+    mark_block_used(*sector_id);
+    unlock_bitmap();
     // write the inode data to the disk
     initial_inode(inode, *sector_id, pre_inode_sector_id, file_type);
-    write_inode_to_disk(inode);
+    update_inode(inode);
     return 0;
 }
 // ---------------------------------
-// get the i th sector index of the inode file
+// the bytes the partial last block of the extent misses
 // ---------------------------------
-int get_sector_id(struct Inode* inode, int index, int* sector_id) {
-    if (index >= inode->block_num) {
+int extent_gap(struct Extent* extent) {
+    return extent->tail == 0 ? 0 : 256 - extent->tail;
+}
+// ---------------------------------
+// whether the content of the file lives in the inode
+// ---------------------------------
+int has_inline_data(struct Inode* inode) {
+    return inode->file_type == 0 && inode->block_num == 0;
+}
+// ---------------------------------
+// read the k th extent of the inode
+// ---------------------------------
+int read_extent(struct Inode* inode, int k, struct Extent* extent) {
+    if (k < 0 || k >= inode->extent_num) {
+        return -1;
+    }
+    if (k < INLINE_EXTENT_NUM) {
+        *extent = inode->extent[k];
+        return 0;
+    }
+    // *the extent is in a leaf of the extent tree
+    struct Extent_index index[EXTENT_INDEX_NUM];
+    struct Extent_leaf leaf;
+    read_block(inode->extent_tree, (char*)index);
+    read_block(index[(k - INLINE_EXTENT_NUM) / LEAF_EXTENT_NUM].sector_id, (char*)&leaf);
+    *extent = leaf.extent[(k - INLINE_EXTENT_NUM) % LEAF_EXTENT_NUM];
+    return 0;
+}
+// ---------------------------------
+// write the k th extent of the inode
+// the inode itself is not written
+// ---------------------------------
+int write_extent(struct Inode* inode, int k, struct Extent* extent) {
+    if (k < 0 || k >= inode->extent_num) {
         return -1;
     }
-    // if the index is in the direct block
-    if (index < 40) {
-        // read the data from the direct block
-        *sector_id = inode->direct_block[index];
+    invalidate_bmap(inode->sector_id);
+    if (k < INLINE_EXTENT_NUM) {
+        inode->gap_bytes += extent_gap(extent) - extent_gap(&inode->extent[k]);
+        inode->extent[k] = *extent;
         return 0;
     }
-    // if the index is in the first-level indirect block
-    if (index < 40 + 64 * 10) {
-        // read the data from the first-level indirect block
-        int indirect_index = index - 40;
-        int first_index = indirect_index / 64;
-        int second_index = indirect_index % 64;
-        char indirect_data[256];
-        read_block(inode->indirect_block[first_index], indirect_data);
-        int* indirect_block = (int*)indirect_data;
-        *sector_id = indirect_block[second_index];
+    // *the extent is in a leaf of the extent tree
+    struct Extent_index index[EXTENT_INDEX_NUM];
+    struct Extent_leaf leaf;
+    read_block(inode->extent_tree, (char*)index);
+    int leaf_id = index[(k - INLINE_EXTENT_NUM) / LEAF_EXTENT_NUM].sector_id;
+    read_block(leaf_id, (char*)&leaf);
+    inode->gap_bytes += extent_gap(extent) - extent_gap(&leaf.extent[(k - INLINE_EXTENT_NUM) % LEAF_EXTENT_NUM]);
+    leaf.extent[(k - INLINE_EXTENT_NUM) % LEAF_EXTENT_NUM] = *extent;
+    write_block(leaf_id, (char*)&leaf);
+    return 0;
+}
+// ---------------------------------
+// find the extent holding the index th block in a sorted array of extents
+// ---------------------------------
+int search_extent(struct Extent* extent, int extent_num, int index) {
+    int low = 0;
+    int high = extent_num - 1;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if (extent[mid].logical <= index) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+// ---------------------------------
+// Block map iterator
+// ---------------------------------
+// resolves the blocks first .. first + count - 1 of an inode as runs of consecutive
+// sectors; the extent tree index block and every leaf are read at most once per range
+//
+//     struct Bmap_iterator it;
+//     int index, sector_id, length;
+//     bmap_begin(&it, inode, first, count);
+//     while (bmap_next(&it, &index, &sector_id, &length)) {
+//         // blocks index .. index + length - 1 live in sector_id .. sector_id + length - 1
+//     }
+// ---------------------------------
+struct Bmap_iterator {
+    struct Inode* inode;
+    int index;                                        // next block to resolve
+    int end;                                          // one past the last block
+    int k;                                            // extent holding index
+    struct Extent extent;                             // extent k
+    int index_loaded;                                 // index_block has been read
+    int leaf_loaded;                                  // leaf number held in leaf, -1 if none
+    struct Extent_index index_block[EXTENT_INDEX_NUM];
+    struct Extent_leaf leaf;
+};
+// ---------------------------------
+// load the k th extent into the iterator
+// ---------------------------------
+void bmap_load_extent(struct Bmap_iterator* it, int k) {
+    struct Inode* inode = it->inode;
+    it->k = k;
+    if (k < INLINE_EXTENT_NUM) {
+        it->extent = inode->extent[k];
+        return;
+    }
+    int leaf_number = (k - INLINE_EXTENT_NUM) / LEAF_EXTENT_NUM;
+    if (!it->index_loaded) {
+        read_block(inode->extent_tree, (char*)it->index_block);
+        it->index_loaded = 1;
+    }
+    if (it->leaf_loaded != leaf_number) {
+        read_block(it->index_block[leaf_number].sector_id, (char*)&it->leaf);
+        it->leaf_loaded = leaf_number;
+    }
+    it->extent = it->leaf.extent[(k - INLINE_EXTENT_NUM) % LEAF_EXTENT_NUM];
+}
+// ---------------------------------
+// start resolving count blocks from first
+// return -1 if first is not a block of the inode
+// ---------------------------------
+int bmap_begin(struct Bmap_iterator* it, struct Inode* inode, int first, int count) {
+    it->inode = inode;
+    it->index = first;
+    it->end = first + count < inode->block_num ? first + count : inode->block_num;
+    it->index_loaded = 0;
+    it->leaf_loaded = -1;
+    if (first < 0 || first >= inode->block_num || inode->extent_num == 0) {
+        it->end = first;
+        return -1;
+    }
+    // *the extent this inode resolved last time
+    struct Bmap_entry* entry = &BMAP_CACHE->entry[inode->sector_id % BMAP_CACHE_SIZE];
+    pthread_mutex_lock(&BMAP_CACHE->lock);
+    if (entry->inode_sector_id == inode->sector_id && entry->extent.logical <= first &&
+        first < entry->extent.logical + entry->extent.length) {
+        BMAP_CACHE->hit_num++;
+        it->k = entry->k;
+        it->extent = entry->extent;
+        pthread_mutex_unlock(&BMAP_CACHE->lock);
         return 0;
     }
-    // if the index is in the second-level indirect block
-    if (index < 40 + 64 * 10 + 64 * 64 * 8) {
-        // read the data from the second-level indirect block
-        int indirect_index = index - 40 - 64 * 10;
-        int first_index = indirect_index / 64 / 64;
-        int second_index = indirect_index / 64 % 64;
-        int third_index = indirect_index % 64;
-        char indirect_data[256];
-        read_block(inode->double_indirect_block[first_index], indirect_data);
-        int* double_indirect_block = (int*)indirect_data;
-        read_block(double_indirect_block[second_index], indirect_data);
-        int* indirect_block = (int*)indirect_data;
-        *sector_id = indirect_block[third_index];
+    BMAP_CACHE->miss_num++;
+    pthread_mutex_unlock(&BMAP_CACHE->lock);
+    // *the inline extents
+    int inline_num = inode->extent_num < INLINE_EXTENT_NUM ? inode->extent_num : INLINE_EXTENT_NUM;
+    struct Extent* last = &inode->extent[inline_num - 1];
+    if (first < last->logical + last->length) {
+        bmap_load_extent(it, search_extent(inode->extent, inline_num, first));
+    }
+    // *the extent tree: the index block, then one leaf
+    else {
+        read_block(inode->extent_tree, (char*)it->index_block);
+        it->index_loaded = 1;
+        int leaf_num = (inode->extent_num - INLINE_EXTENT_NUM + LEAF_EXTENT_NUM - 1) / LEAF_EXTENT_NUM;
+        int low = 0;
+        int high = leaf_num - 1;
+        while (low < high) {
+            int mid = (low + high + 1) / 2;
+            if (it->index_block[mid].first_logical <= first) {
+                low = mid;
+            } else {
+                high = mid - 1;
+            }
+        }
+        read_block(it->index_block[low].sector_id, (char*)&it->leaf);
+        it->leaf_loaded = low;
+        int leaf_extent_num = inode->extent_num - INLINE_EXTENT_NUM - low * LEAF_EXTENT_NUM;
+        if (leaf_extent_num > LEAF_EXTENT_NUM) {
+            leaf_extent_num = LEAF_EXTENT_NUM;
+        }
+        bmap_load_extent(it, INLINE_EXTENT_NUM + low * LEAF_EXTENT_NUM + search_extent(it->leaf.extent, leaf_extent_num, first));
+    }
+    pthread_mutex_lock(&BMAP_CACHE->lock);
+    entry->inode_sector_id = inode->sector_id;
+    entry->k = it->k;
+    entry->extent = it->extent;
+    pthread_mutex_unlock(&BMAP_CACHE->lock);
+    return 0;
+}
+// ---------------------------------
+// get the next run of consecutive sectors
+// return 0 when the range is done
+// ---------------------------------
+int bmap_next(struct Bmap_iterator* it, int* index, int* sector_id, int* length) {
+    if (it->index >= it->end) {
         return 0;
     }
-    return -1;
+    if (it->index >= it->extent.logical + it->extent.length) {
+        bmap_load_extent(it, it->k + 1);
+    }
+    int offset = it->index - it->extent.logical;
+    *index = it->index;
+    *sector_id = it->extent.start == EXTENT_HOLE ? EXTENT_HOLE : it->extent.start + offset;
+    *length = it->extent.length - offset;
+    if (*length > it->end - it->index) {
+        *length = it->end - it->index;
+    }
+    it->index += *length;
+    return 1;
+}
+// ---------------------------------
+// get the i th sector index of the inode file, EXTENT_HOLE in a hole
+// ---------------------------------
+int get_sector_id(struct Inode* inode, int index, int* sector_id) {
+    struct Bmap_iterator it;
+    int length;
+    if (bmap_begin(&it, inode, index, 1) == -1) {
+        *sector_id = -1;
+        return -1;
+    }
+    bmap_next(&it, &index, sector_id, &length);
+    return 0;
+}
+// ---------------------------------
+// get the sector ids of count blocks from first, EXTENT_HOLE for the blocks of a hole
+// return the number of resolved blocks
+// ---------------------------------
+int get_sector_ids(struct Inode* inode, int first, int count, int* sector_id) {
+    struct Bmap_iterator it;
+    int index, start, length;
+    int resolved = 0;
+    bmap_begin(&it, inode, first, count);
+    while (bmap_next(&it, &index, &start, &length)) {
+        for (int i = 0; i < length; i++) {
+            sector_id[resolved++] = start == EXTENT_HOLE ? EXTENT_HOLE : start + i;
+        }
+    }
+    return resolved;
 }
 // ---------------------------------
 // write inode data (256 bytes in one time)
@@ -242,7 +1306,7 @@ int write_inode(struct Inode* inode, int index, char* inode_data) {
     // write the inode data to the disk
     int sector_id;
     int flag = get_sector_id(inode, index, &sector_id);
-    if (flag == -1 || sector_id < 0 || block_bitmap[sector_id] == '0') {
+    if (flag == -1 || sector_id < 0 || !block_is_used(sector_id)) {
         return -1;
     }
     write_block(sector_id, inode_data);
@@ -258,104 +1322,235 @@ int read_inode(struct Inode* inode, int index, char* inode_data) {
     // read the inode data from the disk
     int sector_id;
     int flag = get_sector_id(inode, index, &sector_id);
-    load_bitmap();
-    if (flag == -1 || sector_id < 0 || block_bitmap[sector_id] == '0') {
+    if (flag == -1 || sector_id < 0 || !block_is_used(sector_id)) {
         return -1;
     }
     read_block(sector_id, inode_data);
     return 0;
 }
 
+// ---------------------------------
+// append an extent after the last one, growing the extent tree when needed
+// ---------------------------------
+int append_extent(struct Inode* inode, struct Extent* extent) {
+    int k = inode->extent_num;
+    if (k >= MAX_EXTENT_NUM) {
+        return -1;
+    }
+    invalidate_bmap(inode->sector_id);
+    if (k < INLINE_EXTENT_NUM) {
+        inode->extent[k] = *extent;
+        inode->extent_num++;
+        inode->gap_bytes += extent_gap(extent);
+        return 0;
+    }
+    // *the first extent out of the inode needs the index block
+    struct Extent_index index[EXTENT_INDEX_NUM];
+    if (inode->extent_tree == -1) {
+        lock_bitmap();
+        int index_id = search_new_block(inode->sector_id);
+        if (index_id != -1) {
+            mark_block_used(index_id);
+        }
+        unlock_bitmap();
+        if (index_id == -1) {
+            return -1;
+        }
+        for (int i = 0; i < EXTENT_INDEX_NUM; i++) {
+            index[i].first_logical = -1;
+            index[i].sector_id = -1;
+        }
+        inode->extent_tree = index_id;
+    } else {
+        read_block(inode->extent_tree, (char*)index);
+    }
+    // *a full leaf needs a new one
+    int leaf_index = (k - INLINE_EXTENT_NUM) / LEAF_EXTENT_NUM;
+    int position = (k - INLINE_EXTENT_NUM) % LEAF_EXTENT_NUM;
+    struct Extent_leaf leaf;
+    if (position == 0) {
+        lock_bitmap();
+        int leaf_id = search_new_block(inode->sector_id);
+        if (leaf_id != -1) {
+            mark_block_used(leaf_id);
+        }
+        unlock_bitmap();
+        if (leaf_id == -1) {
+            // the index block allocated above is released again
+            if (k == INLINE_EXTENT_NUM) {
+                mark_block_free(inode->extent_tree);
+                inode->extent_tree = -1;
+            }
+            return -1;
+        }
+        memset(&leaf, 0, sizeof(leaf));
+        index[leaf_index].first_logical = extent->logical;
+        index[leaf_index].sector_id = leaf_id;
+        write_block(inode->extent_tree, (char*)index);
+    } else {
+        read_block(index[leaf_index].sector_id, (char*)&leaf);
+    }
+    leaf.extent[position] = *extent;
+    write_block(index[leaf_index].sector_id, (char*)&leaf);
+    inode->extent_num++;
+    inode->gap_bytes += extent_gap(extent);
+    return 0;
+}
+// ---------------------------------
+// remove the last extent, shrinking the extent tree when needed
+// ---------------------------------
+int remove_tail_extent(struct Inode* inode) {
+    int k = inode->extent_num - 1;
+    if (k < 0) {
+        return -1;
+    }
+    struct Extent last;
+    read_extent(inode, k, &last);
+    inode->gap_bytes -= extent_gap(&last);
+    invalidate_bmap(inode->sector_id);
+    inode->extent_num--;
+    if (k < INLINE_EXTENT_NUM) {
+        return 0;
+    }
+    // *an empty leaf is released, and the index block with the last leaf
+    int position = (k - INLINE_EXTENT_NUM) % LEAF_EXTENT_NUM;
+    if (position == 0) {
+        struct Extent_index index[EXTENT_INDEX_NUM];
+        int leaf_index = (k - INLINE_EXTENT_NUM) / LEAF_EXTENT_NUM;
+        read_block(inode->extent_tree, (char*)index);
+        mark_block_free(index[leaf_index].sector_id);
+        index[leaf_index].first_logical = -1;
+        index[leaf_index].sector_id = -1;
+        if (leaf_index == 0) {
+            mark_block_free(inode->extent_tree);
+            inode->extent_tree = -1;
+        } else {
+            write_block(inode->extent_tree, (char*)index);
+        }
+    }
+    return 0;
+}
 // ---------------------------------
 // initialize new block
+// the block right after the last one is preferred, so the file stays in few extents
 // ---------------------------------
 int init_new_block(struct Inode* inode, int* sector_id) {
-    // if there is no free block
-    if (inode->block_num >= 40 + 64 * 10 + 64 * 64 * 8) {
-        return -1;
+    // the block after the last extent, or after the inode for an empty file or a hole
+    struct Extent last;
+    int goal = inode->sector_id + 1;
+    int has_last = read_extent(inode, inode->extent_num - 1, &last) == 0 && last.start != EXTENT_HOLE;
+    if (has_last) {
+        goal = last.start + last.length;
     }
-    // find the first free block
-    inode->block_num++;
-    *sector_id = find_free_block();
+    lock_bitmap();
+    *sector_id = LOG_STRUCTURED ? search_new_block(goal) : search_free_block_from(goal);
     if (*sector_id == -1) {
+        unlock_bitmap();
         return -1;
     }
     // update the block bitmap
-    block_bitmap[*sector_id] = '1';
-    store_bitmap();
-    // write the sector id to the inode
-    // if the index is in the direct block
-    int index = inode->block_num - 1;
-    if (inode->block_num <= 40) {
-        inode->direct_block[index] = *sector_id;
-        write_inode_to_disk(inode);
-        return 0;
+    mark_block_used(*sector_id);
+    unlock_bitmap();
+    // *extend the last extent
+    if (has_last && *sector_id == goal && last.tail == 0) {
+        last.length++;
+        write_extent(inode, inode->extent_num - 1, &last);
     }
-    // if the index is in the first-level indirect block
-    if (inode->block_num <= 40 + 64 * 10) {
-        int indirect_index = index - 40;
-        int first_index = indirect_index / 64;
-        int second_index = indirect_index % 64;
-        // if the indirect block is not initialized, we need to intialize it
-        if (second_index == 0) {
-            inode->indirect_block[first_index] = find_free_block();
-            if (inode->indirect_block[first_index] == -1) {
-                return -1;
-            }
-            block_bitmap[inode->indirect_block[first_index]] = '1';
-            store_bitmap();
-        }
-        // write the sector id to the indirect block
-        char indirect_data[256];
-        read_block(inode->indirect_block[first_index], indirect_data);
-        int* indirect_block = (int*)indirect_data;
-        indirect_block[second_index] = *sector_id;
-        write_block(inode->indirect_block[first_index], indirect_data);
-        write_inode_to_disk(inode);
-        return 0;
+    // *start a new extent
+    else {
+        struct Extent extent;
+        extent.logical = inode->block_num;
+        extent.start = *sector_id;
+        extent.length = 1;
+        extent.tail = 0;
+        if (append_extent(inode, &extent) == -1) {
+            mark_block_free(*sector_id);
+            return -1;
+        }
     }
-    // if the index is in the second-level indirect block
-    if (inode->block_num <= 40 + 64 * 10 + 64 * 64 * 8) {
-        int double_indirect_index = index - 40 - 64 * 10;
-        int first_index = double_indirect_index / 64 / 64;
-        int second_index = double_indirect_index / 64 % 64;
-        int third_index = double_indirect_index % 64;
-        // if the double indirect block is not initialized, we need to intialize it
-        if (second_index == 0 && third_index == 0) {
-            inode->double_indirect_block[first_index] = find_free_block();
-            if (inode->double_indirect_block[first_index] == -1) {
-                return -1;
-            }
-            block_bitmap[inode->double_indirect_block[first_index]] = '1';
-            store_bitmap();
-        }
-        // if the indirect block is not initialized, we need to intialize it
-        if (third_index == 0) {
-            char indirect_data[256];
-            read_block(inode->double_indirect_block[first_index], indirect_data);
-            int* double_indirect_block = (int*)indirect_data;
-            double_indirect_block[second_index] = find_free_block();
-            if (double_indirect_block[second_index] == -1) {
+    inode->block_num++;
+    update_inode(inode);
+    return 0;
+}
+// ---------------------------------
+// append count blocks to the file, allocated in as few runs as the disk allows
+// every run is searched once, marked once and joins the last extent when it follows it,
+// and the inode is updated once at the end
+// output: the sector ids of the new blocks
+// ---------------------------------
+int allocate_blocks(struct Inode* inode, int count, int* sector_id) {
+    int allocated = 0;
+    while (allocated < count) {
+        // the block after the last extent, or after the inode for an empty file or a hole
+        struct Extent last;
+        int goal = inode->sector_id + 1;
+        int has_last = read_extent(inode, inode->extent_num - 1, &last) == 0 && last.start != EXTENT_HOLE;
+        if (has_last) {
+            goal = last.start + last.length;
+        }
+        int length;
+        lock_bitmap();
+        int start = LOG_STRUCTURED ? search_log_run(count - allocated, &length) : search_free_run(goal, count - allocated, &length);
+        if (start == -1) {
+            unlock_bitmap();
+            update_inode(inode);
+            return -1;
+        }
+        // update the block bitmap
+        for (int i = 0; i < length; i++) {
+            mark_block_used(start + i);
+        }
+        unlock_bitmap();
+        // *extend the last extent
+        if (has_last && start == goal && last.tail == 0) {
+            last.length += length;
+            write_extent(inode, inode->extent_num - 1, &last);
+        }
+        // *start a new extent
+        else {
+            struct Extent extent;
+            extent.logical = inode->block_num;
+            extent.start = start;
+            extent.length = length;
+            extent.tail = 0;
+            if (append_extent(inode, &extent) == -1) {
+                for (int i = 0; i < length; i++) {
+                    mark_block_free(start + i);
+                }
+                update_inode(inode);
                 return -1;
             }
-            block_bitmap[double_indirect_block[second_index]] = '1';
-            store_bitmap();
-            write_block(inode->double_indirect_block[first_index], indirect_data);
-        }
-        // write the sector id to the indirect block
-        char indirect_data[256];
-        char double_indirect_data[256];
-        read_block(inode->double_indirect_block[first_index], indirect_data);
-        int* double_indirect_block = (int*)indirect_data;
-        read_block(double_indirect_block[second_index], double_indirect_data);
-        int* indirect_block = (int*)double_indirect_data;
-        indirect_block[third_index] = *sector_id;
-        write_block(double_indirect_block[second_index], double_indirect_data);
-        // write the inode data to the disk
-        write_inode_to_disk(inode);
-        return 0;
+        }
+        for (int i = 0; i < length; i++) {
+            sector_id[allocated++] = start + i;
+        }
+        inode->block_num += length;
     }
-    return -1;
+    update_inode(inode);
+    return 0;
+}
+// ---------------------------------
+// append a hole of count blocks to the file, no block is allocated
+// ---------------------------------
+int append_hole(struct Inode* inode, int count) {
+    struct Extent last;
+    if (read_extent(inode, inode->extent_num - 1, &last) == 0 && last.start == EXTENT_HOLE) {
+        last.length += count;
+        write_extent(inode, inode->extent_num - 1, &last);
+    } else {
+        struct Extent extent;
+        extent.logical = inode->block_num;
+        extent.start = EXTENT_HOLE;
+        extent.length = count;
+        extent.tail = 0;
+        if (append_extent(inode, &extent) == -1) {
+            update_inode(inode);
+            return -1;
+        }
+    }
+    inode->block_num += count;
+    update_inode(inode);
+    return 0;
 }
 // ---------------------------------
 // remove the tail block
@@ -365,75 +1560,59 @@ int remove_tail_block(struct Inode* inode) {
     if (inode->block_num == 0) {
         return -1;
     }
-    // if the index is in the direct block
-    int index = inode->block_num - 1;
-    if (index < 40) {
-        block_bitmap[inode->direct_block[index]] = '0';
-        store_bitmap();
-        inode->direct_block[index] = -1;
-        inode->block_num--;
-        write_inode_to_disk(inode);
-        return 0;
+    struct Extent last;
+    read_extent(inode, inode->extent_num - 1, &last);
+    if (last.start != EXTENT_HOLE) {
+        mark_block_free(last.start + last.length - 1);
     }
-    // if the index is in the first-level indirect block
-    if (index < 40 + 64 * 10) {
-        int indirect_index = index - 40;
-        int first_index = indirect_index / 64;
-        int second_index = indirect_index % 64;
-        char indirect_data[256];
-        read_block(inode->indirect_block[first_index], indirect_data);
-        int* indirect_block = (int*)indirect_data;
-        block_bitmap[indirect_block[second_index]] = '0';
-        store_bitmap();
-        indirect_block[second_index] = -1;
-        write_block(inode->indirect_block[first_index], indirect_data);
-        inode->block_num--;
-        // remove the indirect block
-        if (second_index == 0) {
-            block_bitmap[inode->indirect_block[first_index]] = '0';
-            store_bitmap();
-            inode->indirect_block[first_index] = -1;
-        }
-        write_inode_to_disk(inode);
-        return 0;
+    last.length--;
+    last.tail = 0;
+    if (last.length == 0) {
+        remove_tail_extent(inode);
+    } else {
+        write_extent(inode, inode->extent_num - 1, &last);
     }
-    // if the index is in the second-level indirect block
-    if (index < 40 + 64 * 10 + 64 * 64 * 8) {
-        // get index
-        int double_indirect_index = index - 40 - 64 * 10;
-        int first_index = double_indirect_index / 64 / 64;
-        int second_index = double_indirect_index / 64 % 64;
-        int third_index = double_indirect_index % 64;
-        // char data
-        char indirect_data[256];
-        char double_indirect_data[256];
-        // get the first layer data
-        read_block(inode->double_indirect_block[first_index], indirect_data);
-        int* double_indirect_block = (int*)indirect_data;
-        // get the second layer data
-        read_block(double_indirect_block[second_index], double_indirect_data);
-        int* indirect_block = (int*)double_indirect_data;
-        block_bitmap[indirect_block[third_index]] = '0';
-        store_bitmap();
-        indirect_block[third_index] = -1;
-        write_block(double_indirect_block[second_index], double_indirect_data);
-        inode->block_num--;
-        // remove the double indirect block
-        if (third_index == 0) {
-            block_bitmap[double_indirect_block[second_index]] = '0';
-            store_bitmap();
-            double_indirect_block[second_index] = -1;
-            write_block(inode->double_indirect_block[first_index], indirect_data);
-        }
-        // remove the indirect block
-        if (second_index == 0 && third_index == 0) {
-            block_bitmap[inode->double_indirect_block[first_index]] = '0';
-            store_bitmap();
-            inode->double_indirect_block[first_index] = -1;
-        }
-        write_inode_to_disk(inode);
-        return 0;
+    inode->block_num--;
+    update_inode(inode);
+    return 0;
+}
+// ---------------------------------
+// remove every block from keep on in one pass
+// the extents past keep are freed as runs under one bitmap lock and dropped, the one holding
+// block keep - 1 is cut once, and the inode is updated once
+// ---------------------------------
+int truncate_blocks(struct Inode* inode, int keep) {
+    if (keep < 0 || keep >= inode->block_num) {
+        return keep < 0 ? -1 : 0;
     }
-    return -1;
+    lock_bitmap();
+    while (inode->extent_num > 0) {
+        struct Extent last;
+        read_extent(inode, inode->extent_num - 1, &last);
+        // *the new last extent ends where file_size says
+        if (last.logical + last.length <= keep) {
+            if (last.tail != 0) {
+                last.tail = 0;
+                write_extent(inode, inode->extent_num - 1, &last);
+            }
+            break;
+        }
+        int from = keep > last.logical ? keep - last.logical : 0;
+        for (int i = from; i < last.length && last.start != EXTENT_HOLE; i++) {
+            mark_block_free(last.start + i);
+        }
+        if (from == 0) {
+            remove_tail_extent(inode);
+            continue;
+        }
+        last.length = from;
+        last.tail = 0;
+        write_extent(inode, inode->extent_num - 1, &last);
+        break;
+    }
+    unlock_bitmap();
+    inode->block_num = keep;
+    update_inode(inode);
+    return 0;
 }
-#endif
\ No newline at end of file
+#endif
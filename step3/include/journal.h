@@ -0,0 +1,285 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "block_device.h"
+#include "bitmap.h"
+// ---------------------------------
+// Metadata journal
+// ---------------------------------
+// the superblock follows the bitmap sectors, and the journal, a ring of JOURNAL_SECTOR_NUM
+// sectors, follows the superblock; in the log-structured layout the inode map follows the
+// ring; init_bitmap reserves them all
+// ---------------------------------
+// metadata (the bitmap, inodes, extent blocks and directory blocks) reaches its sector only
+// through the journal: the dirty metadata of a group of commands is written to the ring as
+// one transaction, then stays dirty in the block cache and is checkpointed, written to its
+// own sector, only when the ring has no room for the next transaction
+// file data is not logged: a commit writes it to its sectors before the transaction, so a
+// committed inode never points at blocks that were not written; data over a sector the
+// ring still holds metadata of waits until that copy is checkpointed, or a replay would
+// overwrite it
+// ---------------------------------
+// transaction: descriptor blocks, each followed by the blocks whose sector ids it lists,
+// then a commit block with the checksum of all logged blocks; a transaction is replayed at
+// mount only when its commit block is complete and its sequence is the next one expected
+// ---------------------------------
+// group commit: every command is a handle, journal_start counts it and journal_stop
+// releases it; the group is committed when its last handle stops, since only then is the
+// metadata of every command in it complete; after JOURNAL_GROUP_NUM commands, or once the
+// block cache has grown to hold its metadata, no new handle starts until the group is
+// committed, so a busy server still commits
+// ---------------------------------
+// credits: a transaction must fit in the ring, since metadata may not reach its sector
+// before it is committed; a handle that changes metadata takes credits for the blocks it
+// may dirty, and starts only while the uncommitted metadata and the credits of the running
+// handles fit in JOURNAL_META_MAX blocks, otherwise the group is closed and committed
+// first; see begin_command and lock_file
+// ---------------------------------
+// JOURNAL->lock guards the handles and is held through a commit; the ring position and
+// journal_pos change with the cached blocks, so BLOCK_CACHE->lock guards them
+// ---------------------------------
+#define SUPERBLOCK_SECTOR BITMAP_SECTOR_NUM
+#define JOURNAL_START (SUPERBLOCK_SECTOR + 1)
+#ifndef JOURNAL_SECTOR_NUM
+#define JOURNAL_SECTOR_NUM 128
+#endif
+#define JOURNAL_END (JOURNAL_START + JOURNAL_SECTOR_NUM)
+#define INODE_MAP_START JOURNAL_END
+#define INODE_MAP_SECTOR_NUM (LOG_STRUCTURED ? (BLOCK_NUM * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE : 0)
+#define RESERVED_SECTOR_NUM (INODE_MAP_START + INODE_MAP_SECTOR_NUM)
+#ifndef JOURNAL_GROUP_NUM
+#define JOURNAL_GROUP_NUM 32
+#endif
+#define JOURNAL_MAGIC 0x4a524e4c
+// layout of the disk, the inodes and the extents, a disk of another version is not mounted
+#define FS_VERSION 5
+#define JOURNAL_DESCRIPTOR 1
+#define JOURNAL_COMMIT 2
+#define DESCRIPTOR_BLOCK_NUM 59
+// metadata blocks of the largest transaction, with its descriptors and commit block
+#define JOURNAL_META_MAX ((JOURNAL_SECTOR_NUM - 1) * DESCRIPTOR_BLOCK_NUM / (DESCRIPTOR_BLOCK_NUM + 1))
+// ---------------------------------
+// Superblock
+// size: 256 bytes
+// ---------------------------------
+struct Superblock {
+    uint32_t magic;               // JOURNAL_MAGIC
+    int block_num;                // blocks of the FS
+    int root_sector_id;           // root directory
+    int journal_start;            // first sector of the ring
+    int journal_sector_num;       // sectors of the ring
+    int journal_tail;             // ring position of the oldest transaction to replay
+    uint32_t journal_sequence;    // its sequence
+    int log_structured;           // LOG_STRUCTURED of the FS
+    int version;                  // FS_VERSION of the FS
+    int reserved[55];             // reserved
+};
+// ---------------------------------
+// Descriptor and commit block
+// size: 256 bytes
+// ---------------------------------
+struct Journal_block {
+    uint32_t magic;                           // JOURNAL_MAGIC
+    int type;                                 // JOURNAL_DESCRIPTOR or JOURNAL_COMMIT
+    uint32_t sequence;                        // transaction sequence
+    int count;                                // logged blocks of the descriptor or of the transaction
+    uint32_t checksum;                        // commit: checksum of the logged blocks
+    int sector_id[DESCRIPTOR_BLOCK_NUM];      // descriptor: home sectors of the blocks that follow
+};
+// the journal state lives in the shared state of the sessions
+struct Journal_state {
+    pthread_mutex_t lock;
+    pthread_cond_t group_done;
+    int active;                   // running handles
+    int credit_num;               // credits of the running handles
+    int locked;                   // the group is full, new handles wait
+    int group_num;                // handles of the running group
+    int root_sector_id;
+    // ring, guarded by BLOCK_CACHE->lock
+    int head;                     // ring position of the next transaction
+    int tail;                     // ring position of the oldest live transaction
+    int used;                     // sectors between tail and head
+    uint32_t sequence;            // sequence of the next transaction
+    uint32_t tail_sequence;       // sequence of the transaction at tail
+    int journal_pos[BLOCK_NUM];   // ring position of the last logged copy of every sector, -1 if none
+    // statistics
+    long commit_num;
+    long logged_num;
+    long checkpoint_num;
+};
+struct Journal_state* JOURNAL = NULL;
+// ---------------------------------
+// the sector of a ring position
+// ---------------------------------
+int journal_sector(int pos) {
+    return JOURNAL_START + pos % JOURNAL_SECTOR_NUM;
+}
+// ---------------------------------
+// FNV-1a over a logged block and its home sector
+// ---------------------------------
+uint32_t journal_checksum(uint32_t hash, int sector_id, char* data) {
+    for (int i = 0; i < 4; i++) {
+        hash = (hash ^ ((sector_id >> (i * 8)) & 0xff)) * 16777619u;
+    }
+    for (int i = 0; i < SECTOR_SIZE; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+    }
+    return hash;
+}
+// ---------------------------------
+// whether logged blocks go to sectors of the FS outside the superblock and the ring
+// ---------------------------------
+int journal_home_valid(int* sector_id, int count) {
+    for (int i = 0; i < count; i++) {
+        if (sector_id[i] < 0 || sector_id[i] >= BLOCK_NUM || (sector_id[i] >= SUPERBLOCK_SECTOR && sector_id[i] < JOURNAL_END)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+// ---------------------------------
+// write the superblock to the device
+// ---------------------------------
+int store_superblock() {
+    struct Superblock superblock;
+    memset(&superblock, 0, sizeof(superblock));
+    superblock.magic = JOURNAL_MAGIC;
+    superblock.block_num = BLOCK_NUM;
+    superblock.root_sector_id = JOURNAL->root_sector_id;
+    superblock.journal_start = JOURNAL_START;
+    superblock.journal_sector_num = JOURNAL_SECTOR_NUM;
+    superblock.journal_tail = JOURNAL->tail;
+    superblock.journal_sequence = JOURNAL->tail_sequence;
+    superblock.log_structured = LOG_STRUCTURED;
+    superblock.version = FS_VERSION;
+    return device_write_block(SUPERBLOCK_SECTOR, (char*)&superblock);
+}
+// ---------------------------------
+// empty the ring of a newly formatted disk
+// the old transactions are wiped, so none of them can pass for a new one
+// ---------------------------------
+void reset_journal() {
+    int sector_id[JOURNAL_SECTOR_NUM];
+    char data[JOURNAL_SECTOR_NUM * SECTOR_SIZE];
+    for (int i = 0; i < JOURNAL_SECTOR_NUM; i++) {
+        sector_id[i] = JOURNAL_START + i;
+    }
+    memset(data, 0, sizeof(data));
+    device_write_blocks(sector_id, JOURNAL_SECTOR_NUM, data);
+    JOURNAL->head = 0;
+    JOURNAL->tail = 0;
+    JOURNAL->used = 0;
+    JOURNAL->sequence = 1;
+    JOURNAL->tail_sequence = 1;
+    for (int i = 0; i < BLOCK_NUM; i++) {
+        JOURNAL->journal_pos[i] = -1;
+    }
+    JOURNAL->root_sector_id = -1;
+    store_superblock();
+}
+// ---------------------------------
+// record the root directory of a newly formatted disk
+// ---------------------------------
+void set_journal_root(int root_sector_id) {
+    JOURNAL->root_sector_id = root_sector_id;
+    store_superblock();
+}
+// ---------------------------------
+// read the superblock and replay the committed transactions
+// return the root directory, -2 if the disk has no FS, -1 if it cannot be read or holds an
+// FS of another layout
+// a disk whose format stopped before the root directory was recorded has no FS
+// ---------------------------------
+int mount_journal() {
+    struct Superblock superblock;
+    if (device_read_block(SUPERBLOCK_SECTOR, (char*)&superblock) == -1) {
+        fprintf(stderr, "Error: cannot read the superblock\n");
+        return -1;
+    }
+    if (superblock.magic != JOURNAL_MAGIC || superblock.root_sector_id == -1) {
+        return -2;
+    }
+    if (superblock.version != FS_VERSION || superblock.log_structured != LOG_STRUCTURED) {
+        fprintf(stderr, "Error: the disk holds an FS of version %d%s, this FS is version %d%s\n",
+                superblock.version, superblock.log_structured ? " (log-structured)" : "",
+                FS_VERSION, LOG_STRUCTURED ? " (log-structured)" : "");
+        return -1;
+    }
+    if (superblock.block_num != BLOCK_NUM || superblock.journal_start != JOURNAL_START ||
+        superblock.journal_sector_num != JOURNAL_SECTOR_NUM || superblock.journal_tail < 0 ||
+        superblock.journal_tail >= JOURNAL_SECTOR_NUM || superblock.root_sector_id < 0 || superblock.root_sector_id >= BLOCK_NUM) {
+        fprintf(stderr, "Error: the superblock does not match the layout of this FS\n");
+        return -1;
+    }
+    int pos = superblock.journal_tail;
+    uint32_t sequence = superblock.journal_sequence;
+    int replay_num = 0;
+    int sector_id[JOURNAL_SECTOR_NUM];
+    char data[JOURNAL_SECTOR_NUM * SECTOR_SIZE];
+    while (1) {
+        // *collect the blocks of one transaction
+        int count = 0;
+        int step = 0;
+        uint32_t checksum = 2166136261u;
+        struct Journal_block block;
+        while (step < JOURNAL_SECTOR_NUM) {
+            if (device_read_block(journal_sector(pos + step), (char*)&block) == -1) {
+                fprintf(stderr, "Error: cannot read the journal\n");
+                return -1;
+            }
+            step++;
+            if (block.magic != JOURNAL_MAGIC || block.sequence != sequence || block.type != JOURNAL_DESCRIPTOR ||
+                block.count <= 0 || block.count > DESCRIPTOR_BLOCK_NUM || count + block.count + step > JOURNAL_SECTOR_NUM) {
+                break;
+            }
+            for (int i = 0; i < block.count; i++) {
+                sector_id[count] = block.sector_id[i];
+                if (device_read_block(journal_sector(pos + step), data + count * SECTOR_SIZE) == -1) {
+                    fprintf(stderr, "Error: cannot read the journal\n");
+                    return -1;
+                }
+                checksum = journal_checksum(checksum, sector_id[count], data + count * SECTOR_SIZE);
+                count++;
+                step++;
+            }
+        }
+        // *only a complete transaction is applied
+        if (block.magic != JOURNAL_MAGIC || block.sequence != sequence || block.type != JOURNAL_COMMIT ||
+            block.count != count || block.checksum != checksum || !journal_home_valid(sector_id, count)) {
+            break;
+        }
+        if (device_write_blocks(sector_id, count, data) == -1) {
+            fprintf(stderr, "Error: cannot replay the journal\n");
+            return -1;
+        }
+        pos = (pos + step) % JOURNAL_SECTOR_NUM;
+        sequence++;
+        replay_num++;
+    }
+    if (replay_num > 0) {
+        printf("Journal: replayed %d transactions\n", replay_num);
+    }
+    // *the replayed blocks are on their sectors, the ring starts empty after them
+    JOURNAL->head = pos;
+    JOURNAL->tail = pos;
+    JOURNAL->used = 0;
+    JOURNAL->sequence = sequence;
+    JOURNAL->tail_sequence = sequence;
+    for (int i = 0; i < BLOCK_NUM; i++) {
+        JOURNAL->journal_pos[i] = -1;
+    }
+    JOURNAL->root_sector_id = superblock.root_sector_id;
+    store_superblock();
+    return superblock.root_sector_id;
+}
+// ---------------------------------
+// print the journal statistics
+// ---------------------------------
+void print_journal_stats(FILE* fp) {
+    fprintf(fp, "Journal: %ld commits, %ld logged blocks, %ld checkpoints\n",
+            JOURNAL->commit_num, JOURNAL->logged_num, JOURNAL->checkpoint_num);
+}
+#endif
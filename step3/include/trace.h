@@ -0,0 +1,152 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+// ---------------------------------
+// BDS request trace
+// ---------------------------------
+// header: 16 bytes
+// records: 20 bytes each, in arrival order per client
+// ---------------------------------
+#define TRACE_MAGIC 0x54534442  // "BDST"
+#define TRACE_VERSION 1
+#define TRACE_BUFFER_RECORDS 256
+// buffered records are flushed once they are older than this
+#define TRACE_FLUSH_NS 1000000000ULL
+struct Trace_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t block_size;
+    uint32_t cylinder_num;
+    uint32_t sector_num;
+};
+struct Trace_record {
+    uint64_t timestamp_ns;  // time since the trace was opened
+    uint32_t client;        // connection number
+    uint32_t sector_id;     // sector id of the request
+    uint16_t length;        // bytes transferred
+    uint8_t op;             // 'R' or 'W'
+    uint8_t reserved;
+} __attribute__((packed));
+// ---------------------------------
+// trace writer state
+// every forked client keeps its own buffer and appends whole buffers,
+// so records of one client stay in order and never interleave byte-wise
+// a traced client reads with a timeout of TRACE_FLUSH_NS, so an idle client still flushes
+// by age, and SIGTERM or SIGINT only sets TRACE_STOP and interrupts the read, so the client
+// leaves through its final flush instead of losing its buffer
+// ---------------------------------
+int TRACE_FD = -1;
+uint64_t TRACE_START_NS;
+uint64_t TRACE_LAST_FLUSH_NS;
+struct Trace_record trace_buffer[TRACE_BUFFER_RECORDS];
+int trace_buffer_num = 0;
+volatile sig_atomic_t TRACE_STOP = 0;
+// ---------------------------------
+// monotonic clock in nanoseconds
+// ---------------------------------
+uint64_t trace_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+// ---------------------------------
+// create the trace file and write the header
+// ---------------------------------
+int open_trace(char* file_name, int block_size, int cylinder_num, int sector_num) {
+    TRACE_FD = open(file_name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0666);
+    if (TRACE_FD == -1) {
+        return -1;
+    }
+    struct Trace_header header;
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.block_size = block_size;
+    header.cylinder_num = cylinder_num;
+    header.sector_num = sector_num;
+    if (write(TRACE_FD, &header, sizeof(header)) != sizeof(header)) {
+        close(TRACE_FD);
+        TRACE_FD = -1;
+        return -1;
+    }
+    TRACE_START_NS = trace_now_ns();
+    TRACE_LAST_FLUSH_NS = TRACE_START_NS;
+    return 0;
+}
+// ---------------------------------
+// append the buffered records to the trace file
+// ---------------------------------
+void flush_trace() {
+    if (TRACE_FD == -1 || trace_buffer_num == 0) {
+        return;
+    }
+    int size = trace_buffer_num * sizeof(struct Trace_record);
+    if (write(TRACE_FD, trace_buffer, size) != size) {
+        fprintf(stderr, "Error: cannot write the trace file\n");
+    }
+    trace_buffer_num = 0;
+    TRACE_LAST_FLUSH_NS = trace_now_ns();
+}
+// ---------------------------------
+// record one request
+// the buffer is flushed when it is full or older than one second
+// ---------------------------------
+void record_trace(uint32_t client, char op, uint32_t sector_id, uint16_t length) {
+    if (TRACE_FD == -1) {
+        return;
+    }
+    uint64_t now = trace_now_ns();
+    struct Trace_record* record = &trace_buffer[trace_buffer_num++];
+    record->timestamp_ns = now - TRACE_START_NS;
+    record->client = client;
+    record->sector_id = sector_id;
+    record->length = length;
+    record->op = op;
+    record->reserved = 0;
+    if (trace_buffer_num == TRACE_BUFFER_RECORDS || now - TRACE_LAST_FLUSH_NS > TRACE_FLUSH_NS) {
+        flush_trace();
+    }
+}
+// ---------------------------------
+// flush the buffered records when they are older than TRACE_FLUSH_NS
+// ---------------------------------
+void flush_old_trace() {
+    if (TRACE_FD != -1 && trace_buffer_num > 0 && trace_now_ns() - TRACE_LAST_FLUSH_NS > TRACE_FLUSH_NS) {
+        flush_trace();
+    }
+}
+// ---------------------------------
+// SIGTERM and SIGINT handler of a traced client
+// ---------------------------------
+void stop_trace(int signum) {
+    (void)signum;
+    TRACE_STOP = 1;
+}
+// ---------------------------------
+// make the client on sockfd flush by age and on SIGTERM or SIGINT
+// ---------------------------------
+void watch_trace(int sockfd) {
+    if (TRACE_FD == -1) {
+        return;
+    }
+    // *no SA_RESTART, so the signal interrupts a blocked read
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stop_trace;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+    struct timeval timeout;
+    timeout.tv_sec = TRACE_FLUSH_NS / 1000000000ULL;
+    timeout.tv_usec = TRACE_FLUSH_NS % 1000000000ULL / 1000;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+#endif